@@ -0,0 +1,20 @@
+#!/bin/sh
+# Connections per second at 1, 4 and 16 server I/O threads, with a single
+# acceptor and with one SO_REUSEPORT acceptor per thread.
+#   bench/connection_rate.sh [path/to/replico_bench] [extra replico_bench options]
+# Every request of the connect workload opens a new connection.
+
+BENCH=${1:-./replico_bench}
+[ $# -gt 0 ] && shift
+
+for threads in 1 4 16; do
+    for acceptors in single reuse-port; do
+        args="--nodes=1 --server-threads=$threads"
+        if [ "$acceptors" = reuse-port ]; then
+            args="$args --server-args=--reuse-port"
+        fi
+        printf '{"server_threads": %s, "acceptors": "%s", "result": ' "$threads" "$acceptors"
+        "$BENCH" --workload=connect --concurrency=64 --threads=4 --duration-s=5 $args "$@" | tr -d '\n'
+        printf '}\n'
+    done
+done
@@ -0,0 +1,116 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+// Log-linear latency histogram in the HDR style: every power of two range
+// of nanoseconds is split into SUB_BUCKETS / 2 linear buckets, so a value
+// is reported within 2 / SUB_BUCKETS (1.6%) of itself from 1ns to hours,
+// in constant memory. One instance per thread, merged at the end.
+class LatencyHistogram
+{
+public:
+    static const unsigned SUB_BITS = 7;
+    static const uint64_t SUB_BUCKETS = uint64_t(1) << SUB_BITS;
+
+    LatencyHistogram()
+        : m_counts((64 - SUB_BITS + 2) * (SUB_BUCKETS / 2))
+    {
+    }
+
+    void
+    record(uint64_t ns)
+    {
+        ++m_counts[index(ns)];
+        ++m_count;
+        m_sum += ns;
+        m_max = std::max(m_max, ns);
+    }
+
+    void
+    merge(const LatencyHistogram& other)
+    {
+        for (size_t i = 0; i < m_counts.size(); ++i)
+        {
+            m_counts[i] += other.m_counts[i];
+        }
+        m_count += other.m_count;
+        m_sum += other.m_sum;
+        m_max = std::max(m_max, other.m_max);
+    }
+
+    uint64_t
+    count() const
+    {
+        return m_count;
+    }
+
+    uint64_t
+    max() const
+    {
+        return m_max;
+    }
+
+    double
+    mean() const
+    {
+        return m_count ? double(m_sum) / m_count : 0;
+    }
+
+    // Highest value of the bucket holding the q-th quantile, q in [0, 1]
+    uint64_t
+    quantile(double q) const
+    {
+        if (m_count == 0)
+        {
+            return 0;
+        }
+
+        auto rank = std::max<uint64_t>(1, static_cast<uint64_t>(q * m_count + 0.5));
+        uint64_t seen = 0;
+        for (size_t i = 0; i < m_counts.size(); ++i)
+        {
+            seen += m_counts[i];
+            if (seen >= rank)
+            {
+                return std::min(upper(i), m_max);
+            }
+        }
+        return m_max;
+    }
+
+private:
+    // Values below SUB_BUCKETS are exact, above that each power of two
+    // range [2^k, 2^(k+1)) gets SUB_BUCKETS / 2 buckets of equal width
+    static size_t
+    index(uint64_t ns)
+    {
+        if (ns < SUB_BUCKETS)
+        {
+            return ns;
+        }
+
+        unsigned magnitude = 63 - __builtin_clzll(ns);
+        unsigned shift = magnitude - (SUB_BITS - 1);
+        return shift * (SUB_BUCKETS / 2) + (ns >> shift);
+    }
+
+    static uint64_t
+    upper(size_t i)
+    {
+        if (i < SUB_BUCKETS)
+        {
+            return i;
+        }
+
+        auto shift = i / (SUB_BUCKETS / 2) - 1;
+        auto sub = i - shift * (SUB_BUCKETS / 2);
+        return ((sub + 1) << shift) - 1;
+    }
+
+    std::vector<uint64_t> m_counts;
+    uint64_t m_count = 0;
+    uint64_t m_sum = 0;
+    uint64_t m_max = 0;
+};
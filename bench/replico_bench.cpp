@@ -0,0 +1,617 @@
+// Load generator for replico.
+//
+// Starts a cluster inside this process (or targets a running one), drives
+// /addlog or /getlog over keep-alive connections, or opens a new connection
+// for every request, and reports throughput and latency percentiles as JSON.
+//
+// Closed loop: every connection sends the next request as soon as the
+// previous one is answered. Open loop: requests are due at a fixed rate
+// whatever the server does; latency counts from the time a request was due,
+// so a stalled server shows up in the percentiles instead of slowing the
+// load down (no coordinated omission).
+
+#include "latency_histogram.h"
+#include "helpers.h"
+#include "logger.h"
+#include "replico_server.h"
+#include <boost/asio/connect.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/lexical_cast.hpp>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <sstream>
+
+namespace
+{
+using clock_type = std::chrono::steady_clock;
+
+const char* const USAGE =
+    "Usage: replico_bench [--name=value ...]\n"
+    "Cluster:\n"
+    "    --target=<host:port>   benchmark a running node instead of starting a cluster\n"
+    "    --nodes=<n>            secondaries of the in-process cluster, 1 or more (default 2)\n"
+    "    --base-port=<port>     master port, secondaries follow (default 18080)\n"
+    "    --server-threads=<n>   I/O threads per node (default 2)\n"
+    "    --server-args=<args>   extra options for every node, space separated\n"
+    "Workload:\n"
+    "    --workload=<w>         addlog, getlog or connect (default addlog)\n"
+    "    --mode=<m>             closed or open (default closed)\n"
+    "    --rate=<n>             open loop requests per second (default 1000)\n"
+    "    --concurrency=<n>      connections (default 16)\n"
+    "    --threads=<n>          client I/O threads (default 2)\n"
+    "    --payload-bytes=<n>    log size of /addlog (default 64)\n"
+    "    --wc=<n>               write concern of /addlog (default 1)\n"
+    "    --prefill=<n>          logs added before a getlog run (default 10000)\n"
+    "    --getlog-limit=<n>     logs per /getlog (default 100)\n"
+    "    --read-node=<i>        getlog from master (0) or the i-th secondary (default 0)\n"
+    "    --duration-s=<s>       measured time (default 10)\n"
+    "    --warmup-s=<s>         time before measuring (default 1)\n"
+    "    --json=<path>          also write the result to a file\n";
+
+struct Config
+{
+    std::map<std::string, std::string> m_options;
+
+    template <class T>
+    T
+    option(const std::string& name, T def) const
+    {
+        auto it = m_options.find(name);
+        return it == m_options.end() ? def : boost::lexical_cast<T>(it->second);
+    }
+
+    std::string m_workload;
+    bool m_open = false;
+    bool m_connect_each = false;
+    double m_rate = 0;
+    size_t m_concurrency = 0;
+    size_t m_payload_bytes = 0;
+    size_t m_wc = 0;
+    size_t m_prefill = 0;
+    size_t m_getlog_limit = 0;
+    double m_duration_s = 0;
+    double m_warmup_s = 0;
+};
+
+// Time window the results are taken from
+struct Schedule
+{
+    clock_type::time_point m_start;
+    clock_type::time_point m_measure_from;
+    clock_type::time_point m_end;
+};
+
+// One keep-alive connection, or one connection after the other with
+// the connect workload
+class Client : public std::enable_shared_from_this<Client>
+{
+public:
+    Client(net::io_context& ioc,
+           const Config& config,
+           const Schedule& schedule,
+           tcp::resolver::results_type endpoints,
+           size_t index)
+        : m_stream(net::make_strand(ioc))
+        , m_timer(m_stream.get_executor())
+        , m_config(config)
+        , m_schedule(schedule)
+        , m_endpoints(std::move(endpoints))
+        , m_index(index)
+        , m_random(static_cast<unsigned>(index))
+    {
+        if (m_config.m_workload == "addlog")
+        {
+            m_req.method(http::verb::post);
+            m_req.target("/addlog");
+            m_req.body() = "{\"data\": \"" + std::string(m_config.m_payload_bytes, 'x') +
+                           "\", \"wc\": " + std::to_string(m_config.m_wc) + "}";
+        }
+        else
+        {
+            m_req.method(http::verb::get);
+            m_req.target("/getlog?from=0&limit=1");
+        }
+        m_req.version(11);
+        m_req.keep_alive(!m_config.m_connect_each);
+        m_req.set(http::field::host, "replico");
+    }
+
+    void
+    run()
+    {
+        if (m_config.m_connect_each)
+        {
+            net::dispatch(m_stream.get_executor(),
+                          beast::bind_front_handler(&Client::schedule, shared_from_this()));
+        }
+        else
+        {
+            net::dispatch(m_stream.get_executor(),
+                          beast::bind_front_handler(&Client::do_connect, shared_from_this()));
+        }
+    }
+
+    LatencyHistogram m_latency;
+    uint64_t m_ok = 0;
+    uint64_t m_partial = 0;
+    uint64_t m_throttled = 0;
+    uint64_t m_errors = 0;
+
+private:
+    void
+    do_connect()
+    {
+        m_stream.expires_after(std::chrono::seconds(30));
+        m_stream.async_connect(m_endpoints,
+                               beast::bind_front_handler(&Client::on_connect, shared_from_this()));
+    }
+
+    void
+    on_connect(beast::error_code ec, tcp::resolver::results_type::endpoint_type)
+    {
+        if (ec)
+        {
+            // The connect workload carries on with the next request
+            ++m_errors;
+            if (m_config.m_connect_each)
+            {
+                close();
+                schedule();
+            }
+            return;
+        }
+
+        beast::error_code ignored;
+        m_stream.socket().set_option(tcp::no_delay(true), ignored);
+        if (m_config.m_connect_each)
+        {
+            do_request();
+        }
+        else
+        {
+            schedule();
+        }
+    }
+
+    // Picks the time the next request is due and waits for it
+    void
+    schedule()
+    {
+        auto now = clock_type::now();
+        if (m_config.m_open)
+        {
+            // Requests of all connections interleave evenly at the rate
+            auto slot = m_sent * m_config.m_concurrency + m_index;
+            m_due = m_schedule.m_start + std::chrono::nanoseconds(static_cast<int64_t>(
+                                             slot * 1e9 / m_config.m_rate));
+        }
+        else
+        {
+            m_due = now;
+        }
+
+        if (m_due >= m_schedule.m_end)
+        {
+            beast::error_code ec;
+            m_stream.socket().shutdown(tcp::socket::shutdown_both, ec);
+            return;
+        }
+
+        if (m_due > now)
+        {
+            m_timer.expires_at(m_due);
+            m_timer.async_wait(beast::bind_front_handler(&Client::on_timer, shared_from_this()));
+            return;
+        }
+
+        // Late: the request goes now, the delay is part of its latency
+        send();
+    }
+
+    void
+    on_timer(beast::error_code ec)
+    {
+        if (ec)
+        {
+            return;
+        }
+        send();
+    }
+
+    // The connect workload times the connection setup as well
+    void
+    send()
+    {
+        if (m_config.m_connect_each)
+        {
+            do_connect();
+        }
+        else
+        {
+            do_request();
+        }
+    }
+
+    void
+    do_request()
+    {
+        ++m_sent;
+        if (m_config.m_workload == "getlog")
+        {
+            auto last = m_config.m_prefill > m_config.m_getlog_limit
+                            ? m_config.m_prefill - m_config.m_getlog_limit
+                            : 0;
+            std::uniform_int_distribution<size_t> from(0, last);
+            m_req.target("/getlog?from=" + std::to_string(from(m_random)) +
+                         "&limit=" + std::to_string(m_config.m_getlog_limit));
+        }
+        m_req.prepare_payload();
+
+        m_stream.expires_after(std::chrono::seconds(30));
+        http::async_write(m_stream, m_req,
+                          beast::bind_front_handler(&Client::on_write, shared_from_this()));
+    }
+
+    void
+    on_write(beast::error_code ec, std::size_t)
+    {
+        if (ec)
+        {
+            return on_error();
+        }
+
+        m_res = {};
+        http::async_read(m_stream, m_buffer, m_res,
+                         beast::bind_front_handler(&Client::on_read, shared_from_this()));
+    }
+
+    void
+    on_read(beast::error_code ec, std::size_t)
+    {
+        if (ec)
+        {
+            return on_error();
+        }
+
+        if (m_due >= m_schedule.m_measure_from)
+        {
+            m_latency.record(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                 clock_type::now() - m_due)
+                                 .count());
+            if (m_res.result() == http::status::ok)
+            {
+                ++m_ok;
+            }
+            else if (m_res.result() == http::status::accepted)
+            {
+                ++m_partial;
+            }
+            else if (m_res.result() == http::status::too_many_requests ||
+                     m_res.result() == http::status::service_unavailable)
+            {
+                // Refused by admission control
+                ++m_throttled;
+            }
+            else
+            {
+                ++m_errors;
+            }
+        }
+
+        if (m_config.m_connect_each)
+        {
+            close();
+        }
+        schedule();
+    }
+
+    // Counts the failure and carries on over a new connection
+    void
+    on_error()
+    {
+        ++m_errors;
+        close();
+        if (m_config.m_connect_each)
+        {
+            schedule();
+        }
+        else if (clock_type::now() < m_schedule.m_end)
+        {
+            do_connect();
+        }
+    }
+
+    // Resets instead of closing gracefully: at thousands of connections per
+    // second TIME_WAIT would use up the local ports
+    void
+    close()
+    {
+        beast::error_code ec;
+        m_stream.socket().set_option(net::socket_base::linger(true, 0), ec);
+        m_stream.socket().close(ec);
+        m_buffer.clear();
+    }
+
+    beast::tcp_stream m_stream;
+    net::steady_timer m_timer;
+    const Config& m_config;
+    const Schedule& m_schedule;
+    tcp::resolver::results_type m_endpoints;
+    size_t m_index;
+    std::minstd_rand m_random;
+
+    beast::flat_buffer m_buffer;
+    http::request<http::string_body> m_req;
+    http::response<http::string_body> m_res;
+
+    uint64_t m_sent = 0;
+    clock_type::time_point m_due;
+};
+
+// Nodes started inside this process on the loopback interface
+class Cluster
+{
+public:
+    bool
+    start(const Config& config)
+    {
+        auto nodes = std::max<size_t>(1, config.option<size_t>("nodes", 2));
+        auto base = config.option<unsigned>("base-port", 18080);
+        auto threads = config.option<std::string>("server-threads", "2");
+
+        std::vector<std::string> extra;
+        auto args = config.option<std::string>("server-args", "");
+        if (!args.empty())
+        {
+            boost::split(extra, args, boost::is_any_of(" "), boost::token_compress_on);
+        }
+
+        auto root = "127.0.0.1:" + std::to_string(base);
+        std::string secondaries;
+        for (size_t i = 1; i <= nodes; ++i)
+        {
+            auto address = "127.0.0.1:" + std::to_string(base + i);
+            secondaries += (i > 1 ? ";" : "") + address;
+
+            // Secondaries answer right away unless told otherwise
+            if (!launch({"node", address, root, threads, "--fault=none"}, extra))
+            {
+                return false;
+            }
+        }
+
+        return launch({"root", root, secondaries, threads}, extra);
+    }
+
+    void
+    stop()
+    {
+        for (auto& s : m_servers)
+        {
+            s->shutdown();
+        }
+        for (auto& s : m_servers)
+        {
+            s->stop();
+        }
+    }
+
+private:
+    bool
+    launch(std::vector<std::string> args, const std::vector<std::string>& extra)
+    {
+        args.insert(args.begin(), "replico");
+        args.push_back("--log-level=warn");
+        args.insert(args.end(), extra.begin(), extra.end());
+
+        std::vector<char*> argv;
+        for (auto& a : args)
+        {
+            argv.push_back(&a[0]);
+        }
+
+        m_servers.emplace_back(new RServer);
+        return m_servers.back()->start(static_cast<int>(argv.size()), argv.data());
+    }
+
+    std::vector<std::unique_ptr<RServer>> m_servers;
+};
+
+// Adds logs one by one over a blocking connection
+bool
+prefill(net::io_context& ioc, const tcp::resolver::results_type& endpoints, size_t count)
+{
+    beast::tcp_stream stream(ioc);
+    beast::error_code ec;
+    stream.connect(endpoints, ec);
+    if (ec)
+    {
+        fail(ec, "prefill connect");
+        return false;
+    }
+
+    beast::flat_buffer buffer;
+    for (size_t i = 0; i < count; ++i)
+    {
+        http::request<http::string_body> req{http::verb::post, "/addlog", 11};
+        req.set(http::field::host, "replico");
+        req.body() = "{\"data\": \"prefill " + std::to_string(i) + "\", \"wc\": 1}";
+        req.prepare_payload();
+        http::write(stream, req, ec);
+
+        http::response<http::string_body> res;
+        if (!ec)
+        {
+            http::read(stream, buffer, res, ec);
+        }
+        if (ec)
+        {
+            fail(ec, "prefill");
+            return false;
+        }
+    }
+    return true;
+}
+
+std::string
+render_json(const Config& config, const LatencyHistogram& latency, uint64_t ok, uint64_t partial,
+            uint64_t throttled, uint64_t errors)
+{
+    auto us = [](uint64_t ns) { return ns / 1000.0; };
+    auto measured = latency.count();
+
+    std::ostringstream out;
+    out << "{\"workload\": \"" << config.m_workload << "\", \"mode\": \""
+        << (config.m_open ? "open" : "closed") << "\", \"concurrency\": " << config.m_concurrency
+        << ", \"rate\": " << (config.m_open ? config.m_rate : 0)
+        << ", \"payload_bytes\": " << config.m_payload_bytes << ", \"wc\": " << config.m_wc
+        << ", \"duration_s\": " << config.m_duration_s << ", \"requests\": " << measured
+        << ", \"ok\": " << ok << ", \"partial\": " << partial << ", \"throttled\": " << throttled
+        << ", \"errors\": " << errors
+        << ", \"throughput_rps\": " << measured / config.m_duration_s << ", \"latency_us\": {"
+        << "\"mean\": " << latency.mean() / 1000.0 << ", \"p50\": " << us(latency.quantile(0.5))
+        << ", \"p90\": " << us(latency.quantile(0.9)) << ", \"p99\": " << us(latency.quantile(0.99))
+        << ", \"p99.9\": " << us(latency.quantile(0.999)) << ", \"max\": " << us(latency.max())
+        << "}}\n";
+    return out.str();
+}
+}  // namespace
+
+int
+main(int argc, char* argv[])
+{
+    Config config;
+    config.m_options = parse_options(argc, argv, 1);
+    if (config.m_options.count("help"))
+    {
+        std::cerr << USAGE;
+        return EXIT_FAILURE;
+    }
+
+    try
+    {
+        config.m_workload = config.option<std::string>("workload", "addlog");
+        config.m_open = config.option<std::string>("mode", "closed") == "open";
+        config.m_connect_each = config.m_workload == "connect";
+        config.m_rate = config.option<double>("rate", 1000);
+        config.m_concurrency = std::max<size_t>(1, config.option<size_t>("concurrency", 16));
+        config.m_payload_bytes = config.option<size_t>("payload-bytes", 64);
+        config.m_wc = config.option<size_t>("wc", 1);
+        config.m_prefill =
+            config.option<size_t>("prefill", config.m_workload == "getlog" ? 10000 : 0);
+        config.m_getlog_limit = config.option<size_t>("getlog-limit", 100);
+        config.m_duration_s = config.option<double>("duration-s", 10);
+        config.m_warmup_s = config.option<double>("warmup-s", 1);
+    }
+    catch (const boost::bad_lexical_cast& e)
+    {
+        std::cerr << "Bad option: " << e.what() << "\n" << USAGE;
+        return EXIT_FAILURE;
+    }
+
+    if ((config.m_workload != "addlog" && config.m_workload != "getlog" &&
+         config.m_workload != "connect") ||
+        config.m_rate <= 0 ||
+        config.m_duration_s <= 0)
+    {
+        std::cerr << USAGE;
+        return EXIT_FAILURE;
+    }
+
+    Cluster cluster;
+    std::string host = "127.0.0.1";
+    auto port = std::to_string(config.option<unsigned>("base-port", 18080));
+    auto target = config.option<std::string>("target", "");
+    if (target.empty())
+    {
+        if (!cluster.start(config))
+        {
+            cluster.stop();
+            return EXIT_FAILURE;
+        }
+    }
+    else
+    {
+        auto colon = target.rfind(':');
+        host = target.substr(0, colon);
+        port = target.substr(colon + 1);
+    }
+
+    net::io_context ioc;
+    tcp::resolver resolver(ioc);
+    beast::error_code ec;
+    auto writes = resolver.resolve(host, port, ec);
+    if (ec)
+    {
+        fail(ec, "resolve");
+        cluster.stop();
+        return EXIT_FAILURE;
+    }
+
+    if (config.m_prefill > 0 && !prefill(ioc, writes, config.m_prefill))
+    {
+        cluster.stop();
+        return EXIT_FAILURE;
+    }
+
+    // Reads may go to a secondary of the in-process cluster
+    auto endpoints = writes;
+    auto read_node = config.option<unsigned>("read-node", 0);
+    if (config.m_workload == "getlog" && read_node > 0 && target.empty())
+    {
+        endpoints = resolver.resolve(host, std::to_string(std::stoi(port) + read_node), ec);
+    }
+
+    Schedule schedule;
+    schedule.m_start = clock_type::now() + std::chrono::milliseconds(50);
+    schedule.m_measure_from =
+        schedule.m_start +
+        std::chrono::microseconds(static_cast<int64_t>(config.m_warmup_s * 1e6));
+    schedule.m_end = schedule.m_measure_from +
+                     std::chrono::microseconds(static_cast<int64_t>(config.m_duration_s * 1e6));
+
+    std::vector<std::shared_ptr<Client>> clients;
+    for (size_t i = 0; i < config.m_concurrency; ++i)
+    {
+        clients.push_back(std::make_shared<Client>(ioc, config, schedule, endpoints, i));
+        clients.back()->run();
+    }
+
+    std::vector<std::thread> threads;
+    for (auto i = config.option<int>("threads", 2); i > 0; --i)
+    {
+        threads.emplace_back([&ioc] { ioc.run(); });
+    }
+    for (auto& t : threads)
+    {
+        t.join();
+    }
+
+    LatencyHistogram latency;
+    uint64_t ok = 0;
+    uint64_t partial = 0;
+    uint64_t throttled = 0;
+    uint64_t errors = 0;
+    for (auto& c : clients)
+    {
+        latency.merge(c->m_latency);
+        ok += c->m_ok;
+        partial += c->m_partial;
+        throttled += c->m_throttled;
+        errors += c->m_errors;
+    }
+
+    cluster.stop();
+
+    auto json = render_json(config, latency, ok, partial, throttled, errors);
+    std::cout << json;
+
+    auto path = config.option<std::string>("json", "");
+    if (!path.empty())
+    {
+        std::ofstream(path) << json;
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,281 @@
+// Component benchmarks: log store, request handling and serialization.
+// Google Benchmark; every case takes the payload size (and thread count
+// where the code is meant to be shared) as arguments, e.g.
+//   replico_microbench --benchmark_filter=AddLog
+// Servers here are never started: no sockets, no replication, no disk.
+
+#include <benchmark/benchmark.h>
+#include "addlog_parser.h"
+#include "batch_frame.h"
+#include "helpers.h"
+#include "logger.h"
+#include "replico_server.h"
+#include "server_session.h"
+
+namespace
+{
+// Logs in the store before the read benchmarks
+const size_t PREFILL = 100000;
+
+std::unique_ptr<RServer> g_server;
+
+std::string
+payload(size_t size)
+{
+    return std::string(size, 'x');
+}
+
+std::string
+addlog_body(size_t size)
+{
+    return "{\"data\": \"" + payload(size) + "\", \"wc\": 1}";
+}
+
+void
+fresh_server(const benchmark::State&)
+{
+    g_server.reset(new RServer);
+    g_server->m_is_root = true;
+}
+
+// Logs which never reach their write concern, so update_wc only counts
+void
+prefilled_server(const benchmark::State& state)
+{
+    fresh_server(state);
+    auto log = payload(state.range(0));
+    size_t id;
+    for (size_t i = 0; i < PREFILL; ++i)
+    {
+        g_server->add_log(log, std::numeric_limits<size_t>::max(), id);
+    }
+}
+
+void
+drop_server(const benchmark::State&)
+{
+    g_server.reset();
+}
+
+void
+BM_AddLog(benchmark::State& state)
+{
+    auto log = payload(state.range(0));
+    size_t id;
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(g_server->add_log(log, 1, id));
+    }
+    state.SetBytesProcessed(state.iterations() * log.size());
+}
+BENCHMARK(BM_AddLog)
+    ->Setup(fresh_server)
+    ->Teardown(drop_server)
+    ->ArgName("payload")
+    ->RangeMultiplier(8)
+    ->Range(16, 4096)
+    ->ThreadRange(1, 8)
+    ->UseRealTime();
+
+// All threads walk the same logs, like acks of several secondaries
+void
+BM_UpdateWc(benchmark::State& state)
+{
+    size_t id = 0;
+    for (auto _ : state)
+    {
+        g_server->update_wc(id);
+        if (++id == PREFILL)
+        {
+            id = 0;
+        }
+    }
+}
+BENCHMARK(BM_UpdateWc)
+    ->Setup(prefilled_server)
+    ->Teardown(drop_server)
+    ->ArgName("payload")
+    ->Arg(64)
+    ->ThreadRange(1, 8)
+    ->UseRealTime();
+
+// One /getlog page of 100 logs
+void
+BM_RenderLogs(benchmark::State& state)
+{
+    std::string out;
+    size_t from = state.thread_index() * 997;
+    for (auto _ : state)
+    {
+        out.clear();
+        benchmark::DoNotOptimize(g_server->render_logs(from, 100, out));
+        from = (from + 100) % (PREFILL - 100);
+    }
+    state.SetBytesProcessed(state.iterations() * out.size());
+}
+BENCHMARK(BM_RenderLogs)
+    ->Setup(prefilled_server)
+    ->Teardown(drop_server)
+    ->ArgName("payload")
+    ->RangeMultiplier(8)
+    ->Range(16, 4096)
+    ->ThreadRange(1, 8)
+    ->UseRealTime();
+
+void
+BM_ParseAddlog(benchmark::State& state)
+{
+    auto body = addlog_body(state.range(0));
+    AddLogRequest fields;
+    const char* why = nullptr;
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(parse_addlog(body, fields, why));
+    }
+    state.SetBytesProcessed(state.iterations() * body.size());
+}
+BENCHMARK(BM_ParseAddlog)->ArgName("payload")->RangeMultiplier(8)->Range(16, 64 << 10);
+
+// A frame of 256 logs as master sends it
+void
+BM_EncodeFrame(benchmark::State& state)
+{
+    auto log = payload(state.range(0));
+    std::string frame;
+    for (auto _ : state)
+    {
+        batch_frame::begin(frame, 1, 1, 0);
+        for (uint64_t id = 0; id < 256; ++id)
+        {
+            batch_frame::append(frame, id, log);
+        }
+        batch_frame::finish(frame, 256);
+        benchmark::DoNotOptimize(frame.data());
+    }
+    state.SetBytesProcessed(state.iterations() * frame.size());
+}
+BENCHMARK(BM_EncodeFrame)->ArgName("payload")->RangeMultiplier(8)->Range(16, 4096);
+
+void
+BM_DecodeFrame(benchmark::State& state)
+{
+    auto log = payload(state.range(0));
+    std::string frame;
+    batch_frame::begin(frame, 1, 1, 0);
+    for (uint64_t id = 0; id < 256; ++id)
+    {
+        batch_frame::append(frame, id, log);
+    }
+    batch_frame::finish(frame, 256);
+
+    auto body = boost::string_view(frame).substr(batch_frame::PREFIX_SIZE);
+    batch_frame::Append decoded;
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(batch_frame::decode(body, decoded));
+    }
+    state.SetBytesProcessed(state.iterations() * frame.size());
+}
+BENCHMARK(BM_DecodeFrame)->ArgName("payload")->RangeMultiplier(8)->Range(16, 4096);
+
+// Repetitive JSON logs as clients write them
+void
+BM_CompressFrame(benchmark::State& state)
+{
+    std::string frame;
+    batch_frame::begin(frame, 1, 1, 0);
+    for (uint64_t id = 0; id < 256; ++id)
+    {
+        auto log = "{\"user\": " + std::to_string(id % 97) + ", \"event\": \"click\", \"page\": \"/items/" +
+                   std::to_string(id * 31) + "\", \"pad\": \"" + payload(state.range(0)) + "\"}";
+        batch_frame::append(frame, id, log);
+    }
+    batch_frame::finish(frame, 256);
+
+    std::string compressed;
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(batch_frame::compress(frame, 1, compressed));
+    }
+    state.SetBytesProcessed(state.iterations() * frame.size());
+    state.counters["ratio"] = double(frame.size()) / compressed.size();
+}
+BENCHMARK(BM_CompressFrame)->ArgName("payload")->RangeMultiplier(8)->Range(16, 4096);
+
+// handle_request on a session whose socket was never opened: the response
+// is built and handed to the session, the write fails at once. Includes
+// copying the request and running the completion on the io_context.
+class RequestBench
+{
+public:
+    RequestBench()
+        : m_session(std::make_shared<ServerSession>(tcp::socket(m_ioc), g_server.get()))
+    {
+    }
+
+    void
+    handle(const http::request<http::string_body>& req)
+    {
+        auto copy = req;
+        handle_request(std::move(copy), m_session->lambda_, g_server.get(), tcp::endpoint());
+        m_ioc.poll();
+        m_ioc.restart();
+    }
+
+private:
+    net::io_context m_ioc;
+    std::shared_ptr<ServerSession> m_session;
+};
+
+void
+BM_HandleAddlog(benchmark::State& state)
+{
+    RequestBench bench;
+    http::request<http::string_body> req{http::verb::post, "/addlog", 11};
+    req.body() = addlog_body(state.range(0));
+    req.prepare_payload();
+    for (auto _ : state)
+    {
+        bench.handle(req);
+    }
+}
+BENCHMARK(BM_HandleAddlog)
+    ->Setup(fresh_server)
+    ->Teardown(drop_server)
+    ->ArgName("payload")
+    ->RangeMultiplier(8)
+    ->Range(16, 4096);
+
+void
+BM_HandleGetlog(benchmark::State& state)
+{
+    RequestBench bench;
+    http::request<http::string_body> req{http::verb::get, "/getlog?from=5000&limit=100", 11};
+    for (auto _ : state)
+    {
+        bench.handle(req);
+    }
+}
+BENCHMARK(BM_HandleGetlog)
+    ->Setup(prefilled_server)
+    ->Teardown(drop_server)
+    ->ArgName("payload")
+    ->RangeMultiplier(8)
+    ->Range(16, 4096);
+}  // namespace
+
+int
+main(int argc, char** argv)
+{
+    // Failed writes of the request benchmarks would be reported otherwise
+    logger::set_level(logger::off);
+
+    benchmark::Initialize(&argc, argv);
+    if (benchmark::ReportUnrecognizedArguments(argc, argv))
+    {
+        return 1;
+    }
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    return 0;
+}
@@ -0,0 +1,508 @@
+#include "addlog_parser.h"
+#include <limits>
+
+namespace
+{
+// Unknown fields may nest objects and arrays this deep
+const int MAX_DEPTH = 32;
+
+class Parser
+{
+public:
+    explicit Parser(boost::string_view body)
+        : m_p(body.data())
+        , m_end(body.data() + body.size())
+    {
+    }
+
+    bool
+    fail(const char* why)
+    {
+        if (!m_why)
+        {
+            m_why = why;
+        }
+        return false;
+    }
+
+    // Next character after whitespace, 0 at the end
+    char
+    peek()
+    {
+        while (m_p < m_end && (*m_p == ' ' || *m_p == '\t' || *m_p == '\n' || *m_p == '\r'))
+        {
+            ++m_p;
+        }
+        return m_p < m_end ? *m_p : '\0';
+    }
+
+    bool
+    eat(char c)
+    {
+        if (peek() != c || m_p == m_end)
+        {
+            return false;
+        }
+        ++m_p;
+        return true;
+    }
+
+    bool
+    at_end()
+    {
+        peek();
+        return m_p == m_end;
+    }
+
+    // Reads a string at the cursor. Without escapes out points into the body.
+    // Otherwise the string is unescaped into scratch, or just validated
+    // if there is no scratch.
+    bool string(boost::string_view& out, std::string* scratch);
+
+    // Reads a number at the cursor, out is its text
+    bool number(boost::string_view& out);
+
+    // Reads an integer, possibly quoted, at the cursor
+    bool
+    integer(boost::string_view& out)
+    {
+        if (peek() == '"')
+        {
+            return string(out, nullptr);
+        }
+        return number(out);
+    }
+
+    bool skip_value(int depth);
+
+    const char* m_why = nullptr;
+
+private:
+    bool literal(boost::string_view word);
+    bool hex4(unsigned& code);
+    static void append_utf8(std::string& out, unsigned code);
+
+    const char* m_p;
+    const char* m_end;
+};
+
+bool
+Parser::string(boost::string_view& out, std::string* scratch)
+{
+    if (!eat('"'))
+    {
+        return fail("Expected a string");
+    }
+
+    // Fast path: no escapes, the string stays in the body
+    auto begin = m_p;
+    while (m_p < m_end && *m_p != '"' && *m_p != '\\')
+    {
+        if (static_cast<unsigned char>(*m_p) < 0x20)
+        {
+            return fail("Control character in a string");
+        }
+        ++m_p;
+    }
+
+    if (m_p == m_end)
+    {
+        return fail("Unterminated string");
+    }
+
+    if (*m_p == '"')
+    {
+        out = boost::string_view(begin, m_p - begin);
+        ++m_p;
+        return true;
+    }
+
+    if (scratch)
+    {
+        scratch->assign(begin, m_p);
+    }
+
+    while (m_p < m_end)
+    {
+        auto c = *m_p++;
+        if (c == '"')
+        {
+            out = scratch ? boost::string_view(*scratch) : boost::string_view();
+            return true;
+        }
+
+        if (static_cast<unsigned char>(c) < 0x20)
+        {
+            return fail("Control character in a string");
+        }
+
+        if (c != '\\')
+        {
+            if (scratch)
+                scratch->push_back(c);
+            continue;
+        }
+
+        if (m_p == m_end)
+        {
+            break;
+        }
+
+        unsigned code = 0;
+        switch (*m_p++)
+        {
+            case '"': code = '"'; break;
+            case '\\': code = '\\'; break;
+            case '/': code = '/'; break;
+            case 'b': code = '\b'; break;
+            case 'f': code = '\f'; break;
+            case 'n': code = '\n'; break;
+            case 'r': code = '\r'; break;
+            case 't': code = '\t'; break;
+            case 'u':
+            {
+                if (!hex4(code))
+                {
+                    return false;
+                }
+
+                if (code >= 0xdc00 && code <= 0xdfff)
+                {
+                    return fail("Unpaired surrogate");
+                }
+
+                if (code >= 0xd800 && code <= 0xdbff)
+                {
+                    // The low half must follow
+                    unsigned low = 0;
+                    if (m_end - m_p < 2 || m_p[0] != '\\' || m_p[1] != 'u')
+                    {
+                        return fail("Unpaired surrogate");
+                    }
+                    m_p += 2;
+                    if (!hex4(low))
+                    {
+                        return false;
+                    }
+                    if (low < 0xdc00 || low > 0xdfff)
+                    {
+                        return fail("Unpaired surrogate");
+                    }
+                    code = 0x10000 + ((code - 0xd800) << 10) + (low - 0xdc00);
+                }
+                break;
+            }
+            default:
+                return fail("Bad escape sequence");
+        }
+
+        if (scratch)
+        {
+            append_utf8(*scratch, code);
+        }
+    }
+
+    return fail("Unterminated string");
+}
+
+bool
+Parser::hex4(unsigned& code)
+{
+    if (m_end - m_p < 4)
+    {
+        return fail("Bad escape sequence");
+    }
+
+    code = 0;
+    for (int i = 0; i < 4; ++i)
+    {
+        auto c = *m_p++;
+        code <<= 4;
+        if (c >= '0' && c <= '9')
+            code |= c - '0';
+        else if (c >= 'a' && c <= 'f')
+            code |= c - 'a' + 10;
+        else if (c >= 'A' && c <= 'F')
+            code |= c - 'A' + 10;
+        else
+            return fail("Bad escape sequence");
+    }
+    return true;
+}
+
+void
+Parser::append_utf8(std::string& out, unsigned code)
+{
+    if (code < 0x80)
+    {
+        out.push_back(char(code));
+    }
+    else if (code < 0x800)
+    {
+        out.push_back(char(0xc0 | (code >> 6)));
+        out.push_back(char(0x80 | (code & 0x3f)));
+    }
+    else if (code < 0x10000)
+    {
+        out.push_back(char(0xe0 | (code >> 12)));
+        out.push_back(char(0x80 | ((code >> 6) & 0x3f)));
+        out.push_back(char(0x80 | (code & 0x3f)));
+    }
+    else
+    {
+        out.push_back(char(0xf0 | (code >> 18)));
+        out.push_back(char(0x80 | ((code >> 12) & 0x3f)));
+        out.push_back(char(0x80 | ((code >> 6) & 0x3f)));
+        out.push_back(char(0x80 | (code & 0x3f)));
+    }
+}
+
+bool
+Parser::number(boost::string_view& out)
+{
+    peek();
+    auto begin = m_p;
+    auto digits = [this] {
+        auto first = m_p;
+        while (m_p < m_end && *m_p >= '0' && *m_p <= '9')
+        {
+            ++m_p;
+        }
+        return m_p != first;
+    };
+
+    if (m_p < m_end && *m_p == '-')
+    {
+        ++m_p;
+    }
+
+    // No leading zeros
+    if (m_p < m_end && *m_p == '0')
+    {
+        ++m_p;
+    }
+    else if (!digits())
+    {
+        return fail("Bad number");
+    }
+
+    if (m_p < m_end && *m_p == '.')
+    {
+        ++m_p;
+        if (!digits())
+            return fail("Bad number");
+    }
+
+    if (m_p < m_end && (*m_p == 'e' || *m_p == 'E'))
+    {
+        ++m_p;
+        if (m_p < m_end && (*m_p == '+' || *m_p == '-'))
+            ++m_p;
+        if (!digits())
+            return fail("Bad number");
+    }
+
+    out = boost::string_view(begin, m_p - begin);
+    return true;
+}
+
+bool
+Parser::literal(boost::string_view word)
+{
+    if (static_cast<size_t>(m_end - m_p) < word.size() ||
+        boost::string_view(m_p, word.size()) != word)
+    {
+        return fail("Unexpected character");
+    }
+    m_p += word.size();
+    return true;
+}
+
+bool
+Parser::skip_value(int depth)
+{
+    if (depth > MAX_DEPTH)
+    {
+        return fail("Nesting too deep");
+    }
+
+    boost::string_view ignored;
+    switch (peek())
+    {
+        case '"':
+            return string(ignored, nullptr);
+        case 't':
+            return literal("true");
+        case 'f':
+            return literal("false");
+        case 'n':
+            return literal("null");
+        case '{':
+        {
+            ++m_p;
+            if (eat('}'))
+            {
+                return true;
+            }
+            do
+            {
+                if (!string(ignored, nullptr) || !(eat(':') || fail("Expected ':'")) ||
+                    !skip_value(depth + 1))
+                {
+                    return false;
+                }
+            } while (eat(','));
+            return eat('}') || fail("Expected ',' or '}'");
+        }
+        case '[':
+        {
+            ++m_p;
+            if (eat(']'))
+            {
+                return true;
+            }
+            do
+            {
+                if (!skip_value(depth + 1))
+                {
+                    return false;
+                }
+            } while (eat(','));
+            return eat(']') || fail("Expected ',' or ']'");
+        }
+        default:
+            return number(ignored);
+    }
+}
+
+// Digits of a non-negative integer, false on anything else or overflow
+bool
+to_unsigned(boost::string_view text, unsigned long long max, unsigned long long& value)
+{
+    if (text.empty())
+    {
+        return false;
+    }
+
+    value = 0;
+    for (auto c : text)
+    {
+        if (c < '0' || c > '9')
+        {
+            return false;
+        }
+
+        unsigned digit = c - '0';
+        if (value > (max - digit) / 10)
+        {
+            return false;
+        }
+        value = value * 10 + digit;
+    }
+    return true;
+}
+}  // namespace
+
+bool
+parse_addlog(boost::string_view body, AddLogRequest& request, const char*& why)
+{
+    Parser p(body);
+    auto fail = [&](const char* reason) {
+        why = p.m_why ? p.m_why : reason;
+        return false;
+    };
+
+    request.m_has_data = request.m_has_wc = request.m_has_timeout = false;
+
+    if (!p.eat('{'))
+    {
+        return fail("Expected a JSON object");
+    }
+
+    if (!p.eat('}'))
+    {
+        do
+        {
+            // Field names with escapes never match the known fields
+            boost::string_view key;
+            if (!p.string(key, nullptr))
+            {
+                return fail("Expected a field name");
+            }
+            if (!p.eat(':'))
+            {
+                return fail("Expected ':'");
+            }
+
+            if (key == "data")
+            {
+                if (p.peek() != '"' || !p.string(request.m_data, &request.m_unescaped))
+                {
+                    return fail("data must be a string");
+                }
+                request.m_has_data = true;
+            }
+            else if (key == "wc")
+            {
+                boost::string_view text;
+                unsigned long long wc = 0;
+                if (!p.integer(text) ||
+                    !to_unsigned(text, std::numeric_limits<size_t>::max(), wc))
+                {
+                    return fail("wc must be a non-negative integer");
+                }
+                request.m_wc = static_cast<size_t>(wc);
+                request.m_has_wc = true;
+            }
+            else if (key == "timeout")
+            {
+                boost::string_view text;
+                unsigned long long timeout = 0;
+                if (!p.integer(text))
+                {
+                    return fail("timeout must be an integer");
+                }
+
+                // Negative or zero timeout means waiting without a limit
+                auto negative = !text.empty() && text.front() == '-';
+                if (negative)
+                {
+                    text.remove_prefix(1);
+                }
+                if (!to_unsigned(text, std::numeric_limits<long long>::max(), timeout))
+                {
+                    return fail("timeout must be an integer");
+                }
+                request.m_timeout_ms =
+                    negative ? -static_cast<long long>(timeout) : static_cast<long long>(timeout);
+                request.m_has_timeout = true;
+            }
+            else if (!p.skip_value(1))
+            {
+                return fail("Bad value");
+            }
+        } while (p.eat(','));
+
+        if (!p.eat('}'))
+        {
+            return fail("Expected ',' or '}'");
+        }
+    }
+
+    if (!p.at_end())
+    {
+        return fail("Unexpected data after the object");
+    }
+
+    if (!request.m_has_data)
+    {
+        return fail("Missing data");
+    }
+
+    if (!request.m_has_wc)
+    {
+        return fail("Missing wc");
+    }
+
+    return true;
+}
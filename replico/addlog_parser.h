@@ -0,0 +1,30 @@
+#pragma once
+
+#include <boost/utility/string_view.hpp>
+#include <cstddef>
+#include <string>
+
+// Fields of the /addlog request body:
+//   {"data": "<log>", "wc": <n>, "timeout": <ms>}
+// Other fields are validated and skipped. Numbers may also come quoted,
+// as written by boost::property_tree.
+struct AddLogRequest
+{
+    // Points into the parsed body, or into m_unescaped if the log
+    // contains escape sequences
+    boost::string_view m_data;
+    bool m_has_data = false;
+
+    size_t m_wc = 0;
+    bool m_has_wc = false;
+
+    long long m_timeout_ms = 0;
+    bool m_has_timeout = false;
+
+    std::string m_unescaped;
+};
+
+// Single pass over the body, nothing is allocated unless the log has escapes.
+// Returns false and points why at the reason if the body is not valid JSON
+// or a known field has a wrong type.
+bool parse_addlog(boost::string_view body, AddLogRequest& request, const char*& why);
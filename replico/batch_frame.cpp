@@ -0,0 +1,249 @@
+#include "batch_frame.h"
+#include "segment_format.h"
+#include <zlib.h>
+#include <algorithm>
+
+using segment_format::get_u32;
+using segment_format::get_u64;
+using segment_format::put_u32;
+using segment_format::put_u64;
+
+namespace
+{
+const size_t APPEND_HEADER_SIZE = 1 + 8 + 8 + 8 + 4;
+const size_t ENTRY_HEADER_SIZE = 8 + 4 + 4;
+const size_t COMPRESSED_HEADER_SIZE = 1 + 4;
+const size_t SNAPSHOT_SIZE = 1 + 8 + 8 + 8;
+const size_t HEARTBEAT_SIZE = 1 + 8 + 8 + 8;
+}  // namespace
+
+namespace batch_frame
+{
+void
+begin(std::string& frame, uint64_t term, uint64_t epoch, uint64_t acked)
+{
+    frame.assign(PREFIX_SIZE + APPEND_HEADER_SIZE, '\0');
+
+    auto p = &frame[PREFIX_SIZE];
+    p[0] = char(append_type);
+    put_u64(p + 1, term);
+    put_u64(p + 9, epoch);
+    put_u64(p + 17, acked);
+}
+
+void
+append(std::string& frame, uint64_t id, boost::string_view log)
+{
+    append(frame, id, log, segment_format::checksum(log.data(), log.size()));
+}
+
+void
+append(std::string& frame, uint64_t id, boost::string_view log, uint32_t crc)
+{
+    append_header(frame, id, log, crc);
+    frame.append(log.data(), log.size());
+}
+
+void
+append_header(std::string& frame, uint64_t id, boost::string_view log, uint32_t crc)
+{
+    auto offset = frame.size();
+    frame.resize(offset + ENTRY_HEADER_SIZE);
+
+    auto p = &frame[offset];
+    put_u64(p, id);
+    put_u32(p + 8, static_cast<uint32_t>(log.size()));
+    put_u32(p + 12, crc);
+}
+
+void
+finish(std::string& frame, uint32_t count, size_t referenced)
+{
+    put_u32(&frame[PREFIX_SIZE + 25], count);
+    put_u32(&frame[0], static_cast<uint32_t>(frame.size() + referenced - PREFIX_SIZE));
+}
+
+void
+encode_snapshot(std::string& frame, uint64_t term, uint64_t epoch, uint64_t index)
+{
+    frame.assign(PREFIX_SIZE + SNAPSHOT_SIZE, '\0');
+    put_u32(&frame[0], static_cast<uint32_t>(SNAPSHOT_SIZE));
+
+    auto p = &frame[PREFIX_SIZE];
+    p[0] = char(snapshot_type);
+    put_u64(p + 1, term);
+    put_u64(p + 9, epoch);
+    put_u64(p + 17, index);
+}
+
+void
+encode_heartbeat(std::string& frame, uint64_t term, uint64_t epoch, uint64_t seq)
+{
+    frame.assign(PREFIX_SIZE + HEARTBEAT_SIZE, '\0');
+    put_u32(&frame[0], static_cast<uint32_t>(HEARTBEAT_SIZE));
+
+    auto p = &frame[PREFIX_SIZE];
+    p[0] = char(heartbeat_type);
+    put_u64(p + 1, term);
+    put_u64(p + 9, epoch);
+    put_u64(p + 17, seq);
+}
+
+void
+encode_ack(std::string& out, Status status, uint64_t term, uint64_t last_id, uint8_t codecs)
+{
+    auto offset = out.size();
+    out.resize(offset + ACK_SIZE);
+
+    auto p = &out[offset];
+    put_u32(p, static_cast<uint32_t>(ACK_SIZE - PREFIX_SIZE));
+    p[4] = char(ack_type);
+    p[5] = char(status);
+    put_u64(p + 6, term);
+    put_u64(p + 14, last_id);
+    p[22] = char(codecs);
+}
+
+bool
+compress(const std::string& frame, int level, std::string& out)
+{
+    auto body = frame.size() - PREFIX_SIZE;
+    auto bound = compressBound(static_cast<uLong>(body));
+    out.resize(PREFIX_SIZE + COMPRESSED_HEADER_SIZE + bound);
+
+    auto p = &out[PREFIX_SIZE];
+    p[0] = char(compressed_type);
+    put_u32(p + 1, static_cast<uint32_t>(body));
+
+    auto size = bound;
+    if (compress2(reinterpret_cast<Bytef*>(p + COMPRESSED_HEADER_SIZE), &size,
+                  reinterpret_cast<const Bytef*>(frame.data() + PREFIX_SIZE),
+                  static_cast<uLong>(body), level) != Z_OK ||
+        size + COMPRESSED_HEADER_SIZE >= body)
+    {
+        return false;
+    }
+
+    out.resize(PREFIX_SIZE + COMPRESSED_HEADER_SIZE + size);
+    put_u32(&out[0], static_cast<uint32_t>(out.size() - PREFIX_SIZE));
+    return true;
+}
+
+uint32_t
+body_size(const char* prefix)
+{
+    return get_u32(prefix);
+}
+
+bool
+decode(boost::string_view body, Append& frame)
+{
+    if (body.size() < APPEND_HEADER_SIZE || uint8_t(body[0]) != append_type)
+    {
+        return false;
+    }
+
+    frame.m_term = get_u64(body.data() + 1);
+    frame.m_epoch = get_u64(body.data() + 9);
+    frame.m_acked = get_u64(body.data() + 17);
+    auto count = get_u32(body.data() + 25);
+    body.remove_prefix(APPEND_HEADER_SIZE);
+
+    // Each entry takes at least its header, do not trust count blindly
+    if (count > body.size() / ENTRY_HEADER_SIZE)
+    {
+        return false;
+    }
+
+    frame.m_entries.clear();
+    frame.m_entries.reserve(count);
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        if (body.size() < ENTRY_HEADER_SIZE)
+        {
+            return false;
+        }
+
+        auto id = get_u64(body.data());
+        auto len = get_u32(body.data() + 8);
+        auto crc = get_u32(body.data() + 12);
+        body.remove_prefix(ENTRY_HEADER_SIZE);
+        if (body.size() < len || segment_format::checksum(body.data(), len) != crc)
+        {
+            return false;
+        }
+
+        frame.m_entries.push_back(Entry{id, boost::string_view(body.data(), len)});
+        body.remove_prefix(len);
+    }
+
+    return body.empty();
+}
+
+bool
+decode_ack(boost::string_view body, Ack& ack)
+{
+    if (body.size() != ACK_SIZE - PREFIX_SIZE || uint8_t(body[0]) != ack_type)
+    {
+        return false;
+    }
+
+    ack.m_status = static_cast<Status>(body[1]);
+    ack.m_term = get_u64(body.data() + 2);
+    ack.m_last_id = get_u64(body.data() + 10);
+    ack.m_codecs = uint8_t(body[18]);
+    return true;
+}
+
+bool
+decode_snapshot(boost::string_view body, Snapshot& snapshot)
+{
+    if (body.size() != SNAPSHOT_SIZE || uint8_t(body[0]) != snapshot_type)
+    {
+        return false;
+    }
+
+    snapshot.m_term = get_u64(body.data() + 1);
+    snapshot.m_epoch = get_u64(body.data() + 9);
+    snapshot.m_index = get_u64(body.data() + 17);
+    return true;
+}
+
+bool
+decode_heartbeat(boost::string_view body, Heartbeat& heartbeat)
+{
+    if (body.size() != HEARTBEAT_SIZE || uint8_t(body[0]) != heartbeat_type)
+    {
+        return false;
+    }
+
+    heartbeat.m_term = get_u64(body.data() + 1);
+    heartbeat.m_epoch = get_u64(body.data() + 9);
+    heartbeat.m_seq = get_u64(body.data() + 17);
+    return true;
+}
+
+bool
+decompress(boost::string_view body, std::string& out)
+{
+    if (body.size() < COMPRESSED_HEADER_SIZE || uint8_t(body[0]) != compressed_type)
+    {
+        return false;
+    }
+
+    // The frame inside is bound by the same limit as any other
+    auto size = get_u32(body.data() + 1);
+    if (size > MAX_FRAME_BYTES)
+    {
+        return false;
+    }
+    body.remove_prefix(COMPRESSED_HEADER_SIZE);
+
+    out.resize(size);
+    uLongf inflated = size;
+    return uncompress(reinterpret_cast<Bytef*>(&out[0]), &inflated,
+                      reinterpret_cast<const Bytef*>(body.data()),
+                      static_cast<uLong>(body.size())) == Z_OK &&
+           inflated == size;
+}
+}  // namespace batch_frame
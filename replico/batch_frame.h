@@ -0,0 +1,146 @@
+#pragma once
+
+#include <boost/utility/string_view.hpp>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Frames of the binary replication protocol spoken on the replication port.
+// Layout (little-endian):
+//   u32 length of the rest of the frame, u8 type, then by type
+//   append: u64 term, u64 epoch, u64 acked, u32 count,
+//           count x { u64 id, u32 length, u32 crc32 of the log, length bytes of the log }
+//   compressed: u32 length of the append frame body it holds (type included),
+//           zlib stream of that body
+//   snapshot: u64 term, u64 epoch, u64 index
+//   heartbeat: u64 term, u64 epoch, u64 sequence number
+//   ack:    u8 status, u64 term, u64 id of the last log of the acknowledged batch
+//           (for gap: id of the first log the secondary is missing),
+//           u8 codecs the secondary accepts
+//
+// Master sends append frames, the secondary answers every one of them
+// with an ack in the same order once its logs are durable. acked is the id
+// below which master holds acks of the secondary for every log; frames of
+// one secondary may come over several connections and out of order.
+// Master compresses frames only once an ack told it the secondary can
+// read them. Logs master compacted away are replaced by a snapshot frame:
+// the secondary drops what it has below index and continues from there,
+// the ack carries index - 1 as the last id. Heartbeats come over a
+// connection of their own and are answered at once, the ack carries the
+// sequence number as the last id.
+namespace batch_frame
+{
+const size_t PREFIX_SIZE = 4;
+const size_t ACK_SIZE = PREFIX_SIZE + 1 + 1 + 8 + 8 + 1;
+
+// Longer frames are refused, the connection is closed
+const uint32_t MAX_FRAME_BYTES = 64 << 20;
+
+enum Type : uint8_t
+{
+    append_type = 1,
+    ack_type = 2,
+    compressed_type = 3,
+    snapshot_type = 4,
+    heartbeat_type = 5
+};
+
+// Bits of the codecs field of an ack
+enum Codec : uint8_t
+{
+    no_codec = 0,
+    zlib_codec = 1
+};
+
+enum Status : uint8_t
+{
+    ok = 0,
+    // Bad layout or checksum
+    malformed = 1,
+    // Sent by a master of an older term
+    stale_term = 2,
+    // Injected failure
+    unavailable = 3,
+    // Logs below acked are missing, master sends again from the id in the ack
+    gap = 4
+};
+
+struct Entry
+{
+    uint64_t m_id;
+    boost::string_view m_log;
+};
+
+struct Append
+{
+    uint64_t m_term = 0;
+    uint64_t m_epoch = 0;
+    uint64_t m_acked = 0;
+    std::vector<Entry> m_entries;
+};
+
+struct Snapshot
+{
+    uint64_t m_term = 0;
+    uint64_t m_epoch = 0;
+    uint64_t m_index = 0;
+};
+
+struct Heartbeat
+{
+    uint64_t m_term = 0;
+    uint64_t m_epoch = 0;
+    uint64_t m_seq = 0;
+};
+
+struct Ack
+{
+    Status m_status = ok;
+    uint64_t m_term = 0;
+    uint64_t m_last_id = 0;
+    uint8_t m_codecs = no_codec;
+};
+
+// Starts an append frame, replaces the content of frame
+void begin(std::string& frame, uint64_t term, uint64_t epoch, uint64_t acked);
+
+// Appends one log to the frame
+void append(std::string& frame, uint64_t id, boost::string_view log);
+
+// Same with the crc32 of the log known already
+void append(std::string& frame, uint64_t id, boost::string_view log, uint32_t crc);
+
+// Appends only the header of a log, the caller writes the log itself
+// right after the frame bytes appended so far (scatter-gather)
+void append_header(std::string& frame, uint64_t id, boost::string_view log, uint32_t crc);
+
+// Fills in the number of logs and the length prefix once all logs are
+// appended. referenced - bytes of the logs left out by append_header.
+void finish(std::string& frame, uint32_t count, size_t referenced = 0);
+
+// Replaces the content of frame with a snapshot frame
+void encode_snapshot(std::string& frame, uint64_t term, uint64_t epoch, uint64_t index);
+
+// Replaces the content of frame with a heartbeat frame
+void encode_heartbeat(std::string& frame, uint64_t term, uint64_t epoch, uint64_t seq);
+
+// Appends an ack frame to out
+void encode_ack(std::string& out, Status status, uint64_t term, uint64_t last_id, uint8_t codecs);
+
+// Compresses a finished append frame into a compressed frame in out.
+// Returns false if the frame does not get smaller.
+bool compress(const std::string& frame, int level, std::string& out);
+
+// Length of the frame following the prefix
+uint32_t body_size(const char* prefix);
+
+// Parse the frame without its prefix. Logs point into the frame.
+// Return false if the frame is malformed or a checksum does not match.
+bool decode(boost::string_view body, Append& frame);
+bool decode_ack(boost::string_view body, Ack& ack);
+bool decode_snapshot(boost::string_view body, Snapshot& snapshot);
+bool decode_heartbeat(boost::string_view body, Heartbeat& heartbeat);
+
+// Inflates the body of a compressed frame into the body of the append frame
+bool decompress(boost::string_view body, std::string& out);
+}  // namespace batch_frame
@@ -0,0 +1,86 @@
+#include "failure_detector.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+
+FailureDetector::FailureDetector(std::chrono::milliseconds interval,
+                                 std::chrono::milliseconds acceptable_pause,
+                                 clock::time_point start,
+                                 size_t window)
+    : m_window(std::max<size_t>(2, window))
+    , m_min_stddev(std::max(1.0, interval.count() / 4.0))
+    , m_acceptable_pause(acceptable_pause.count())
+    , m_last(start)
+{
+    // Until real intervals come in: the configured one give or take a quarter
+    auto ms = double(interval.count());
+    for (auto seed : {ms - ms / 4, ms + ms / 4})
+    {
+        m_intervals.push_back(seed);
+        m_sum += seed;
+        m_squares += seed * seed;
+    }
+}
+
+void
+FailureDetector::heartbeat(clock::time_point now)
+{
+    auto interval = std::chrono::duration<double, std::milli>(now - m_last).count();
+    m_last = now;
+
+    m_intervals.push_back(interval);
+    m_sum += interval;
+    m_squares += interval * interval;
+    if (m_intervals.size() > m_window)
+    {
+        auto old = m_intervals.front();
+        m_intervals.pop_front();
+        m_sum -= old;
+        m_squares -= old * old;
+    }
+}
+
+double
+FailureDetector::phi(clock::time_point now) const
+{
+    auto n = double(m_intervals.size());
+    auto mean = m_sum / n;
+    auto variance = std::max(0.0, m_squares / n - mean * mean);
+    auto stddev = std::max(m_min_stddev, std::sqrt(variance));
+
+    // Logistic approximation of the normal CDF; phi = -log10(1 - F(t)),
+    // written as a softplus so neither tail overflows
+    auto elapsed = std::chrono::duration<double, std::milli>(now - m_last).count();
+    auto y = (elapsed - (mean + m_acceptable_pause)) / stddev;
+    auto a = y * (1.5976 + 0.070566 * y * y);
+    return (std::max(a, 0.0) + std::log1p(std::exp(-std::fabs(a)))) / std::log(10.0);
+}
+
+void
+RttEstimator::observe(std::chrono::nanoseconds rtt)
+{
+    auto us = std::chrono::duration_cast<std::chrono::microseconds>(rtt).count();
+    if (m_samples++ == 0)
+    {
+        m_srtt_us = us;
+        m_rttvar_us = us / 2;
+        return;
+    }
+
+    // alpha 1/8, beta 1/4
+    m_rttvar_us += (std::abs(m_srtt_us - us) - m_rttvar_us) / 4;
+    m_srtt_us += (us - m_srtt_us) / 8;
+}
+
+std::chrono::milliseconds
+RttEstimator::timeout(std::chrono::milliseconds min, std::chrono::milliseconds max) const
+{
+    if (empty())
+    {
+        return max;
+    }
+
+    auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::microseconds(m_srtt_us + 4 * m_rttvar_us));
+    return std::min(max, std::max(min, ms));
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+
+// Phi accrual failure detector (Hayashibara et al.) over the arrival times
+// of heartbeat acks. Instead of a yes/no after a fixed timeout it tells how
+// unlikely the silence since the last heartbeat is, given the intervals
+// seen so far: phi = -log10(probability that a heartbeat is still to come).
+// phi 1 means a 10% chance the node is fine, 8 means 1e-8. Not thread safe.
+class FailureDetector
+{
+public:
+    typedef std::chrono::steady_clock clock;
+
+    // interval is how often heartbeats are sent, it seeds the history.
+    // acceptable_pause is added to the mean interval: pauses this long
+    // (GC, a slow fsync, a busy network) are not suspicious yet.
+    FailureDetector(std::chrono::milliseconds interval,
+                    std::chrono::milliseconds acceptable_pause,
+                    clock::time_point start,
+                    size_t window = 100);
+
+    // An ack of a heartbeat arrived
+    void heartbeat(clock::time_point now);
+
+    double phi(clock::time_point now) const;
+
+    clock::time_point
+    last() const
+    {
+        return m_last;
+    }
+
+private:
+    // Intervals between heartbeats in ms, the last m_window of them
+    std::deque<double> m_intervals;
+    double m_sum = 0;
+    double m_squares = 0;
+    size_t m_window;
+
+    double m_min_stddev;
+    double m_acceptable_pause;
+    clock::time_point m_last;
+};
+
+// Smoothed round trip time and the timeout derived from it, as TCP
+// computes its retransmission timeout (RFC 6298): srtt + 4 * rttvar.
+// Not thread safe.
+class RttEstimator
+{
+public:
+    void observe(std::chrono::nanoseconds rtt);
+
+    bool
+    empty() const
+    {
+        return m_samples == 0;
+    }
+
+    std::chrono::microseconds
+    srtt() const
+    {
+        return std::chrono::microseconds(m_srtt_us);
+    }
+
+    // max until the first sample
+    std::chrono::milliseconds timeout(std::chrono::milliseconds min,
+                                      std::chrono::milliseconds max) const;
+
+private:
+    int64_t m_srtt_us = 0;
+    int64_t m_rttvar_us = 0;
+    uint64_t m_samples = 0;
+};
@@ -0,0 +1,224 @@
+#include "fault_injector.h"
+#include <boost/algorithm/string.hpp>
+#include <algorithm>
+#include <atomic>
+#include <random>
+
+namespace
+{
+std::mt19937_64&
+random_engine()
+{
+    // One engine per thread, the request path never shares it
+    thread_local std::mt19937_64 engine{std::random_device{}()};
+    return engine;
+}
+
+bool
+parse_probability(const std::string& value, double& p)
+{
+    try
+    {
+        p = std::stod(value);
+    }
+    catch (const std::exception&)
+    {
+        return false;
+    }
+    return p >= 0 && p <= 1;
+}
+
+bool
+parse_pair(const std::string& value, double& a, double& b)
+{
+    auto dash = value.find('-');
+    if (dash == std::string::npos)
+    {
+        return false;
+    }
+
+    try
+    {
+        a = std::stod(value.substr(0, dash));
+        b = std::stod(value.substr(dash + 1));
+    }
+    catch (const std::exception&)
+    {
+        return false;
+    }
+    return a >= 0 && b >= 0;
+}
+}  // namespace
+
+bool
+FaultInjector::parse_delay(const std::string& value, Delay& delay)
+{
+    auto colon = value.find(':');
+    if (colon == std::string::npos)
+    {
+        return false;
+    }
+
+    auto kind = value.substr(0, colon);
+    auto args = value.substr(colon + 1);
+    try
+    {
+        if (kind == "fixed")
+        {
+            delay.m_kind = Delay::fixed;
+            delay.m_a = std::stod(args);
+            return delay.m_a >= 0;
+        }
+        if (kind == "exp")
+        {
+            delay.m_kind = Delay::exponential;
+            delay.m_a = std::stod(args);
+            return delay.m_a > 0;
+        }
+    }
+    catch (const std::exception&)
+    {
+        return false;
+    }
+
+    if (kind == "uniform")
+    {
+        delay.m_kind = Delay::uniform;
+        return parse_pair(args, delay.m_a, delay.m_b) && delay.m_a <= delay.m_b;
+    }
+    if (kind == "normal")
+    {
+        delay.m_kind = Delay::normal;
+        return parse_pair(args, delay.m_a, delay.m_b);
+    }
+    return false;
+}
+
+bool
+FaultInjector::configure(const std::string& spec, std::string& why)
+{
+    auto rules = std::make_shared<Rules>();
+
+    std::vector<std::string> parts;
+    boost::split(parts, spec, boost::is_any_of(";"));
+    for (auto& part : parts)
+    {
+        boost::trim(part);
+        if (part.empty() || part == "none")
+        {
+            continue;
+        }
+
+        auto colon = part.find(':');
+        if (colon == std::string::npos || colon == 0)
+        {
+            why = "Missing target in rule: " + part;
+            return false;
+        }
+
+        Rule rule;
+        rule.m_target = part.substr(0, colon);
+        rule.m_spec = part;
+
+        std::vector<std::string> settings;
+        boost::split(settings, part.substr(colon + 1), boost::is_any_of(","));
+        for (auto& setting : settings)
+        {
+            auto eq = setting.find('=');
+            auto key = setting.substr(0, eq);
+            auto value = eq == std::string::npos ? std::string() : setting.substr(eq + 1);
+
+            bool ok = false;
+            if (key == "delay")
+            {
+                ok = parse_delay(value, rule.m_delay);
+            }
+            else if (key == "drop")
+            {
+                ok = parse_probability(value, rule.m_drop);
+            }
+            else if (key == "error")
+            {
+                ok = parse_probability(value, rule.m_error);
+            }
+
+            if (!ok)
+            {
+                why = "Bad setting '" + setting + "' in rule: " + part;
+                return false;
+            }
+        }
+
+        rules->push_back(std::move(rule));
+    }
+
+    std::atomic_store(&m_rules, std::shared_ptr<const Rules>(std::move(rules)));
+    return true;
+}
+
+std::string
+FaultInjector::describe() const
+{
+    auto rules = std::atomic_load(&m_rules);
+
+    std::string spec;
+    for (auto& r : *rules)
+    {
+        if (!spec.empty())
+        {
+            spec += ";";
+        }
+        spec += r.m_spec;
+    }
+    return spec.empty() ? "none" : spec;
+}
+
+FaultInjector::Action
+FaultInjector::decide(beast::string_view target) const
+{
+    Action action;
+
+    // Strip the query, rules match the path only
+    auto path = target.substr(0, target.find('?'));
+    if (path.starts_with("/admin"))
+    {
+        return action;
+    }
+
+    auto rules = std::atomic_load(&m_rules);
+    auto it = std::find_if(rules->begin(), rules->end(), [&](const Rule& r) {
+        return r.m_target == "*" || path == r.m_target;
+    });
+    if (it == rules->end())
+    {
+        return action;
+    }
+
+    auto& engine = random_engine();
+    std::uniform_real_distribution<double> coin(0, 1);
+
+    double ms = 0;
+    switch (it->m_delay.m_kind)
+    {
+    case Delay::none:
+        break;
+    case Delay::fixed:
+        ms = it->m_delay.m_a;
+        break;
+    case Delay::uniform:
+        ms = std::uniform_real_distribution<double>(it->m_delay.m_a, it->m_delay.m_b)(engine);
+        break;
+    case Delay::exponential:
+        ms = std::exponential_distribution<double>(1 / it->m_delay.m_a)(engine);
+        break;
+    case Delay::normal:
+        ms = std::max(0.,
+                      std::normal_distribution<double>(it->m_delay.m_a, it->m_delay.m_b)(engine));
+        break;
+    }
+
+    action.m_delay = std::chrono::microseconds(static_cast<long long>(ms * 1000));
+    action.m_drop = it->m_drop > 0 && coin(engine) < it->m_drop;
+    action.m_error = !action.m_drop && it->m_error > 0 && coin(engine) < it->m_error;
+    return action;
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <boost/beast/core.hpp>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace beast = boost::beast;  // from <boost/beast.hpp>
+
+// Latency and failure injection to emulate slow or flaky nodes.
+// Applied by ServerSession with a timer, so no thread is blocked.
+//
+// Spec: rules separated by ';', each rule is
+//   <target>:<key>=<value>[,<key>=<value>...]
+// target - request target ("/addbatch") or "*" for any
+// delay  - fixed:<ms> | uniform:<min_ms>-<max_ms> | exp:<mean_ms> | normal:<mean_ms>-<stddev_ms>
+// drop   - probability to close the connection without a response
+// error  - probability to answer 503
+// Example: /addbatch:delay=uniform:1000-10000,drop=0.01;*:error=0.001
+class FaultInjector
+{
+public:
+    struct Action
+    {
+        std::chrono::microseconds m_delay{0};
+        bool m_drop = false;
+        bool m_error = false;
+    };
+
+    // Replaces all rules. On error keeps the previous rules and fills why.
+    bool configure(const std::string& spec, std::string& why);
+
+    // Current rules in the spec format
+    std::string describe() const;
+
+    // Rolls the dice for one request. Admin targets are never affected.
+    Action decide(beast::string_view target) const;
+
+private:
+    struct Delay
+    {
+        enum Kind
+        {
+            none,
+            fixed,
+            uniform,
+            exponential,
+            normal
+        };
+
+        Kind m_kind = none;
+        double m_a = 0;
+        double m_b = 0;
+    };
+
+    struct Rule
+    {
+        std::string m_target;
+        std::string m_spec;
+        Delay m_delay;
+        double m_drop = 0;
+        double m_error = 0;
+    };
+
+    typedef std::vector<Rule> Rules;
+
+    static bool parse_delay(const std::string& value, Delay& delay);
+
+    // Swapped atomically by configure, read without locks by decide
+    std::shared_ptr<const Rules> m_rules = std::make_shared<Rules>();
+};
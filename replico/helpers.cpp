@@ -1,18 +1,262 @@
 #include "replico_server.h"
-#include "client_session.h"
+#include "addlog_parser.h"
 #include "log_time_scope.h"
+#include "logger.h"
+#include "log_streamer.h"
 #include "server_session.h"
-#include <random>
-#include <boost/property_tree/json_parser.hpp>
+#include <atomic>
+#include <limits>
+#include <boost/asio/steady_timer.hpp>
 
 namespace
 {
-std::uniform_int_distribution<int> dice_distribution(1, 10);
-std::mt19937 random_number_engine;  // pseudorandom number generator
-auto rgen = std::bind(dice_distribution, random_number_engine);
-}  // namespace
+// Logs rendered per slice
+const size_t GETLOG_SLICE = 256;
+
+// Seconds a refused writer is asked to wait, see admission control
+const char* const RETRY_AFTER_S = "1";
+
+// Fault injection and logging change how the node behaves: clients on this
+// host may use them, others need --admin-token in the pwd header
+bool
+admin_allowed(const http::request<http::string_body>& req,
+              const RServer* context,
+              const tcp::endpoint& remote_endpoint)
+{
+    auto address = remote_endpoint.address();
+    if (address.is_v6() && address.to_v6().is_v4_mapped())
+    {
+        address = net::ip::make_address_v4(net::ip::v4_mapped, address.to_v6());
+    }
+    if (address.is_loopback())
+    {
+        return true;
+    }
+
+    // Compared in constant time, the token is a secret
+    auto& token = context->m_admin_token;
+    auto given = req["pwd"];
+    if (token.empty() || given.size() != token.size())
+    {
+        return false;
+    }
+    unsigned char diff = 0;
+    for (size_t i = 0; i < token.size(); ++i)
+    {
+        diff |= static_cast<unsigned char>(given[i] ^ token[i]);
+    }
+    return diff == 0;
+}
+
+// Non-negative integer of a query parameter, the whole text must be one.
+// Checked like option(): lexical_cast wraps "-1" around for unsigned types.
+bool
+parse_count(const std::string& text, size_t& value)
+{
+    return text.find('-') == std::string::npos &&
+           boost::conversion::try_lexical_convert(text, value);
+}
+
+// Holds the /addlog response until the log reaches its write concern.
+// No thread waits for it: the response is sent from the ack handler
+// or from the timeout, whichever comes first.
+struct PendingWrite : public std::enable_shared_from_this<PendingWrite>
+{
+    PendingWrite(std::shared_ptr<ServerSession> session,
+                 RServer* context,
+                 unsigned version,
+                 bool keep_alive,
+                 size_t expected_wc)
+        : m_session(std::move(session))
+        , m_context(context)
+        , m_timer(m_session->stream_.get_executor())
+        , m_version(version)
+        , m_keep_alive(keep_alive)
+        , m_expected_wc(expected_wc)
+        , m_start(std::chrono::steady_clock::now())
+    {
+    }
+
+    // Called on the session strand right after the log is added
+    void
+    start_timer(size_t id, std::chrono::milliseconds timeout)
+    {
+        m_timer.expires_after(timeout);
+        m_timer.async_wait([self = shared_from_this(), id](beast::error_code ec) {
+            if (ec)
+            {
+                return;
+            }
+            self->finish(self->m_context->cancel_ack(id), true);
+        });
+    }
+
+    // May be called from any thread, only the first call responds.
+    // Not durable: master failed to persist the log, the write is refused.
+    void
+    finish(size_t actual_wc, bool timed_out, bool durable = true)
+    {
+        if (m_done.exchange(true))
+        {
+            return;
+        }
+
+        m_context->m_metrics.m_ack_lag.observe(std::chrono::steady_clock::now() - m_start);
+        if (durable && actual_wc < m_expected_wc)
+        {
+            m_context->m_metrics.m_partial_acks.add();
+        }
+        if (m_admitted)
+        {
+            m_context->release_write(m_bytes);
+        }
+
+        net::post(m_session->stream_.get_executor(), [self = shared_from_this(), actual_wc,
+                                                      timed_out, durable]() {
+            self->m_timer.cancel();
+
+            std::string body;
+            auto status = http::status::ok;
+            if (!durable)
+            {
+                // The log may still show up, as with any refused write
+                status = http::status::service_unavailable;
+                body = "Log could not be persisted";
+            }
+            else if (timed_out && actual_wc < self->m_expected_wc)
+            {
+                // Partial acknowledgement
+                status = http::status::accepted;
+                body = "PARTIAL " + std::to_string(actual_wc) + "/" +
+                       std::to_string(self->m_expected_wc);
+            }
+            else
+            {
+                body = "CONGRATS!";
+            }
+
+            http::response<http::string_body> res{status, self->m_version};
+            res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
+            if (!durable)
+            {
+                res.set(http::field::retry_after, RETRY_AFTER_S);
+            }
+
+            // Token for reading the log back from any node, see min_index
+            res.set("X-Log-Index", std::to_string(self->m_id));
+            res.keep_alive(self->m_keep_alive);
+            res.body() = std::move(body);
+            res.prepare_payload();
+            self->m_session->lambda_(std::move(res));
+        });
+    }
+
+    std::shared_ptr<ServerSession> m_session;
+    RServer* m_context;
+    net::steady_timer m_timer;
+    unsigned m_version;
+    bool m_keep_alive;
+    size_t m_expected_wc;
+    std::chrono::steady_clock::time_point m_start;
+    std::atomic<bool> m_done{false};
+
+    // Set on the session strand right after the log is added,
+    // before the response posted there reads it
+    size_t m_id = 0;
+
+    // Room taken by admission control, given back on the response
+    bool m_admitted = false;
+    size_t m_bytes = 0;
+};
+
+// Holds a /getlog?min_index=N until the log reaches N or the wait expires.
+// No thread waits: the publisher of log N posts the request back to the
+// session, which answers it as usual. A secondary which does not get there
+// in time sends the client to master, master refuses the request.
+struct PendingRead : public std::enable_shared_from_this<PendingRead>
+{
+    PendingRead(std::shared_ptr<ServerSession> session,
+                RServer* context,
+                http::request<http::string_body>&& req,
+                tcp::endpoint remote_endpoint,
+                size_t index)
+        : m_session(std::move(session))
+        , m_context(context)
+        , m_timer(m_session->stream_.get_executor())
+        , m_req(std::move(req))
+        , m_remote_endpoint(remote_endpoint)
+        , m_index(index)
+    {
+    }
+
+    // Called on the session strand
+    void
+    start(std::chrono::milliseconds timeout)
+    {
+        m_timer.expires_after(timeout);
+        m_timer.async_wait([self = shared_from_this()](beast::error_code ec) {
+            if (ec)
+            {
+                return;
+            }
+            self->finish();
+        });
+
+        m_ticket = m_context->wait_for_log(m_index, [self = shared_from_this()] {
+            net::post(self->m_session->stream_.get_executor(), [self] { self->finish(); });
+        });
+    }
+
+    // On the session strand, only the first call responds
+    void
+    finish()
+    {
+        if (m_done)
+        {
+            return;
+        }
+        m_done = true;
+        m_timer.cancel();
+        m_context->cancel_wait(m_index, m_ticket);
 
-extern std::mutex STDOUT_LOCK;
+        if (m_context->log_count() > m_index)
+        {
+            return handle_request(std::move(m_req), m_session->lambda_, m_context,
+                                  m_remote_endpoint);
+        }
+
+        http::response<http::string_body> res;
+        res.version(m_req.version());
+        res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
+        if (m_context->m_is_root)
+        {
+            res.result(http::status::service_unavailable);
+            res.body() = "Index not reached";
+        }
+        else
+        {
+            // Master has every acknowledged log
+            auto& root = m_context->m_root_endpoint;
+            res.result(http::status::temporary_redirect);
+            res.set(http::field::location, "http://" + root.address().to_string() + ":" +
+                                               std::to_string(root.port()) +
+                                               std::string(m_req.target()));
+        }
+        res.keep_alive(m_req.keep_alive());
+        res.prepare_payload();
+        m_session->lambda_(std::move(res));
+    }
+
+    std::shared_ptr<ServerSession> m_session;
+    RServer* m_context;
+    net::steady_timer m_timer;
+    http::request<http::string_body> m_req;
+    tcp::endpoint m_remote_endpoint;
+    size_t m_index;
+    uint64_t m_ticket = 0;
+    bool m_done = false;
+};
+}  // namespace
 
 void
 handle_request(http::request<http::string_body>&& req,
@@ -20,8 +264,21 @@ handle_request(http::request<http::string_body>&& req,
                RServer* context,
                tcp::endpoint remote_endpoint)
 {
+    // Returns a response refusing a write for now
+    auto const overloaded = [&req](http::status status, beast::string_view why) {
+        http::response<http::string_body> res{status, req.version()};
+        res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
+        res.set(http::field::retry_after, RETRY_AFTER_S);
+        res.keep_alive(req.keep_alive());
+        res.body() = std::string(why);
+        res.prepare_payload();
+        return res;
+    };
+
     // Returns a bad request response
-    auto const bad_request = [&req](beast::string_view why) {
+    auto const bad_request = [&req, context](beast::string_view why) {
+        context->m_metrics.m_bad_requests.add();
+
         http::response<http::string_body> res{http::status::bad_request, req.version()};
         res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
         res.set(http::field::content_type, "text/html");
@@ -33,81 +290,249 @@ handle_request(http::request<http::string_body>&& req,
 
     LogTimeScope g(__FUNCTION__, context->m_is_root);
 
-    auto prefix = req.target();
+    auto target = req.target();
+    auto prefix = target.substr(0, target.find('?'));
+    auto query = parse_query(target);
 
     std::string body;
+    std::string next_id;
+    std::string first_id;
+    std::string applied_index;
+    const char* content_type = nullptr;
     auto isAdd = req.method() == http::verb::post && "/addlog" == prefix;
     auto isGet = req.method() == http::verb::get && prefix == "/getlog";
 
-    if (context->m_is_root)
+    if (prefix.starts_with("/admin/") && !admin_allowed(req, context, remote_endpoint))
     {
-        if (isAdd)
-        {
-            boost::property_tree::ptree pt;
-            std::stringstream ss;
-            ss << req.body();
-            read_json(ss, pt);
-
-            auto log = pt.get<std::string>("data");
-            auto wc = pt.get<size_t>("wc");
-            auto id = context->add_log(log, wc);
-
-            body = "CONGRATS!";
-            size_t wc_idx = 0;
+        http::response<http::string_body> res{http::status::forbidden, req.version()};
+        res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
+        res.keep_alive(req.keep_alive());
+        res.body() = "Admin requests need --admin-token in the pwd header";
+        res.prepare_payload();
+        return send(std::move(res));
+    }
 
-            // Schedule write to secondaries
-            for (auto& n : context->m_nodes)
+    // Latency and failure injection rules
+    if (prefix == "/admin/fault")
+    {
+        if (req.method() == http::verb::post || req.method() == http::verb::delete_)
+        {
+            std::string why;
+            auto spec = req.method() == http::verb::post ? req.body() : std::string();
+            if (!context->m_faults.configure(spec, why))
             {
-                if (wc_idx >= wc)
-                {
-                    break;
-                }
-                std::make_shared<ClientSession>(context)->run(n.ip, n.port, "/addlog", log, id);
-                ++wc_idx;
+                return send(bad_request(why));
             }
         }
-        else if (isGet)
+        else if (req.method() != http::verb::get)
+        {
+            return send(bad_request("Illegal method"));
+        }
+        body = context->m_faults.describe() + "\n";
+    }
+    else if (prefix == "/admin/log")
+    {
+        // POST /admin/log?level=<level>&sample=<n>
+        if (req.method() == http::verb::post)
         {
-            auto reg = context->get_logs();
-            for (auto& l : reg)
+            logger::Level level;
+            if (query.count("level"))
+            {
+                if (!logger::parse_level(query["level"], level))
+                {
+                    return send(bad_request("Unknown log level"));
+                }
+                logger::set_level(level);
+            }
+
+            if (query.count("sample"))
             {
-                body += l.m_data;
-                body += " [" + std::to_string(l.m_actual_wc) + "/" +
-                        std::to_string(l.m_expected_wc) + "]";
-                body += "\n";
+                try
+                {
+                    logger::set_sample(std::stoul(query["sample"]));
+                }
+                catch (const std::exception&)
+                {
+                    return send(bad_request("Bad sample"));
+                }
             }
         }
-        else
+        else if (req.method() != http::verb::get)
         {
-            return send(bad_request("Illegal request-target"));
+            return send(bad_request("Illegal method"));
         }
+        body = std::string("level=") + logger::level_name(logger::level()) +
+               " sample=" + std::to_string(logger::sample()) +
+               " dropped=" + std::to_string(logger::dropped()) + "\n";
     }
-    else
+    else if (req.method() == http::verb::get && prefix == "/stats")
+    {
+        body = context->memory_stats();
+    }
+    else if (req.method() == http::verb::get && prefix == "/health")
     {
-        if (isAdd && remote_endpoint.address() == context->m_root_endpoint.address())
+        content_type = "application/json";
+        body = context->health();
+    }
+    else if (req.method() == http::verb::get && prefix == "/metrics")
+    {
+        content_type = "text/plain; version=0.0.4";
+        body = context->render_metrics();
+    }
+    else if (isGet)
+    {
+        // /getlog?from=<id>&limit=<n>[&stream=1][&min_index=<id>[&wait_ms=<ms>]]
+        size_t from = 0;
+        size_t limit = std::numeric_limits<size_t>::max();
+        size_t min_index = 0;
+        size_t wait_ms = 0;
+        if ((query.count("from") && !parse_count(query["from"], from)) ||
+            (query.count("limit") && !parse_count(query["limit"], limit)) ||
+            (query.count("min_index") && !parse_count(query["min_index"], min_index)) ||
+            (query.count("wait_ms") && !parse_count(query["wait_ms"], wait_ms)))
+        {
+            return send(bad_request("Bad from, limit, min_index or wait_ms"));
+        }
+
+        // A client may wait shorter than --min-index-wait-ms, not longer
+        auto wait = context->m_min_index_wait;
+        auto longest = static_cast<size_t>(std::max<int64_t>(wait.count(), 0));
+        if (query.count("wait_ms") && wait_ms < longest)
+        {
+            wait = std::chrono::milliseconds(wait_ms);
+        }
+
+        // Read-your-writes: the log must include the index /addlog returned
+        if (query.count("min_index") && context->log_count() <= min_index)
+        {
+            std::make_shared<PendingRead>(send.self_.shared_from_this(), context, std::move(req),
+                                          remote_endpoint, min_index)
+                ->start(wait);
+            return;
+        }
+
+        // The logs below were compacted, the page starts at the first one kept
+        auto first = context->first_log();
+        if (from < first)
         {
-            if (req["pwd"] == "rootovich")
+            from = first;
+            first_id = std::to_string(first);
+        }
+
+        // Logs appended after this point are not part of the response
+        auto count = context->log_count();
+        if (count > 0)
+        {
+            applied_index = std::to_string(count - 1);
+        }
+        auto end = from + std::min(limit, count - std::min(from, count));
+
+        if (query.count("stream") && query["stream"] != "0")
+        {
+            std::make_shared<LogStreamer>(send.self_.shared_from_this(), context, from, end,
+                                          req.version(), req.keep_alive())
+                ->run();
+            return;
+        }
+
+        // Writers wait for one slice at most
+        auto next = from;
+        while (next < end)
+        {
+            auto rendered = context->render_logs(next, std::min(GETLOG_SLICE, end - next), body);
+            if (rendered == 0)
             {
-                // Random sleep on secondary node before handling the request.
-                std::this_thread::sleep_for(std::chrono::seconds(rgen()));
-                std::string log = req.body();
-                context->add_log(log);
+                break;
             }
+            next += rendered;
         }
-        else if (isGet)
+        next_id = std::to_string(next);
+    }
+    else if (context->m_is_root)
+    {
+        if (isAdd)
         {
-            auto reg = context->get_logs();
-            for (auto& l : reg)
+            AddLogRequest fields;
+            const char* why = nullptr;
+            if (!parse_addlog(req.body(), fields, why))
+            {
+                return send(bad_request(why));
+            }
+
+            auto wc = fields.m_wc;
+            auto timeout = fields.m_has_timeout ? std::chrono::milliseconds(fields.m_timeout_ms)
+                                                : context->m_wc_timeout;
+
+            // Master itself counts toward the write concern
+            if (wc > context->m_nodes.size() + 1)
+            {
+                return send(bad_request("Write concern exceeds number of nodes"));
+            }
+
+            // Fail fast instead of waiting for secondaries which are down
+            if (wc > context->healthy_nodes() + 1)
+            {
+                context->m_metrics.m_unreachable_wc.add();
+                return send(overloaded(http::status::service_unavailable,
+                                       "Write concern exceeds healthy nodes"));
+            }
+
+            // The response is sent once the write concern is reached
+            auto pending = std::make_shared<PendingWrite>(send.self_.shared_from_this(), context,
+                                                          req.version(), req.keep_alive(), wc);
+
+            // Writes which are not answered at once wait within the
+            // budget; beyond it the client backs off instead of piling up
+            if (wc > (context->m_wal ? 0 : 1))
+            {
+                auto bytes = fields.m_data.size();
+                switch (context->admit_write(bytes))
+                {
+                case RServer::too_many_writes:
+                    return send(overloaded(http::status::too_many_requests,
+                                           "Too many writes waiting for their write concern"));
+                case RServer::too_many_bytes:
+                    return send(overloaded(http::status::service_unavailable,
+                                           "Too many bytes waiting for replication"));
+                case RServer::admitted:
+                    pending->m_admitted = true;
+                    pending->m_bytes = bytes;
+                    break;
+                }
+            }
+            size_t id = 0;
+            if (!context->add_log(fields.m_data, wc, id,
+                                  [pending](size_t actual_wc, bool durable) {
+                                      pending->finish(actual_wc, false, durable);
+                                  }))
+            {
+                if (pending->m_admitted)
+                {
+                    context->release_write(pending->m_bytes);
+                }
+                return send(overloaded(http::status::insufficient_storage,
+                                       "Log store is full, older logs must be compacted"));
+            }
+            pending->m_id = id;
+
+            if (timeout.count() > 0)
             {
-                body += l.m_data;
-                body += "\n";
+                pending->start_timer(id, timeout);
             }
+
+            // Replication to secondaries is scheduled once the log is published
+            return;
         }
         else
         {
             return send(bad_request("Illegal request-target"));
         }
     }
+    else
+    {
+        // Master replicates over the replication port, see ReplicationSession
+        return send(bad_request("Illegal request-target"));
+    }
 
     // Cache the size since we need it after the move
     auto const size = body.size();
@@ -119,6 +544,29 @@ handle_request(http::request<http::string_body>&& req,
     res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
     res.content_length(size);
 
+    if (content_type)
+    {
+        res.set(http::field::content_type, content_type);
+    }
+
+    if (!next_id.empty())
+    {
+        // Where the next page starts
+        res.set("X-Next-Id", next_id);
+    }
+
+    if (!first_id.empty())
+    {
+        // Logs before this one were requested but are gone
+        res.set("X-First-Id", first_id);
+    }
+
+    if (!applied_index.empty())
+    {
+        // Highest log this node has, compare with X-Log-Index of /addlog
+        res.set("X-Applied-Index", applied_index);
+    }
+
     res.keep_alive(req.keep_alive());
     return send(std::move(res));
 }
@@ -126,6 +574,62 @@ handle_request(http::request<http::string_body>&& req,
 void
 fail(beast::error_code ec, char const* what)
 {
-    std::lock_guard<std::mutex> lock(STDOUT_LOCK);
-    std::cerr << what << ": " << ec.message() << "\n";
+    if (logger::enabled(logger::error))
+    {
+        logger::Line(logger::error) << what << ": " << ec.message();
+    }
+}
+
+std::map<std::string, std::string>
+parse_options(int argc, char* argv[], int first)
+{
+    std::map<std::string, std::string> options;
+    for (int i = first; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        if (arg.compare(0, 2, "--") != 0)
+        {
+            continue;
+        }
+
+        auto eq = arg.find('=');
+        if (eq == std::string::npos)
+        {
+            options[arg.substr(2)] = "1";
+        }
+        else
+        {
+            options[arg.substr(2, eq - 2)] = arg.substr(eq + 1);
+        }
+    }
+    return options;
+}
+
+std::map<std::string, std::string>
+parse_query(beast::string_view target)
+{
+    std::map<std::string, std::string> query;
+
+    auto q = target.find('?');
+    if (q == beast::string_view::npos)
+    {
+        return query;
+    }
+
+    std::vector<std::string> pairs;
+    auto params = target.substr(q + 1);
+    boost::split(pairs, params, boost::is_any_of("&"));
+    for (auto& p : pairs)
+    {
+        auto eq = p.find('=');
+        if (eq == std::string::npos)
+        {
+            query[p] = "";
+        }
+        else
+        {
+            query[p.substr(0, eq)] = p.substr(eq + 1);
+        }
+    }
+    return query;
 }
@@ -2,6 +2,8 @@
 
 #include "replico_server.h"
 #include "server_session.h"
+#include <map>
+#include <string>
 
 namespace beast = boost::beast;    // from <boost/beast.hpp>
 namespace http = beast::http;      // from <boost/beast/http.hpp>
@@ -11,6 +13,13 @@ class RServer;
 
 // Report a failure
 void fail(beast::error_code ec, char const* what);
+
+// Splits "?a=1&b=2" of the request target into a map
+std::map<std::string, std::string> parse_query(beast::string_view target);
+
+// Collects "--name=value" arguments starting from argv[first]
+std::map<std::string, std::string> parse_options(int argc, char* argv[], int first);
+
 void handle_request(http::request<http::string_body>&& req,
                     ServerSession::send_lambda& send,
                     RServer* context,
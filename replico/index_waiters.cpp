@@ -0,0 +1,64 @@
+#include "index_waiters.h"
+#include <vector>
+
+uint64_t
+IndexWaiters::wait(size_t index, handler fn)
+{
+    uint64_t ticket;
+    {
+        std::lock_guard<std::mutex> g(m_lock);
+        ticket = m_next_ticket++;
+        m_waiters.emplace(index, Waiter{ticket, std::move(fn)});
+        m_lowest = m_waiters.begin()->first;
+    }
+
+    // Pairs with the fence in applied(): either the publisher sees the
+    // waiter or the caller sees the log
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    return ticket;
+}
+
+void
+IndexWaiters::cancel(size_t index, uint64_t ticket)
+{
+    std::lock_guard<std::mutex> g(m_lock);
+    auto range = m_waiters.equal_range(index);
+    for (auto it = range.first; it != range.second; ++it)
+    {
+        if (it->second.m_ticket == ticket)
+        {
+            m_waiters.erase(it);
+            break;
+        }
+    }
+    m_lowest = m_waiters.empty() ? std::numeric_limits<size_t>::max() : m_waiters.begin()->first;
+}
+
+void
+IndexWaiters::applied(size_t end)
+{
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (end <= m_lowest.load(std::memory_order_relaxed))
+    {
+        return;
+    }
+
+    // Called outside the lock, a waiter may register again
+    std::vector<handler> ready;
+    {
+        std::lock_guard<std::mutex> g(m_lock);
+        auto last = m_waiters.lower_bound(end);
+        for (auto it = m_waiters.begin(); it != last; ++it)
+        {
+            ready.push_back(std::move(it->second.m_fn));
+        }
+        m_waiters.erase(m_waiters.begin(), last);
+        m_lowest =
+            m_waiters.empty() ? std::numeric_limits<size_t>::max() : m_waiters.begin()->first;
+    }
+
+    for (auto& fn : ready)
+    {
+        fn();
+    }
+}
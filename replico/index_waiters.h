@@ -0,0 +1,44 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <map>
+#include <mutex>
+
+// Readers waiting until the log reaches an index (/getlog?min_index=N).
+// Waiters are kept by index. The publisher checks one atomic per published
+// log and takes the lock only once the lowest index waited for is reached,
+// writers pay next to nothing while no reader waits. Thread safe.
+class IndexWaiters
+{
+public:
+    typedef std::function<void()> handler;
+
+    // Calls fn from applied() once the log passes index. The caller checks
+    // the log after registering, the update may have come in between.
+    // Returns a ticket for cancel.
+    uint64_t wait(size_t index, handler fn);
+
+    // Forgets a waiter which was not called yet
+    void cancel(size_t index, uint64_t ticket);
+
+    // Logs below end are applied, calls the waiters of the indexes below end
+    void applied(size_t end);
+
+private:
+    struct Waiter
+    {
+        uint64_t m_ticket;
+        handler m_fn;
+    };
+
+    std::mutex m_lock;
+    std::multimap<size_t, Waiter> m_waiters;
+    uint64_t m_next_ticket = 0;
+
+    // Lowest index waited for, max when nobody waits
+    std::atomic<size_t> m_lowest{std::numeric_limits<size_t>::max()};
+};
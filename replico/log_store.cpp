@@ -0,0 +1,256 @@
+#include "log_store.h"
+#include <stdexcept>
+#include <vector>
+
+LogStore::LogStore()
+    : m_chunks(new std::atomic<Chunk*>[MAX_CHUNKS])
+    , m_generations(new std::atomic<PayloadArena*>[MAX_GENERATIONS])
+{
+    for (size_t i = 0; i < MAX_CHUNKS; ++i)
+    {
+        m_chunks[i].store(nullptr, std::memory_order_relaxed);
+    }
+    for (size_t i = 0; i < MAX_GENERATIONS; ++i)
+    {
+        m_generations[i].store(nullptr, std::memory_order_relaxed);
+    }
+    m_readers[0].store(0);
+    m_readers[1].store(0);
+}
+
+LogStore::~LogStore()
+{
+    for (size_t i = 0; i < MAX_CHUNKS; ++i)
+    {
+        delete m_chunks[i].load(std::memory_order_relaxed);
+    }
+    for (size_t i = 0; i < MAX_GENERATIONS; ++i)
+    {
+        auto arena = m_generations[i].load(std::memory_order_relaxed);
+        if (arena)
+        {
+            arena->release();
+        }
+    }
+}
+
+void
+LogStore::set_base(size_t base)
+{
+    m_base = base;
+    m_first = base;
+}
+
+LogStore::Chunk*
+LogStore::allocate(size_t index)
+{
+    // reserve keeps ids below limit()
+    if (index >= m_freed_chunks.load() + MAX_CHUNKS)
+    {
+        throw std::length_error("log store is full");
+    }
+
+    // Several writers may race for a new chunk, one of them wins
+    auto chunk = new Chunk;
+    chunk->m_index = index;
+    Chunk* expected = nullptr;
+    if (!m_chunks[index & (MAX_CHUNKS - 1)].compare_exchange_strong(expected, chunk,
+                                                                    std::memory_order_acq_rel))
+    {
+        delete chunk;
+        return expected;
+    }
+
+    ++m_chunk_count;
+    return chunk;
+}
+
+PayloadArena*
+LogStore::generation(size_t index)
+{
+    auto& slot = m_generations[index & (MAX_GENERATIONS - 1)];
+    auto arena = slot.load(std::memory_order_acquire);
+    if (arena)
+    {
+        return arena;
+    }
+
+    // reserve keeps ids below limit()
+    if (index >= m_freed_generations.load() + MAX_GENERATIONS)
+    {
+        throw std::length_error("log store is full");
+    }
+
+    auto created = new PayloadArena;
+    if (!slot.compare_exchange_strong(arena, created, std::memory_order_acq_rel))
+    {
+        delete created;
+        return arena;
+    }
+    return created;
+}
+
+boost::string_view
+LogStore::copy(size_t id, boost::string_view payload)
+{
+    auto chunk = (id - m_base) >> CHUNK_BITS;
+    return generation(chunk >> GENERATION_BITS)->copy(payload);
+}
+
+PayloadArena::Stats
+LogStore::arena_stats() const
+{
+    ReadGuard guard(*this);
+
+    PayloadArena::Stats total;
+    for (size_t i = 0; i < MAX_GENERATIONS; ++i)
+    {
+        auto arena = m_generations[i].load(std::memory_order_acquire);
+        if (arena)
+        {
+            auto s = arena->stats();
+            total.m_blocks += s.m_blocks;
+            total.m_reserved_bytes += s.m_reserved_bytes;
+            total.m_payload_bytes += s.m_payload_bytes;
+            total.m_payloads += s.m_payloads;
+        }
+    }
+    return total;
+}
+
+void
+LogStore::commit(size_t id)
+{
+    at(id).m_ready.store(true);
+    publish();
+}
+
+void
+LogStore::publish()
+{
+    for (;;)
+    {
+        // Whoever holds the flag publishes our entry as well
+        if (m_publishing.exchange(true))
+        {
+            return;
+        }
+
+        auto next = m_published.load(std::memory_order_relaxed);
+        while (next < m_reserved.load() && at(m_base + next).m_ready.load())
+        {
+            // Visible to readers before the handler runs, so whoever the
+            // handler wakes up finds the entry
+            m_published.store(next + 1, std::memory_order_release);
+            if (m_on_publish)
+            {
+                m_on_publish(m_base + next, at(m_base + next));
+            }
+            ++next;
+        }
+
+        m_publishing.store(false);
+
+        // An entry committed after the check above but before the flag
+        // was released found the flag taken, publish it here
+        if (next >= m_reserved.load() || !at(m_base + next).m_ready.load())
+        {
+            return;
+        }
+    }
+}
+
+unsigned
+LogStore::enter() const
+{
+    for (;;)
+    {
+        auto epoch = m_epoch.load();
+        m_readers[epoch].fetch_add(1);
+
+        // The epoch flipped in between, the truncation may not wait for us
+        if (m_epoch.load() == epoch)
+        {
+            return epoch;
+        }
+        m_readers[epoch].fetch_sub(1);
+    }
+}
+
+void
+LogStore::truncate(size_t below)
+{
+    std::lock_guard<std::mutex> g(m_truncate_lock);
+    truncate_locked(std::min(below, published()));
+}
+
+void
+LogStore::skip_to(size_t id)
+{
+    std::lock_guard<std::mutex> g(m_truncate_lock);
+
+    // Nobody may read the skipped ids, they have no chunks
+    truncate_locked(id);
+    m_reserved.store(id - m_base);
+    m_published.store(id - m_base, std::memory_order_release);
+}
+
+void
+LogStore::truncate_locked(size_t below)
+{
+    if (below <= m_first.load())
+    {
+        return;
+    }
+
+    // Readers starting from now on stay at or above below, wait for the
+    // ones which may have seen the old first id
+    m_first.store(below);
+    auto epoch = m_epoch.load();
+    m_epoch.store(epoch ^ 1);
+    while (m_readers[epoch].load() != 0)
+    {
+        std::this_thread::yield();
+    }
+
+    // Chunks and generations entirely below are free. Only the last
+    // MAX_CHUNKS of them may still be in their slots.
+    auto chunks = (below - m_base) >> CHUNK_BITS;
+    auto from = std::max(m_freed_chunks.load(), chunks > MAX_CHUNKS ? chunks - MAX_CHUNKS : 0);
+    std::vector<Chunk*> freed_chunks;
+    for (auto i = from; i < chunks; ++i)
+    {
+        auto chunk = m_chunks[i & (MAX_CHUNKS - 1)].exchange(nullptr);
+        if (chunk)
+        {
+            freed_chunks.push_back(chunk);
+        }
+    }
+    m_freed_chunks = std::max(m_freed_chunks.load(), chunks);
+
+    auto generations = chunks >> GENERATION_BITS;
+    auto first_generation =
+        std::max(m_freed_generations.load(),
+                 generations > MAX_GENERATIONS ? generations - MAX_GENERATIONS : 0);
+    std::vector<PayloadArena*> freed_generations;
+    for (auto i = first_generation; i < generations; ++i)
+    {
+        auto arena = m_generations[i & (MAX_GENERATIONS - 1)].exchange(nullptr);
+        if (arena)
+        {
+            freed_generations.push_back(arena);
+        }
+    }
+    m_freed_generations = std::max(m_freed_generations.load(), generations);
+
+    for (auto chunk : freed_chunks)
+    {
+        delete chunk;
+        --m_chunk_count;
+    }
+    // Batches being written to secondaries may still hold some of them
+    for (auto arena : freed_generations)
+    {
+        arena->release();
+    }
+}
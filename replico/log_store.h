@@ -0,0 +1,289 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include "payload_arena.h"
+
+struct LogEntry
+{
+    // The log message itself, stored in the PayloadArena of the LogStore
+    boost::string_view m_data;
+
+    // Master - crc32 of m_data, computed once for all the secondaries
+    uint32_t m_crc = 0;
+
+    // Expected write concern
+    size_t m_expected_wc = 0;
+
+    // Number of successful posts to secondaries
+    std::atomic<size_t> m_actual_wc{0};
+
+    // Waiter for the write concern (master) or for durability (secondary),
+    // durable is false if the write-ahead log failed to store the log.
+    // Owned by whoever flips m_ack_taken first.
+    std::function<void(size_t actual_wc, bool durable)> m_on_ack;
+    std::atomic<bool> m_ack_taken{false};
+
+    // Filled by the writer, may be published
+    std::atomic<bool> m_ready{false};
+};
+
+// Append-only log built of fixed-size chunks which never move.
+//
+// A writer reserves ids with one atomic increment, fills the entries
+// and commits them. Committed entries are published in id order: the
+// watermark only moves over a contiguous prefix and the publish handler
+// sees every entry exactly once, in order, from whichever committing
+// thread happens to advance the watermark.
+// Readers walk [first, published) without any locks.
+//
+// The prefix may be truncated (compaction). Chunks and payloads are freed
+// once every reader which started before the truncation is done: readers
+// hold a ReadGuard, which counts them per epoch, and the truncation flips
+// the epoch and waits for the readers of the previous one. Payloads of
+// every GENERATION_CHUNKS chunks share an arena, which goes as a whole.
+// Chunk and arena slots are reused round-robin, so memory depends on the
+// number of logs kept, not on the number ever written.
+class LogStore
+{
+public:
+    static const size_t CHUNK_BITS = 12;
+    static const size_t CHUNK_SIZE = size_t(1) << CHUNK_BITS;
+
+    // Chunks alive at once
+    static const size_t MAX_CHUNKS = size_t(1) << 16;
+
+    static const size_t GENERATION_BITS = 2;
+    static const size_t GENERATION_CHUNKS = size_t(1) << GENERATION_BITS;
+    static const size_t MAX_GENERATIONS = MAX_CHUNKS / GENERATION_CHUNKS;
+
+    typedef std::function<void(size_t id, LogEntry& entry)> publish_handler;
+
+    LogStore();
+    ~LogStore();
+
+    LogStore(const LogStore&) = delete;
+    LogStore& operator=(const LogStore&) = delete;
+
+    // Keeps the entries and payloads of truncated logs alive while held
+    class ReadGuard
+    {
+    public:
+        explicit ReadGuard(const LogStore& store)
+            : m_store(store)
+            , m_epoch(store.enter())
+        {
+        }
+
+        ~ReadGuard()
+        {
+            m_store.m_readers[m_epoch].fetch_sub(1);
+        }
+
+        ReadGuard(const ReadGuard&) = delete;
+        ReadGuard& operator=(const ReadGuard&) = delete;
+
+    private:
+        const LogStore& m_store;
+        unsigned m_epoch;
+    };
+
+    // Ids below base belong to the sealed segments. Set before the first append.
+    void set_base(size_t base);
+
+    size_t
+    base() const
+    {
+        return m_base;
+    }
+
+    // First id still held, the ones below were truncated
+    size_t
+    first() const
+    {
+        return m_first.load();
+    }
+
+    // Thread safe. Copies the payload of the reserved id into the arena
+    // of its generation.
+    boost::string_view copy(size_t id, boost::string_view payload);
+
+    // Payload memory of all generations still held
+    PayloadArena::Stats arena_stats() const;
+
+    // Arena the payload of a published id lives in. Hold a ReadGuard.
+    PayloadArena*
+    arena(size_t id) const
+    {
+        auto chunk = (id - m_base) >> CHUNK_BITS;
+        return m_generations[(chunk >> GENERATION_BITS) & (MAX_GENERATIONS - 1)].load(
+            std::memory_order_acquire);
+    }
+
+    // Keeps the arena, and the payloads in it, alive while the pointer is
+    // held, truncated or not. Hold a ReadGuard while calling.
+    static std::shared_ptr<const void>
+    pin(PayloadArena* arena)
+    {
+        arena->retain();
+        return std::shared_ptr<const void>(arena, [](PayloadArena* a) { a->release(); });
+    }
+
+    // Memory taken by the entry chunks
+    size_t
+    chunk_bytes() const
+    {
+        return m_chunk_count.load() * sizeof(Chunk);
+    }
+
+    // Set before the first append
+    void
+    on_publish(publish_handler handler)
+    {
+        m_on_publish = std::move(handler);
+    }
+
+    // Reserves count consecutive ids, first is the first one. False, with
+    // nothing reserved, if they do not fit below limit().
+    bool
+    reserve(size_t count, size_t& first)
+    {
+        auto reserved = m_reserved.load();
+        do
+        {
+            if (m_base + reserved + count > limit())
+            {
+                return false;
+            }
+        } while (!m_reserved.compare_exchange_weak(reserved, reserved + count));
+
+        first = m_base + reserved;
+        return true;
+    }
+
+    // First id without a chunk and arena slot until older logs are truncated
+    size_t
+    limit() const
+    {
+        auto chunks = std::min(m_freed_chunks.load() + MAX_CHUNKS,
+                               (m_freed_generations.load() + MAX_GENERATIONS) << GENERATION_BITS);
+        return m_base + (chunks << CHUNK_BITS);
+    }
+
+    // Next id to reserve
+    size_t
+    end() const
+    {
+        return m_base + m_reserved.load();
+    }
+
+    // Entry of a reserved id
+    LogEntry&
+    at(size_t id)
+    {
+        auto i = id - m_base;
+        auto chunk = m_chunks[(i >> CHUNK_BITS) & (MAX_CHUNKS - 1)].load(std::memory_order_acquire);
+        if (!chunk || chunk->m_index != i >> CHUNK_BITS)
+        {
+            chunk = allocate(i >> CHUNK_BITS);
+        }
+        return chunk->m_entries[i & (CHUNK_SIZE - 1)];
+    }
+
+    // The entry is filled, publish it once all the previous ones are
+    void commit(size_t id);
+
+    // Ids below the watermark are visible to readers
+    size_t
+    published() const
+    {
+        return m_base + m_published.load(std::memory_order_acquire);
+    }
+
+    // Published entry of id, null if it was truncated. Hold a ReadGuard
+    // while using it.
+    LogEntry*
+    find(size_t id)
+    {
+        if (id < m_first.load() || id >= published())
+        {
+            return nullptr;
+        }
+        auto i = id - m_base;
+        auto chunk = m_chunks[(i >> CHUNK_BITS) & (MAX_CHUNKS - 1)].load(std::memory_order_acquire);
+        return chunk && chunk->m_index == i >> CHUNK_BITS ? &chunk->m_entries[i & (CHUNK_SIZE - 1)]
+                                                          : nullptr;
+    }
+
+    // Calls fn(id, const LogEntry&) for published entries starting from id
+    // until fn returns false
+    template <class F>
+    void
+    visit(size_t id, F&& fn)
+    {
+        ReadGuard guard(*this);
+        id = std::max(id, m_first.load());
+        auto end = published();
+        for (; id < end; ++id)
+        {
+            if (!fn(id, static_cast<const LogEntry&>(at(id))))
+            {
+                return;
+            }
+        }
+    }
+
+    // Drops the published logs below id and frees their memory once no
+    // reader can see them. Blocks until the readers of the entries are done,
+    // must not be called while holding a ReadGuard.
+    void truncate(size_t below);
+
+    // Single writer only, everything reserved must be committed. Drops all
+    // logs and continues the log at id, past the end; the ids in between
+    // are never stored here.
+    void skip_to(size_t id);
+
+private:
+    struct Chunk
+    {
+        size_t m_index = 0;
+        LogEntry m_entries[CHUNK_SIZE];
+    };
+
+    Chunk* allocate(size_t index);
+    PayloadArena* generation(size_t index);
+    void publish();
+
+    unsigned enter() const;
+    void truncate_locked(size_t below);
+
+    size_t m_base = 0;
+    publish_handler m_on_publish;
+
+    // Slot of chunk i is i % MAX_CHUNKS, the one of generation g is
+    // g % MAX_GENERATIONS. Chunks and generations below the freed ones
+    // were released.
+    std::unique_ptr<std::atomic<Chunk*>[]> m_chunks;
+    std::unique_ptr<std::atomic<PayloadArena*>[]> m_generations;
+    std::atomic<size_t> m_freed_chunks{0};
+    std::atomic<size_t> m_freed_generations{0};
+
+    std::atomic<size_t> m_first{0};
+    std::atomic<size_t> m_reserved{0};
+    std::atomic<size_t> m_published{0};
+    std::atomic<size_t> m_chunk_count{0};
+
+    // Readers per epoch, truncation waits for the previous epoch to drain
+    mutable std::atomic<unsigned> m_epoch{0};
+    mutable std::atomic<size_t> m_readers[2];
+    std::mutex m_truncate_lock;
+
+    // Only one thread advances the watermark at a time
+    std::atomic<bool> m_publishing{false};
+};
@@ -0,0 +1,90 @@
+#include "log_streamer.h"
+#include "replico_server.h"
+#include "server_session.h"
+
+namespace
+{
+// Logs serialized per chunk
+const size_t SLICE = 256;
+}  // namespace
+
+LogStreamer::LogStreamer(std::shared_ptr<ServerSession> session,
+                         RServer* context,
+                         size_t from,
+                         size_t end,
+                         unsigned version,
+                         bool keep_alive)
+    : m_session(std::move(session))
+    , m_context(context)
+    , m_next(from)
+    , m_end(end)
+    , m_keep_alive(keep_alive)
+    , m_res{http::status::ok, version}
+    , m_sr{m_res}
+{
+}
+
+void
+LogStreamer::run()
+{
+    m_res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
+    m_res.set(http::field::content_type, "text/plain");
+    m_res.keep_alive(m_keep_alive);
+    m_res.chunked(true);
+
+    m_session->stream_.expires_after(std::chrono::seconds(30));
+    http::async_write_header(m_session->stream_, m_sr,
+                             beast::bind_front_handler(&LogStreamer::on_header, shared_from_this()));
+}
+
+void
+LogStreamer::on_header(beast::error_code ec, std::size_t bytes_transferred)
+{
+    boost::ignore_unused(bytes_transferred);
+
+    if (ec)
+        return fail(ec, "write");
+
+    write_slice();
+}
+
+void
+LogStreamer::write_slice()
+{
+    m_slice.clear();
+    size_t rendered = 0;
+    if (m_next < m_end)
+    {
+        rendered = m_context->render_logs(m_next, std::min(SLICE, m_end - m_next), m_slice);
+        m_next += rendered;
+    }
+
+    m_session->stream_.expires_after(std::chrono::seconds(30));
+    if (rendered == 0)
+    {
+        return net::async_write(
+            m_session->stream_, http::make_chunk_last(),
+            beast::bind_front_handler(&LogStreamer::on_last, shared_from_this()));
+    }
+
+    net::async_write(m_session->stream_, http::make_chunk(net::buffer(m_slice)),
+                     beast::bind_front_handler(&LogStreamer::on_chunk, shared_from_this()));
+}
+
+void
+LogStreamer::on_chunk(beast::error_code ec, std::size_t bytes_transferred)
+{
+    boost::ignore_unused(bytes_transferred);
+
+    if (ec)
+        return fail(ec, "write");
+
+    write_slice();
+}
+
+void
+LogStreamer::on_last(beast::error_code ec, std::size_t bytes_transferred)
+{
+    // The session reads the next request or closes the connection
+    m_session->on_write(!m_keep_alive, ec, bytes_transferred);
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <boost/beast/core.hpp>
+#include <boost/beast/http.hpp>
+#include <memory>
+#include <string>
+
+namespace beast = boost::beast;  // from <boost/beast.hpp>
+namespace http = beast::http;    // from <boost/beast/http.hpp>
+
+class RServer;
+class ServerSession;
+
+// Streams /getlog?stream=1 as HTTP chunked transfer.
+// Logs are serialized slice by slice, the log lock is held for
+// one slice at a time and the whole log is never copied.
+class LogStreamer : public std::enable_shared_from_this<LogStreamer>
+{
+public:
+    LogStreamer(std::shared_ptr<ServerSession> session,
+                RServer* context,
+                size_t from,
+                size_t end,
+                unsigned version,
+                bool keep_alive);
+
+    // Start the asynchronous operation
+    void run();
+
+private:
+    void on_header(beast::error_code ec, std::size_t bytes_transferred);
+    void write_slice();
+    void on_chunk(beast::error_code ec, std::size_t bytes_transferred);
+    void on_last(beast::error_code ec, std::size_t bytes_transferred);
+
+    std::shared_ptr<ServerSession> m_session;
+    RServer* m_context;
+    size_t m_next;
+    size_t m_end;
+    bool m_keep_alive;
+
+    http::response<http::empty_body> m_res;
+    http::response_serializer<http::empty_body> m_sr;
+    std::string m_slice;
+};
@@ -1,23 +1,23 @@
 #include "log_time_scope.h"
-#include <mutex>
-#include <iostream>
+#include "logger.h"
 
-std::mutex STDOUT_LOCK;
-
-LogTimeScope::LogTimeScope(const std::string& name, bool isRoot)
-    : m_begin(clock::now())
-    , m_name(name)
+LogTimeScope::LogTimeScope(const char* name, bool isRoot)
+    : m_name(name)
     , m_isRoot(isRoot)
+    , m_sampled(logger::enabled(logger::info) && logger::sampled())
 {
+    if (m_sampled)
+    {
+        m_begin = clock::now();
+    }
 }
 
 LogTimeScope::~LogTimeScope()
 {
-    duration dur = clock::now() - m_begin;
+    if (m_sampled)
     {
-        std::lock_guard<std::mutex> lock(STDOUT_LOCK);
-        std::cout << (m_isRoot ? "[ROOT]" : "[NODE]") << " Executing " << m_name << " : "
-                  << dur.count() << std::endl;
+        duration dur = clock::now() - m_begin;
+        logger::Line(logger::info) << (m_isRoot ? "[ROOT]" : "[NODE]") << " Executing " << m_name
+                                   << " : " << dur.count();
     }
 }
-
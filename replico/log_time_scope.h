@@ -1,18 +1,20 @@
 #pragma once
 
-#include <string>
 #include <chrono>
 
-// Auxiliary struct to automatically print execution time for each request
+// Auxiliary struct to automatically log execution time of sampled requests
 struct LogTimeScope
 {
     typedef std::chrono::high_resolution_clock clock;
-    typedef std::chrono::duration<float, std::milli> duration;
+    typedef std::chrono::duration<double, std::milli> duration;
 
     clock::time_point m_begin;
-    std::string m_name = 0;
+    const char* m_name;
     bool m_isRoot = false;
 
-    LogTimeScope(const std::string& name, bool isRoot);
+    // Only one of every logger::sample() scopes is timed
+    bool m_sampled = false;
+
+    LogTimeScope(const char* name, bool isRoot);
     ~LogTimeScope();
 };
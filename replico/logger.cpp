@@ -0,0 +1,318 @@
+#include "logger.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace logger
+{
+namespace
+{
+// Records per thread, a power of two
+const size_t RING_SIZE = 1024;
+
+// How often the writer thread looks into the rings
+const auto DRAIN_INTERVAL = std::chrono::milliseconds(2);
+
+struct Record
+{
+    uint64_t m_time;
+    Level m_level;
+    uint32_t m_size;
+    char m_text[Line::CAPACITY];
+};
+
+// Single producer (the owning thread), single consumer (the writer thread)
+struct Ring
+{
+    Record m_records[RING_SIZE];
+
+    // Next record to fill, moved by the producer
+    alignas(64) std::atomic<uint64_t> m_head{0};
+
+    // Next record to write out, moved by the writer thread
+    alignas(64) std::atomic<uint64_t> m_tail{0};
+};
+
+std::atomic<int> g_level{info};
+std::atomic<unsigned> g_sample{1};
+std::atomic<uint64_t> g_dropped{0};
+
+// Rings of all threads which ever logged. A thread registers once,
+// rings stay alive after their threads exit.
+std::mutex g_rings_lock;
+std::vector<std::shared_ptr<Ring>> g_rings;
+
+std::mutex g_writer_lock;
+std::condition_variable g_writer_cv;
+bool g_stop = false;
+std::thread g_writer;
+
+Ring&
+local_ring()
+{
+    thread_local std::shared_ptr<Ring> ring = [] {
+        auto r = std::make_shared<Ring>();
+        std::lock_guard<std::mutex> g(g_rings_lock);
+        g_rings.push_back(r);
+        return r;
+    }();
+    return *ring;
+}
+
+void
+drain(std::vector<Record>& batch)
+{
+    std::vector<std::shared_ptr<Ring>> rings;
+    {
+        std::lock_guard<std::mutex> g(g_rings_lock);
+        rings = g_rings;
+    }
+
+    batch.clear();
+    for (auto& ring : rings)
+    {
+        auto tail = ring->m_tail.load(std::memory_order_relaxed);
+        auto head = ring->m_head.load(std::memory_order_acquire);
+        for (; tail < head; ++tail)
+        {
+            batch.push_back(ring->m_records[tail & (RING_SIZE - 1)]);
+        }
+        ring->m_tail.store(tail, std::memory_order_release);
+    }
+
+    if (batch.empty())
+    {
+        return;
+    }
+
+    // Lines of different threads in the order they were logged
+    std::stable_sort(batch.begin(), batch.end(),
+                     [](const Record& a, const Record& b) { return a.m_time < b.m_time; });
+
+    for (auto& r : batch)
+    {
+        auto out = r.m_level >= warn ? stderr : stdout;
+        std::fwrite(r.m_text, 1, r.m_size, out);
+        std::fputc('\n', out);
+    }
+    std::fflush(stdout);
+    std::fflush(stderr);
+}
+
+void
+run()
+{
+    std::vector<Record> batch;
+    for (;;)
+    {
+        bool stopping = false;
+        {
+            std::unique_lock<std::mutex> lock(g_writer_lock);
+            g_writer_cv.wait_for(lock, DRAIN_INTERVAL, [] { return g_stop; });
+            stopping = g_stop;
+        }
+
+        drain(batch);
+        if (stopping)
+        {
+            return;
+        }
+    }
+}
+
+uint64_t
+now()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+}  // namespace
+
+void
+start()
+{
+    std::lock_guard<std::mutex> lock(g_writer_lock);
+    if (!g_writer.joinable())
+    {
+        g_stop = false;
+        g_writer = std::thread(run);
+    }
+}
+
+void
+stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(g_writer_lock);
+        if (!g_writer.joinable())
+        {
+            return;
+        }
+        g_stop = true;
+    }
+    g_writer_cv.notify_one();
+    g_writer.join();
+}
+
+void
+set_level(Level l)
+{
+    g_level.store(l, std::memory_order_relaxed);
+}
+
+Level
+level()
+{
+    return static_cast<Level>(g_level.load(std::memory_order_relaxed));
+}
+
+bool
+parse_level(const std::string& name, Level& l)
+{
+    for (int i = trace; i <= off; ++i)
+    {
+        if (name == level_name(static_cast<Level>(i)))
+        {
+            l = static_cast<Level>(i);
+            return true;
+        }
+    }
+    return false;
+}
+
+const char*
+level_name(Level l)
+{
+    static const char* const names[] = {"trace", "debug", "info", "warn", "error", "off"};
+    return names[l];
+}
+
+void
+set_sample(unsigned every)
+{
+    g_sample.store(std::max(1u, every), std::memory_order_relaxed);
+}
+
+unsigned
+sample()
+{
+    return g_sample.load(std::memory_order_relaxed);
+}
+
+bool
+sampled()
+{
+    thread_local unsigned counter = 0;
+    auto every = sample();
+    return every <= 1 || ++counter % every == 0;
+}
+
+uint64_t
+dropped()
+{
+    return g_dropped.load(std::memory_order_relaxed);
+}
+
+Line::~Line()
+{
+    auto& ring = local_ring();
+    auto head = ring.m_head.load(std::memory_order_relaxed);
+    if (head - ring.m_tail.load(std::memory_order_acquire) >= RING_SIZE)
+    {
+        g_dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+
+    auto& r = ring.m_records[head & (RING_SIZE - 1)];
+    r.m_time = now();
+    r.m_level = m_level;
+    r.m_size = static_cast<uint32_t>(m_size);
+    std::memcpy(r.m_text, m_text, m_size);
+    ring.m_head.store(head + 1, std::memory_order_release);
+}
+
+Line&
+Line::operator<<(boost::string_view text)
+{
+    auto n = std::min(text.size(), CAPACITY - m_size);
+    std::memcpy(m_text + m_size, text.data(), n);
+    m_size += n;
+
+    if (n < text.size())
+    {
+        // Mark the cut
+        std::memcpy(m_text + CAPACITY - 3, "...", 3);
+    }
+    return *this;
+}
+
+Line&
+Line::operator<<(const char* text)
+{
+    return *this << boost::string_view(text);
+}
+
+Line&
+Line::operator<<(const std::string& text)
+{
+    return *this << boost::string_view(text);
+}
+
+Line&
+Line::operator<<(char c)
+{
+    return *this << boost::string_view(&c, 1);
+}
+
+Line&
+Line::operator<<(uint64_t value)
+{
+    char buf[24];
+    auto p = buf + sizeof(buf);
+    do
+    {
+        *--p = char('0' + value % 10);
+        value /= 10;
+    } while (value);
+    return *this << boost::string_view(p, buf + sizeof(buf) - p);
+}
+
+Line&
+Line::operator<<(int64_t value)
+{
+    if (value < 0)
+    {
+        *this << '-';
+        return *this << (~static_cast<uint64_t>(value) + 1);
+    }
+    return *this << static_cast<uint64_t>(value);
+}
+
+Line&
+Line::operator<<(unsigned value)
+{
+    return *this << static_cast<uint64_t>(value);
+}
+
+Line&
+Line::operator<<(int value)
+{
+    return *this << static_cast<int64_t>(value);
+}
+
+Line&
+Line::operator<<(double value)
+{
+    char buf[32];
+    auto n = std::snprintf(buf, sizeof(buf), "%g", value);
+    return *this << boost::string_view(buf, std::max(0, n));
+}
+}  // namespace logger
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <boost/utility/string_view.hpp>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// Asynchronous logging.
+//
+// Every thread formats its line into a fixed-size record of its own
+// single-producer ring buffer; a background thread drains the rings,
+// orders the records by time and writes them out. Logging threads never
+// take a lock or touch the terminal. When a ring is full the line is
+// dropped and counted instead of waiting.
+namespace logger
+{
+enum Level
+{
+    trace,
+    debug,
+    info,
+    warn,
+    error,
+    off
+};
+
+// Starts the writer thread
+void start();
+
+// Writes out everything logged so far and stops the writer thread
+void stop();
+
+void set_level(Level level);
+Level level();
+
+inline bool
+enabled(Level l)
+{
+    return l >= level();
+}
+
+bool parse_level(const std::string& name, Level& l);
+const char* level_name(Level l);
+
+// Lines of frequent events (e.g. request timing) are written
+// one per every n, per thread
+void set_sample(unsigned every);
+unsigned sample();
+bool sampled();
+
+// Lines lost because the ring of the thread was full
+uint64_t dropped();
+
+// Formats one line on the stack and queues it on destruction.
+// Longer lines are truncated.
+//   if (logger::enabled(logger::info))
+//       logger::Line(logger::info) << "Added log: " << log;
+class Line
+{
+public:
+    static const size_t CAPACITY = 240;
+
+    explicit Line(Level level)
+        : m_level(level)
+    {
+    }
+
+    ~Line();
+
+    Line(const Line&) = delete;
+    Line& operator=(const Line&) = delete;
+
+    Line& operator<<(boost::string_view text);
+    Line& operator<<(const char* text);
+    Line& operator<<(const std::string& text);
+    Line& operator<<(char c);
+    Line& operator<<(uint64_t value);
+    Line& operator<<(int64_t value);
+    Line& operator<<(unsigned value);
+    Line& operator<<(int value);
+    Line& operator<<(double value);
+
+private:
+    Level m_level;
+    size_t m_size = 0;
+    char m_text[CAPACITY];
+};
+}  // namespace logger
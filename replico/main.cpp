@@ -1,14 +1,63 @@
 #include "replico_server.h"
+#include "logger.h"
 
 
  int main(int argc, char* argv[])
  {
      // Check command line arguments.
-     if (argc != 5)
+     if (argc < 5)
      {
          std::cerr << "Usage: replico <mode> <rootaddress> <nodeaddress1;nodeaddress2> <threads>"
                    << std::endl
                    << "Usage: replico <mode> <nodeadress> <rootaddress> <threads>" << std::endl
+                   << "A secondary address on master may carry the replication port: ip:port:port"
+                   << std::endl
+                   << std::endl
+                   << "Options (master):\n"
+                   << "    --pool-size=<n>        idle keep-alive connections per secondary\n"
+                   << "    --pool-idle-ms=<ms>    close pooled connections idle for longer\n"
+                   << "    --batch-entries=<n>    max logs per replication batch\n"
+                   << "    --batch-bytes=<n>      max bytes per replication batch\n"
+                   << "    --batch-linger-us=<us> wait for more logs before sending a batch\n"
+                   << "    --batch-inflight=<n>   batches pipelined per secondary\n"
+                   << "    --replication-connections=<n> connections per secondary\n"
+                   << "    --retry-base-ms=<ms>   first backoff after a replication failure\n"
+                   << "    --retry-max-ms=<ms>    longest backoff between retries\n"
+                   << "    --wc-timeout-ms=<ms>   answer /addlog with a partial ack after timeout\n"
+                   << "    --term=<n>             term of this master, secondaries refuse older ones\n"
+                   << "    --compression=<codec>  compress batches: none or zlib\n"
+                   << "    --compression-level=<n> zlib level, 1 fastest to 9 smallest\n"
+                   << "    --compress-min-bytes=<n> smaller batches are sent raw\n"
+                   << "    --zero-copy-min-bytes=<n> larger logs are written to secondaries in place\n"
+                   << "    --heartbeat-ms=<ms>    heartbeat interval per secondary, 0 disables\n"
+                   << "    --heartbeat-pause-ms=<ms> heartbeat silence tolerated before suspicion\n"
+                   << "    --phi-threshold=<phi>  suspicion at which a secondary counts as down\n"
+                   << "    --timeout-min-ms=<ms>  lower bound of the round trip based timeouts\n"
+                   << "    --max-pending-writes=<n> writes waiting for wc before /addlog answers 429\n"
+                   << "    --max-pending-bytes=<n> their payload bytes before /addlog answers 503\n"
+                   << std::endl
+                   << "Options (secondary):\n"
+                   << "    --replication-port=<n> port master replicates to (default port + 1000)\n"
+                   << "    --reorder-window=<n>   logs buffered ahead of a missing one\n"
+                   << "    --compression=<codec>  compressed batches accepted: zlib or none\n"
+                   << std::endl
+                   << "Options (any):\n"
+                   << "    --fault=<rules>        latency/failure injection, 'none' to disable\n"
+                   << "                           e.g. /addbatch:delay=uniform:1000-10000,drop=0.01\n"
+                   << "    --data-dir=<path>      keep logs in a write-ahead log in the directory\n"
+                   << "    --durability=<mode>    none, batch (group fdatasync) or entry\n"
+                   << "    --segment-bytes=<n>    size of one write-ahead log segment file\n"
+                   << "    --min-index-wait-ms=<ms> /getlog?min_index waits this long for the index\n"
+                   << "    --retain-logs=<n>      keep the last n logs, compact the older ones\n"
+                   << "    --retain-bytes=<n>     keep at most n bytes of log payloads\n"
+                   << "    --retain-age-s=<s>     compact logs older than s seconds\n"
+                   << "    --compact-interval-ms=<ms> how often the retention is applied\n"
+                   << "    --reuse-port           one client acceptor per thread (SO_REUSEPORT)\n"
+                   << "    --shards               one io_context per thread instead of a shared one\n"
+                   << "    --pin-cpus             pin every I/O thread to its own CPU\n"
+                   << "    --log-level=<level>    trace, debug, info, warn, error or off\n"
+                   << "    --log-sample=<n>       log the timing of one of every n requests\n"
+                   << "    --admin-token=<token>  pwd header /admin/* needs from other hosts\n"
                    << std::endl
                    << "Example for main:\n"
                    << "    replico root 0.0.0.0:8080 0.0.0.0:8081;0.0.0.0:8082 1" << std::endl
@@ -19,7 +68,11 @@
 
      RServer server;
 
-     server.start(argc, argv);
+     if (!server.start(argc, argv))
+     {
+         logger::stop();
+         return EXIT_FAILURE;
+     }
 
      return EXIT_SUCCESS;
  }
@@ -0,0 +1,107 @@
+#include "metrics.h"
+#include <algorithm>
+#include <cstdio>
+
+namespace metrics
+{
+namespace
+{
+// Threads get shards round robin in the order they first record
+size_t
+shard_index()
+{
+    static std::atomic<size_t> next{0};
+    thread_local size_t index = next.fetch_add(1) % Histogram::SHARDS;
+    return index;
+}
+
+std::string
+format(double value)
+{
+    char buf[32];
+    std::snprintf(buf, sizeof(buf), "%.9g", value);
+    return buf;
+}
+}  // namespace
+
+const uint64_t Histogram::BOUNDS_US[BUCKETS - 1] = {
+    50,     100,    250,    500,     1000,    2500,    5000,    10000,   25000,
+    50000,  100000, 250000, 500000,  1000000, 2500000, 5000000, 10000000};
+
+void
+Histogram::observe(std::chrono::nanoseconds duration)
+{
+    auto us = static_cast<uint64_t>(
+        std::max<int64_t>(0, std::chrono::duration_cast<std::chrono::microseconds>(duration).count()));
+    auto bucket = std::lower_bound(std::begin(BOUNDS_US), std::end(BOUNDS_US), us) -
+                  std::begin(BOUNDS_US);
+
+    auto& shard = m_shards[shard_index()];
+    shard.m_buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+    shard.m_sum_us.fetch_add(us, std::memory_order_relaxed);
+}
+
+Histogram::Snapshot
+Histogram::snapshot() const
+{
+    Snapshot s;
+    for (auto& shard : m_shards)
+    {
+        for (size_t i = 0; i < BUCKETS; ++i)
+        {
+            auto n = shard.m_buckets[i].load(std::memory_order_relaxed);
+            s.m_buckets[i] += n;
+            s.m_count += n;
+        }
+        s.m_sum_us += shard.m_sum_us.load(std::memory_order_relaxed);
+    }
+    return s;
+}
+
+void
+Writer::family(const char* name, const char* type, const char* help)
+{
+    m_out += "# HELP ";
+    m_out += name;
+    m_out += " ";
+    m_out += help;
+    m_out += "\n# TYPE ";
+    m_out += name;
+    m_out += " ";
+    m_out += type;
+    m_out += "\n";
+}
+
+void
+Writer::sample(const char* name, const std::string& labels, double value)
+{
+    m_out += name;
+    if (!labels.empty())
+    {
+        m_out += "{" + labels + "}";
+    }
+    m_out += " " + format(value) + "\n";
+}
+
+void
+Writer::histogram(const char* name, const std::string& labels, const Histogram& h)
+{
+    auto s = h.snapshot();
+    auto prefix = labels.empty() ? std::string() : labels + ",";
+
+    uint64_t cumulative = 0;
+    for (size_t i = 0; i < Histogram::BUCKETS; ++i)
+    {
+        cumulative += s.m_buckets[i];
+        auto le = i + 1 < Histogram::BUCKETS ? format(Histogram::BOUNDS_US[i] / 1e6) : "+Inf";
+        m_out += name;
+        m_out += "_bucket{" + prefix + "le=\"" + le + "\"} " + std::to_string(cumulative) + "\n";
+    }
+
+    auto suffix = labels.empty() ? std::string() : "{" + labels + "}";
+    m_out += name;
+    m_out += "_sum" + suffix + " " + format(s.m_sum_us / 1e6) + "\n";
+    m_out += name;
+    m_out += "_count" + suffix + " " + std::to_string(cumulative) + "\n";
+}
+}  // namespace metrics
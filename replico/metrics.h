@@ -0,0 +1,88 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// Counters and latency histograms exported by /metrics in the
+// Prometheus text format. Updates are relaxed atomic increments,
+// nothing on the request path takes a lock.
+namespace metrics
+{
+class Counter
+{
+public:
+    void
+    add(uint64_t n = 1)
+    {
+        m_value.fetch_add(n, std::memory_order_relaxed);
+    }
+
+    uint64_t
+    value() const
+    {
+        return m_value.load(std::memory_order_relaxed);
+    }
+
+private:
+    std::atomic<uint64_t> m_value{0};
+};
+
+// Latency histogram with fixed buckets from 50us to 10s.
+// Every thread records into its own shard, so threads never contend
+// for a cache line; shards are merged on scrape.
+class Histogram
+{
+public:
+    static const size_t BUCKETS = 18;
+    static const size_t SHARDS = 16;
+
+    // Upper bounds of the buckets in microseconds, the last one is +Inf
+    static const uint64_t BOUNDS_US[BUCKETS - 1];
+
+    struct Snapshot
+    {
+        // Not cumulative
+        uint64_t m_buckets[BUCKETS] = {};
+        uint64_t m_count = 0;
+        uint64_t m_sum_us = 0;
+    };
+
+    void observe(std::chrono::nanoseconds duration);
+
+    // Thread safe, may be slightly behind concurrent observations
+    Snapshot snapshot() const;
+
+private:
+    struct alignas(64) Shard
+    {
+        std::atomic<uint64_t> m_buckets[BUCKETS] = {};
+        std::atomic<uint64_t> m_sum_us{0};
+    };
+
+    Shard m_shards[SHARDS];
+};
+
+// Builds the text exposition
+class Writer
+{
+public:
+    // Starts a metric family
+    void family(const char* name, const char* type, const char* help);
+
+    // labels is a ready list like: node="127.0.0.1:8082", may be empty
+    void sample(const char* name, const std::string& labels, double value);
+    void histogram(const char* name, const std::string& labels, const Histogram& h);
+
+    std::string&
+    str()
+    {
+        return m_out;
+    }
+
+private:
+    std::string m_out;
+};
+}  // namespace metrics
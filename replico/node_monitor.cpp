@@ -0,0 +1,201 @@
+#include "node_monitor.h"
+#include "replico_server.h"
+#include "logger.h"
+
+NodeMonitor::NodeMonitor(RServer* context,
+                         const RNode& node,
+                         const Settings& settings,
+                         std::function<void(bool up)> on_change)
+    : m_context(context)
+    , m_pool(node.pool)
+    , m_name(node.ip + ":" + node.port)
+    , m_settings(settings)
+    , m_on_change(std::move(on_change))
+    , m_strand(net::make_strand(node.pool->io_context()))
+    , m_tick_timer(m_strand)
+    , m_detector(settings.m_interval, settings.m_acceptable_pause, FailureDetector::clock::now())
+{
+}
+
+void
+NodeMonitor::run()
+{
+    net::post(m_strand, beast::bind_front_handler(&NodeMonitor::on_tick, shared_from_this(),
+                                                  beast::error_code()));
+}
+
+NodeMonitor::Status
+NodeMonitor::status()
+{
+    auto now = FailureDetector::clock::now();
+    std::lock_guard<std::mutex> g(m_lock);
+    return Status{up(), m_detector.phi(now), m_rtt.srtt(), timeout(),
+                  std::chrono::duration_cast<std::chrono::milliseconds>(now - m_detector.last())};
+}
+
+std::chrono::milliseconds
+NodeMonitor::timeout()
+{
+    return m_rtt.timeout(m_settings.m_timeout_min, m_settings.m_timeout_max);
+}
+
+void
+NodeMonitor::on_tick(beast::error_code ec)
+{
+    if (ec == net::error::operation_aborted)
+        return;
+
+    check();
+    if (!m_busy)
+    {
+        send();
+    }
+
+    m_tick_timer.expires_after(m_settings.m_interval);
+    m_tick_timer.async_wait(beast::bind_front_handler(&NodeMonitor::on_tick, shared_from_this()));
+}
+
+void
+NodeMonitor::check()
+{
+    double phi;
+    {
+        std::lock_guard<std::mutex> g(m_lock);
+        phi = m_detector.phi(FailureDetector::clock::now());
+    }
+
+    auto up = phi < m_settings.m_phi_threshold;
+    if (up == m_up.load())
+    {
+        return;
+    }
+
+    m_up = up;
+    if (up)
+    {
+        if (logger::enabled(logger::info))
+        {
+            logger::Line(logger::info) << "Secondary " << m_name << " is up";
+        }
+    }
+    else if (logger::enabled(logger::warn))
+    {
+        logger::Line(logger::warn) << "Secondary " << m_name << " is down (phi " << phi
+                                   << "), replication to it paused";
+    }
+    m_on_change(up);
+}
+
+void
+NodeMonitor::send()
+{
+    m_busy = true;
+    if (m_conn)
+    {
+        return do_write();
+    }
+
+    m_conn.reset(new NodePool::Connection(m_pool->io_context()));
+    m_conn->m_stream.expires_after(timeout());
+    m_conn->m_stream.async_connect(
+        m_pool->endpoints(),
+        net::bind_executor(m_strand, beast::bind_front_handler(&NodeMonitor::on_connect,
+                                                               shared_from_this())));
+}
+
+void
+NodeMonitor::on_connect(beast::error_code ec, tcp::resolver::results_type::endpoint_type)
+{
+    if (ec)
+        return drop(ec, "heartbeat connect");
+
+    m_conn->m_stream.socket().set_option(tcp::no_delay(true), ec);
+    do_write();
+}
+
+void
+NodeMonitor::do_write()
+{
+    batch_frame::encode_heartbeat(m_frame, m_context->m_term, m_context->m_epoch, ++m_seq);
+    m_sent = FailureDetector::clock::now();
+    m_conn->m_stream.expires_after(timeout());
+    net::async_write(m_conn->m_stream, net::buffer(m_frame),
+                     net::bind_executor(m_strand, beast::bind_front_handler(
+                                                       &NodeMonitor::on_write, shared_from_this())));
+}
+
+void
+NodeMonitor::on_write(beast::error_code ec, std::size_t bytes_transferred)
+{
+    boost::ignore_unused(bytes_transferred);
+
+    if (ec)
+        return drop(ec, "heartbeat write");
+
+    net::async_read(m_conn->m_stream, net::buffer(m_ack),
+                    net::bind_executor(m_strand, beast::bind_front_handler(
+                                                      &NodeMonitor::on_read, shared_from_this())));
+}
+
+void
+NodeMonitor::on_read(beast::error_code ec, std::size_t bytes_transferred)
+{
+    boost::ignore_unused(bytes_transferred);
+
+    if (ec)
+        return drop(ec, "heartbeat read");
+
+    m_busy = false;
+    auto now = FailureDetector::clock::now();
+    auto body = boost::string_view(m_ack, sizeof(m_ack)).substr(batch_frame::PREFIX_SIZE);
+    batch_frame::Ack ack;
+    if (!batch_frame::decode_ack(body, ack) || ack.m_last_id != m_seq)
+    {
+        return drop(beast::errc::make_error_code(beast::errc::protocol_error), "heartbeat ack");
+    }
+
+    // A node which refuses the batches of this master is no use for wc,
+    // its acks are not counted as heartbeats
+    if (ack.m_status == batch_frame::stale_term)
+    {
+        if (!m_stale)
+        {
+            m_stale = true;
+            fail(beast::errc::make_error_code(beast::errc::permission_denied),
+                 "heartbeat refused, secondary follows a newer term");
+        }
+        return;
+    }
+    m_stale = false;
+
+    // Injected failures count as lost heartbeats
+    if (ack.m_status != batch_frame::ok)
+    {
+        return;
+    }
+
+    m_round_trip.observe(now - m_sent);
+    {
+        std::lock_guard<std::mutex> g(m_lock);
+        m_detector.heartbeat(now);
+        m_rtt.observe(now - m_sent);
+    }
+    check();
+}
+
+void
+NodeMonitor::drop(beast::error_code ec, const char* what)
+{
+    // Every tick fails while the node is away, the transitions are logged
+    if (logger::enabled(logger::debug))
+    {
+        logger::Line(logger::debug) << what << " " << m_name << ": " << ec.message();
+    }
+
+    m_busy = false;
+    if (m_conn)
+    {
+        m_conn->m_stream.socket().close(ec);
+        m_conn.reset();
+    }
+}
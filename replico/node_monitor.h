@@ -0,0 +1,131 @@
+#pragma once
+
+#include <boost/beast/core.hpp>
+#include <boost/asio/read.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/asio/strand.hpp>
+#include <boost/asio/write.hpp>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include "batch_frame.h"
+#include "failure_detector.h"
+#include "metrics.h"
+#include "node_pool.h"
+
+namespace beast = boost::beast;    // from <boost/beast.hpp>
+namespace net = boost::asio;       // from <boost/asio.hpp>
+using tcp = boost::asio::ip::tcp;  // from <boost/asio/ip/tcp.hpp>
+
+class RServer;
+struct RNode;
+
+// One NodeMonitor per secondary.
+//
+// Sends a heartbeat frame every interval over a connection of its own to
+// the replication port, one at a time, and feeds the acks to a
+// FailureDetector. Once phi passes the threshold the secondary is down:
+// on_change(false) is called and writes stop counting on it. The next ack
+// brings it back up. A heartbeat or connect which takes longer than the
+// timeout derived from the measured round trips drops the connection,
+// the next tick connects again.
+class NodeMonitor : public std::enable_shared_from_this<NodeMonitor>
+{
+public:
+    struct Settings
+    {
+        std::chrono::milliseconds m_interval{200};
+        std::chrono::milliseconds m_acceptable_pause{1000};
+        double m_phi_threshold = 8;
+
+        // Bounds of the heartbeat timeout
+        std::chrono::milliseconds m_timeout_min{1000};
+        std::chrono::milliseconds m_timeout_max{30000};
+    };
+
+    // As of the call, for /health
+    struct Status
+    {
+        bool m_up;
+        double m_phi;
+        std::chrono::microseconds m_rtt;
+        std::chrono::milliseconds m_timeout;
+        std::chrono::milliseconds m_since_heartbeat;
+    };
+
+    // on_change is called on the monitor's strand when the node goes
+    // down or comes back up
+    NodeMonitor(RServer* context,
+                const RNode& node,
+                const Settings& settings,
+                std::function<void(bool up)> on_change);
+
+    void run();
+
+    // Thread safe
+    bool
+    up() const
+    {
+        return m_up.load(std::memory_order_relaxed);
+    }
+
+    // Thread safe
+    Status status();
+
+    // From writing a heartbeat to receiving its ack
+    const metrics::Histogram&
+    round_trip() const
+    {
+        return m_round_trip;
+    }
+
+private:
+    void on_tick(beast::error_code ec);
+
+    // Compares phi with the threshold
+    void check();
+
+    void send();
+    void on_connect(beast::error_code ec, tcp::resolver::results_type::endpoint_type);
+    void do_write();
+    void on_write(beast::error_code ec, std::size_t bytes_transferred);
+    void on_read(beast::error_code ec, std::size_t bytes_transferred);
+
+    // The heartbeat failed, the connection is dropped
+    void drop(beast::error_code ec, const char* what);
+
+    std::chrono::milliseconds timeout();
+
+    RServer* m_context;
+    std::shared_ptr<NodePool> m_pool;
+    std::string m_name;
+    Settings m_settings;
+    std::function<void(bool)> m_on_change;
+    net::strand<net::io_context::executor_type> m_strand;
+    net::steady_timer m_tick_timer;
+
+    // State below is only touched on m_strand
+
+    std::unique_ptr<NodePool::Connection> m_conn;
+
+    // A heartbeat is on its way
+    bool m_busy = false;
+    uint64_t m_seq = 0;
+    FailureDetector::clock::time_point m_sent;
+    std::string m_frame;
+    char m_ack[batch_frame::ACK_SIZE];
+
+    // The secondary follows a newer term, reported once
+    bool m_stale = false;
+
+    // Also read by status()
+    std::mutex m_lock;
+    FailureDetector m_detector;
+    RttEstimator m_rtt;
+
+    std::atomic<bool> m_up{true};
+    metrics::Histogram m_round_trip;
+};
@@ -0,0 +1,97 @@
+#include "node_pool.h"
+#include "replico_server.h"
+#include <boost/asio/strand.hpp>
+
+NodePool::Connection::Connection(net::io_context& ioc)
+    : m_stream(net::make_strand(ioc))
+    , m_last_used(clock::now())
+{
+}
+
+NodePool::NodePool(RServer* context,
+                   net::io_context& ioc,
+                   tcp::resolver::results_type endpoints,
+                   size_t size,
+                   std::chrono::milliseconds idle_timeout)
+    : m_context(context)
+    , m_ioc(ioc)
+    , m_endpoints(std::move(endpoints))
+    , m_size(size)
+    , m_idle_timeout(idle_timeout)
+    , m_sweep_timer(ioc)
+{
+}
+
+void
+NodePool::run()
+{
+    m_sweep_timer.expires_after(m_idle_timeout / 2 + std::chrono::milliseconds(1));
+    m_sweep_timer.async_wait(beast::bind_front_handler(&NodePool::on_sweep, shared_from_this()));
+}
+
+NodePool::connection_ptr
+NodePool::acquire()
+{
+    {
+        std::lock_guard<std::mutex> g(m_lock);
+        auto now = clock::now();
+        while (!m_idle.empty())
+        {
+            // Most recently used connection is the most likely to be alive
+            auto conn = std::move(m_idle.back());
+            m_idle.pop_back();
+            if (now - conn->m_last_used < m_idle_timeout)
+            {
+                return conn;
+            }
+        }
+    }
+
+    return connection_ptr(new Connection(m_ioc));
+}
+
+void
+NodePool::release(connection_ptr conn)
+{
+    conn->m_last_used = clock::now();
+
+    std::lock_guard<std::mutex> g(m_lock);
+    if (m_idle.size() < m_size)
+    {
+        m_idle.push_back(std::move(conn));
+    }
+}
+
+size_t
+NodePool::idle_count()
+{
+    std::lock_guard<std::mutex> g(m_lock);
+    return m_idle.size();
+}
+
+void
+NodePool::on_sweep(beast::error_code ec)
+{
+    if (ec)
+        return;
+
+    std::vector<connection_ptr> expired;
+    {
+        std::lock_guard<std::mutex> g(m_lock);
+        auto now = clock::now();
+        auto it = std::partition(m_idle.begin(), m_idle.end(), [&](const connection_ptr& c) {
+            return now - c->m_last_used < m_idle_timeout;
+        });
+        std::move(it, m_idle.end(), std::back_inserter(expired));
+        m_idle.erase(it, m_idle.end());
+    }
+
+    // Expired connections are closed outside of the lock
+    for (auto& c : expired)
+    {
+        c->m_stream.socket().shutdown(tcp::socket::shutdown_both, ec);
+        c->m_stream.close();
+    }
+
+    run();
+}
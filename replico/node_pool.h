@@ -0,0 +1,80 @@
+#pragma once
+
+#include <boost/beast/core.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace beast = boost::beast;    // from <boost/beast.hpp>
+namespace net = boost::asio;       // from <boost/asio.hpp>
+using tcp = boost::asio::ip::tcp;  // from <boost/asio/ip/tcp.hpp>
+
+class RServer;
+
+// Pool of keep-alive connections from master to one secondary.
+// Endpoints are resolved once, connections are reused between requests
+// and closed after staying idle longer than the idle timeout.
+class NodePool : public std::enable_shared_from_this<NodePool>
+{
+public:
+    typedef std::chrono::steady_clock clock;
+
+    struct Connection
+    {
+        explicit Connection(net::io_context& ioc);
+
+        beast::tcp_stream m_stream;
+        beast::flat_buffer m_buffer;  // (Must persist between reads)
+        clock::time_point m_last_used;
+
+        // True once the connection was established at least once
+        bool m_connected = false;
+    };
+
+    typedef std::unique_ptr<Connection> connection_ptr;
+
+    // Connections run on ioc, the shard of the secondary's sender
+    NodePool(RServer* context,
+             net::io_context& ioc,
+             tcp::resolver::results_type endpoints,
+             size_t size,
+             std::chrono::milliseconds idle_timeout);
+
+    // Start closing connections which stayed idle for too long
+    void run();
+
+    // Returns an idle connection or a new not yet connected one
+    connection_ptr acquire();
+
+    // Returns a kept-alive connection back to the pool
+    void release(connection_ptr conn);
+
+    net::io_context&
+    io_context()
+    {
+        return m_ioc;
+    }
+
+    const tcp::resolver::results_type&
+    endpoints() const
+    {
+        return m_endpoints;
+    }
+
+    size_t idle_count();
+
+private:
+    void on_sweep(beast::error_code ec);
+
+    RServer* m_context;
+    net::io_context& m_ioc;
+    tcp::resolver::results_type m_endpoints;
+    size_t m_size;
+    std::chrono::milliseconds m_idle_timeout;
+    net::steady_timer m_sweep_timer;
+
+    std::mutex m_lock;
+    std::vector<connection_ptr> m_idle;
+};
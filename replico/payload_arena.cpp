@@ -0,0 +1,94 @@
+#include "payload_arena.h"
+#include <cstring>
+#include <new>
+
+PayloadArena::PayloadArena(size_t block_bytes)
+    : m_block_bytes(block_bytes)
+{
+}
+
+PayloadArena::~PayloadArena()
+{
+    while (m_blocks)
+    {
+        auto next = m_blocks->m_next;
+        m_blocks->~Block();
+        ::operator delete(m_blocks);
+        m_blocks = next;
+    }
+}
+
+PayloadArena::Block*
+PayloadArena::new_block(size_t size)
+{
+    auto b = new (::operator new(sizeof(Block) + size)) Block;
+    b->m_size = size;
+    b->m_used = 0;
+
+    b->m_next = m_blocks;
+    m_blocks = b;
+
+    ++m_block_count;
+    m_reserved_bytes += sizeof(Block) + size;
+    return b;
+}
+
+char*
+PayloadArena::allocate(size_t size)
+{
+    // Big payloads get a block of their own and leave the current one be
+    if (size > m_block_bytes / 4)
+    {
+        std::lock_guard<std::mutex> g(m_grow_lock);
+        auto b = new_block(size);
+        b->m_used = size;
+        return b->data();
+    }
+
+    for (;;)
+    {
+        auto b = m_current.load(std::memory_order_acquire);
+        if (b)
+        {
+            auto offset = b->m_used.fetch_add(size);
+            if (offset + size <= b->m_size)
+            {
+                return b->data() + offset;
+            }
+        }
+
+        // The block is full, the first thread to get here replaces it
+        std::lock_guard<std::mutex> g(m_grow_lock);
+        if (m_current.load() == b)
+        {
+            m_current.store(new_block(m_block_bytes), std::memory_order_release);
+        }
+    }
+}
+
+boost::string_view
+PayloadArena::copy(boost::string_view payload)
+{
+    if (payload.empty())
+    {
+        return boost::string_view();
+    }
+
+    auto p = allocate(payload.size());
+    std::memcpy(p, payload.data(), payload.size());
+
+    m_payload_bytes.fetch_add(payload.size(), std::memory_order_relaxed);
+    m_payloads.fetch_add(1, std::memory_order_relaxed);
+    return boost::string_view(p, payload.size());
+}
+
+PayloadArena::Stats
+PayloadArena::stats() const
+{
+    Stats s;
+    s.m_blocks = m_block_count.load();
+    s.m_reserved_bytes = m_reserved_bytes.load();
+    s.m_payload_bytes = m_payload_bytes.load();
+    s.m_payloads = m_payloads.load();
+    return s;
+}
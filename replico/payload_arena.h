@@ -0,0 +1,89 @@
+#pragma once
+
+#include <boost/utility/string_view.hpp>
+#include <atomic>
+#include <cstddef>
+#include <mutex>
+
+// Storage for log payloads in large contiguous blocks.
+// Payloads are bump allocated one after another, so a sequential scan
+// of the log reads memory front to back and there is no malloc per log.
+// Payloads live as long as the arena. The arena is reference counted:
+// whoever writes payloads straight from it (replication) keeps it alive
+// after its owner let go.
+class PayloadArena
+{
+public:
+    struct Stats
+    {
+        size_t m_blocks = 0;
+
+        // Memory taken by the blocks
+        size_t m_reserved_bytes = 0;
+
+        // Bytes of payloads stored
+        size_t m_payload_bytes = 0;
+        size_t m_payloads = 0;
+    };
+
+    explicit PayloadArena(size_t block_bytes = 1 << 20);
+    ~PayloadArena();
+
+    PayloadArena(const PayloadArena&) = delete;
+    PayloadArena& operator=(const PayloadArena&) = delete;
+
+    // Thread safe. Copies the payload into the arena.
+    boost::string_view copy(boost::string_view payload);
+
+    Stats stats() const;
+
+    // Thread safe. The creator holds the first reference, the last
+    // release deletes the arena.
+    void
+    retain()
+    {
+        m_refs.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void
+    release()
+    {
+        if (m_refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+        {
+            delete this;
+        }
+    }
+
+private:
+    struct Block
+    {
+        Block* m_next;
+        size_t m_size;
+        std::atomic<size_t> m_used;
+
+        char*
+        data()
+        {
+            return reinterpret_cast<char*>(this + 1);
+        }
+    };
+
+    Block* new_block(size_t size);
+    char* allocate(size_t size);
+
+    size_t m_block_bytes;
+
+    // Block the payloads are bump allocated from
+    std::atomic<Block*> m_current{nullptr};
+
+    // All blocks, guarded by m_grow_lock
+    std::mutex m_grow_lock;
+    Block* m_blocks = nullptr;
+
+    std::atomic<size_t> m_block_count{0};
+    std::atomic<size_t> m_reserved_bytes{0};
+    std::atomic<size_t> m_payload_bytes{0};
+    std::atomic<size_t> m_payloads{0};
+
+    std::atomic<size_t> m_refs{1};
+};
@@ -0,0 +1,52 @@
+#include "reorder_buffer.h"
+#include <utility>
+
+ReorderBuffer::ReorderBuffer(size_t window)
+{
+    size_t size = 1;
+    while (size < window)
+    {
+        size <<= 1;
+    }
+
+    m_slots.resize(size);
+    m_mask = size - 1;
+}
+
+void
+ReorderBuffer::put(size_t id, boost::string_view log)
+{
+    auto& s = m_slots[id & m_mask];
+    s.m_full = true;
+    s.m_id = id;
+    s.m_log = log;
+    ++m_size;
+}
+
+void
+ReorderBuffer::wait(size_t id, durable_handler on_durable)
+{
+    auto& s = m_slots[id & m_mask];
+    if (!s.m_on_durable)
+    {
+        s.m_on_durable = std::move(on_durable);
+        return;
+    }
+
+    // The log was sent again in another frame
+    auto first = std::move(s.m_on_durable);
+    s.m_on_durable = [first, on_durable](bool durable) {
+        first(durable);
+        on_durable(durable);
+    };
+}
+
+ReorderBuffer::Slot
+ReorderBuffer::take(size_t id)
+{
+    auto& s = m_slots[id & m_mask];
+    Slot taken = std::move(s);
+    s = Slot();
+    --m_size;
+    return taken;
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <boost/utility/string_view.hpp>
+#include <cstddef>
+#include <functional>
+#include <vector>
+
+// Logs of a secondary which arrived ahead of the ones before them.
+// Frames of master may come over several connections and in any order;
+// a log waits here until every log before it is in place. Slots are
+// indexed by id modulo the window, so finding out whether the next log
+// arrived is a single lookup. Not thread safe.
+class ReorderBuffer
+{
+public:
+    // durable is false if the logs could not be persisted
+    typedef std::function<void(bool durable)> durable_handler;
+
+    struct Slot
+    {
+        bool m_full = false;
+        size_t m_id = 0;
+        boost::string_view m_log;
+
+        // Frames answered once this log is durable
+        durable_handler m_on_durable;
+    };
+
+    // Room for window logs from the next one to apply, rounded up to a power of two
+    explicit ReorderBuffer(size_t window);
+
+    size_t
+    window() const
+    {
+        return m_slots.size();
+    }
+
+    // Logs waiting for the ones before them
+    size_t
+    size() const
+    {
+        return m_size;
+    }
+
+    bool
+    has(size_t id) const
+    {
+        auto& s = m_slots[id & m_mask];
+        return s.m_full && s.m_id == id;
+    }
+
+    // The log must outlive the slot. id must lie within the window
+    // and not be buffered yet.
+    void put(size_t id, boost::string_view log);
+
+    // Calls on_durable once the buffered log id is applied and durable
+    void wait(size_t id, durable_handler on_durable);
+
+    // Empties the slot of a buffered log and returns its content
+    Slot take(size_t id);
+
+private:
+    std::vector<Slot> m_slots;
+    size_t m_mask;
+    size_t m_size = 0;
+};
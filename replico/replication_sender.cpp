@@ -0,0 +1,662 @@
+#include "replication_sender.h"
+#include "replico_server.h"
+#include "helpers.h"
+#include "logger.h"
+#include "segment_format.h"
+#include <fcntl.h>
+#include <unistd.h>
+
+ReplicationSender::ReplicationSender(RServer* context, const RNode& node, const Settings& settings)
+    : m_context(context)
+    , m_pool(node.pool)
+    , m_settings(settings)
+    , m_strand(net::make_strand(node.pool->io_context()))
+    , m_linger_timer(m_strand)
+    , m_backoff_timer(m_strand)
+    , m_random(std::random_device()())
+    , m_save_timer(m_strand)
+{
+    m_lanes.resize(std::max<size_t>(1, settings.m_connections));
+    m_metrics.m_timeout_ms = io_timeout().count();
+    load_cursor();
+}
+
+ReplicationSender::~ReplicationSender()
+{
+    if (m_cursor_fd >= 0)
+    {
+        ::close(m_cursor_fd);
+    }
+}
+
+void
+ReplicationSender::run()
+{
+    net::post(m_strand,
+              beast::bind_front_handler(&ReplicationSender::do_flush, shared_from_this()));
+}
+
+void
+ReplicationSender::notify(size_t bytes)
+{
+    m_notified_bytes.fetch_add(bytes, std::memory_order_relaxed);
+
+    // One wake up of the strand covers all the logs published meanwhile
+    if (!m_notified.exchange(true))
+    {
+        net::post(m_strand,
+                  beast::bind_front_handler(&ReplicationSender::on_notify, shared_from_this()));
+    }
+}
+
+void
+ReplicationSender::set_reachable(bool reachable)
+{
+    net::post(m_strand, beast::bind_front_handler(&ReplicationSender::on_reachable,
+                                                  shared_from_this(), reachable));
+}
+
+void
+ReplicationSender::on_reachable(bool reachable)
+{
+    if (reachable == m_reachable)
+    {
+        return;
+    }
+
+    m_reachable = reachable;
+    if (!reachable)
+    {
+        // Batches in flight would only wait for the timeout. Their logs
+        // go again from the cursor once the secondary is back.
+        return do_close(true);
+    }
+
+    // Back: no reason to wait for the backoff
+    m_failures = 0;
+    m_metrics.m_timeout_ms = io_timeout().count();
+    if (m_backing_off)
+    {
+        m_backing_off = false;
+        m_backoff_timer.cancel();
+    }
+    do_flush();
+}
+
+void
+ReplicationSender::on_notify()
+{
+    m_notified = false;
+    m_queued_bytes += m_notified_bytes.exchange(0, std::memory_order_relaxed);
+
+    if (m_settings.m_linger.count() == 0 ||
+        m_context->log_count() - m_next >= m_settings.m_max_entries ||
+        m_queued_bytes >= m_settings.m_max_bytes)
+    {
+        return do_flush();
+    }
+
+    if (m_linger_armed)
+    {
+        return;
+    }
+
+    // Give other logs a chance to join the batch
+    m_linger_armed = true;
+    m_linger_timer.expires_after(m_settings.m_linger);
+    m_linger_timer.async_wait(
+        beast::bind_front_handler(&ReplicationSender::on_linger, shared_from_this()));
+}
+
+void
+ReplicationSender::on_linger(beast::error_code ec)
+{
+    if (ec == net::error::operation_aborted)
+        return;
+
+    m_linger_armed = false;
+    do_flush();
+}
+
+void
+ReplicationSender::do_flush()
+{
+    // Batches cut now would be thrown away by the retry
+    if (m_closing || m_backing_off || !m_reachable)
+    {
+        return;
+    }
+    m_queued_bytes = 0;
+
+    // Batches are only cut while there is room in the pipeline,
+    // otherwise the logs keep accumulating into bigger batches.
+    // Logs are read straight from the log of master.
+    auto end = m_context->log_count();
+    while (m_next < end && m_unsent.size() + m_outstanding.size() < m_settings.m_max_inflight)
+    {
+        auto batch = std::make_shared<Batch>();
+        batch->m_first = m_next;
+
+        // The logs the secondary needs next were compacted away
+        auto first = m_context->first_log();
+        if (m_next < first)
+        {
+            batch_frame::encode_snapshot(batch->m_frame, m_context->m_term, m_context->m_epoch,
+                                         first);
+            batch->m_snapshot = true;
+            batch->m_end = m_next = first;
+            batch->m_raw_bytes = batch->m_frame.size();
+            batch->gather();
+            m_unsent.push_back(std::move(batch));
+            continue;
+        }
+
+        batch_frame::begin(batch->m_frame, m_context->m_term, m_context->m_epoch, m_cursor);
+
+        // Compression needs the logs in one piece
+        auto zero_copy = !(m_settings.m_codec & m_peer_codecs);
+        const void* pinned = nullptr;
+
+        size_t count = 0;
+        size_t bytes = 0;
+        m_context->visit_payloads(m_next, [&](size_t id, boost::string_view log, uint32_t crc,
+                                              const void* owner, auto&& pin) {
+            // A compaction overtook the batch
+            if (id != m_next + count || id >= end || count == m_settings.m_max_entries ||
+                (count > 0 && bytes + log.size() > m_settings.m_max_bytes))
+            {
+                return false;
+            }
+
+            if (zero_copy && log.size() >= m_settings.m_zero_copy_min_bytes)
+            {
+                batch_frame::append_header(batch->m_frame, id, log, crc);
+                batch->m_refs.push_back(Batch::Ref{batch->m_frame.size(), log});
+                batch->m_ref_bytes += log.size();
+                if (owner != pinned)
+                {
+                    batch->m_pins.push_back(pin());
+                    pinned = owner;
+                }
+            }
+            else
+            {
+                batch_frame::append(batch->m_frame, id, log, crc);
+            }
+            ++count;
+            bytes += log.size();
+            return true;
+        });
+
+        if (count == 0)
+        {
+            if (m_next < m_context->first_log())
+            {
+                continue;
+            }
+            break;
+        }
+
+        batch_frame::finish(batch->m_frame, static_cast<uint32_t>(count), batch->m_ref_bytes);
+        m_next += count;
+        batch->m_end = m_next;
+        batch->m_raw_bytes = batch->size();
+        if (batch->m_refs.empty())
+        {
+            compress(*batch);
+        }
+        batch->gather();
+
+        m_unsent.push_back(std::move(batch));
+    }
+
+    m_metrics.m_queued_batches = m_unsent.size() + m_outstanding.size();
+    pump();
+}
+
+void
+ReplicationSender::Batch::gather()
+{
+    m_buffers.clear();
+    m_buffers.reserve(m_refs.size() * 2 + 1);
+
+    size_t from = 0;
+    for (auto& ref : m_refs)
+    {
+        m_buffers.emplace_back(m_frame.data() + from, ref.m_offset - from);
+        m_buffers.emplace_back(ref.m_log.data(), ref.m_log.size());
+        from = ref.m_offset;
+    }
+    m_buffers.emplace_back(m_frame.data() + from, m_frame.size() - from);
+}
+
+void
+ReplicationSender::compress(Batch& batch)
+{
+    if (!(m_settings.m_codec & m_peer_codecs) ||
+        batch.m_frame.size() < m_settings.m_compress_min_bytes)
+    {
+        return;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    std::string compressed;
+    if (batch_frame::compress(batch.m_frame, m_settings.m_compression_level, compressed))
+    {
+        batch.m_frame.swap(compressed);
+        m_metrics.m_compressed_batches.add();
+    }
+    m_metrics.m_compress_ns.add(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                    std::chrono::steady_clock::now() - start)
+                                    .count());
+}
+
+void
+ReplicationSender::pump()
+{
+    if (m_closing || m_backing_off || !m_reachable)
+    {
+        return;
+    }
+
+    for (size_t i = 0; i < m_lanes.size(); ++i)
+    {
+        pump(i);
+    }
+}
+
+void
+ReplicationSender::pump(size_t i)
+{
+    auto& lane = m_lanes[i];
+    if (m_unsent.empty() && lane.m_inflight.empty())
+    {
+        if (lane.m_conn && !lane.m_connecting && !lane.m_writing && !lane.m_reading)
+        {
+            // Nothing to send - give the connection back until next batch
+            lane.m_conn->m_stream.expires_never();
+            m_pool->release(std::move(lane.m_conn));
+        }
+        return;
+    }
+
+    if (!lane.m_conn)
+    {
+        lane.m_conn = m_pool->acquire();
+        lane.m_maybe_stale = lane.m_conn->m_connected;
+        if (!lane.m_conn->m_connected)
+        {
+            lane.m_connecting = true;
+            lane.m_conn->m_stream.expires_after(io_timeout());
+            lane.m_conn->m_stream.async_connect(
+                m_pool->endpoints(),
+                net::bind_executor(m_strand, beast::bind_front_handler(
+                                                 &ReplicationSender::on_connect,
+                                                 shared_from_this(), i)));
+            return;
+        }
+    }
+
+    if (lane.m_connecting)
+    {
+        return;
+    }
+
+    do_write(i);
+    do_read(i);
+}
+
+void
+ReplicationSender::do_write(size_t i)
+{
+    auto& lane = m_lanes[i];
+    if (lane.m_writing || m_unsent.empty())
+    {
+        return;
+    }
+
+    // Whichever connection is free takes the next batch
+    auto batch = m_unsent.front();
+    m_unsent.pop_front();
+    lane.m_inflight.push_back(batch);
+    m_outstanding.push_back(batch);
+    if (!batch->m_snapshot && batch->m_first < m_sent)
+    {
+        m_metrics.m_resent_logs.add(std::min(batch->m_end, m_sent) - batch->m_first);
+    }
+    m_sent = std::max(m_sent, batch->m_end);
+    m_metrics.m_raw_bytes.add(batch->m_raw_bytes);
+    m_metrics.m_wire_bytes.add(batch->size());
+    m_metrics.m_zero_copy_bytes.add(batch->m_ref_bytes);
+
+    lane.m_writing = true;
+    batch->m_sent = std::chrono::steady_clock::now();
+    lane.m_conn->m_stream.expires_after(io_timeout());
+    net::async_write(lane.m_conn->m_stream, batch->m_buffers,
+                     net::bind_executor(m_strand, beast::bind_front_handler(
+                                                       &ReplicationSender::on_write,
+                                                       shared_from_this(), i)));
+}
+
+void
+ReplicationSender::do_read(size_t i)
+{
+    auto& lane = m_lanes[i];
+    if (lane.m_reading || lane.m_inflight.empty())
+    {
+        return;
+    }
+
+    // Acks come back in the order the batches were written on the connection
+    lane.m_reading = true;
+    lane.m_conn->m_stream.expires_after(io_timeout());
+    net::async_read(lane.m_conn->m_stream, net::buffer(lane.m_ack),
+                    net::bind_executor(m_strand, beast::bind_front_handler(
+                                                      &ReplicationSender::on_read,
+                                                      shared_from_this(), i)));
+}
+
+void
+ReplicationSender::on_connect(size_t i,
+                              beast::error_code ec,
+                              tcp::resolver::results_type::endpoint_type)
+{
+    auto& lane = m_lanes[i];
+    lane.m_connecting = false;
+    if (m_closing)
+        return on_closed();
+
+    if (ec)
+        return on_error(i, ec, "connect");
+
+    lane.m_conn->m_connected = true;
+
+    // Pipelined frames must not wait for each other's acks
+    lane.m_conn->m_stream.socket().set_option(tcp::no_delay(true), ec);
+    pump(i);
+}
+
+void
+ReplicationSender::on_write(size_t i, beast::error_code ec, std::size_t bytes_transferred)
+{
+    boost::ignore_unused(bytes_transferred);
+
+    m_lanes[i].m_writing = false;
+    if (m_closing)
+        return on_closed();
+
+    if (ec)
+        return on_error(i, ec, "write");
+
+    pump(i);
+}
+
+void
+ReplicationSender::on_read(size_t i, beast::error_code ec, std::size_t bytes_transferred)
+{
+    boost::ignore_unused(bytes_transferred);
+
+    auto& lane = m_lanes[i];
+    lane.m_reading = false;
+    if (m_closing)
+        return on_closed();
+
+    if (ec)
+        return on_error(i, ec, "read");
+
+    lane.m_maybe_stale = false;
+    m_reconnected = false;
+
+    auto batch = lane.m_inflight.front();
+    auto body = boost::string_view(lane.m_ack, sizeof(lane.m_ack)).substr(batch_frame::PREFIX_SIZE);
+    batch_frame::Ack ack;
+    if (!batch_frame::decode_ack(body, ack) ||
+        (ack.m_status == batch_frame::ok && ack.m_last_id + 1 != batch->m_end))
+    {
+        fail(beast::errc::make_error_code(beast::errc::protocol_error), "bad ack");
+        return do_close(false);
+    }
+
+    // Every ack tells what the secondary reads, batches cut from now on
+    // use it. Compressed batches it refuses are cut again after the retry.
+    m_peer_codecs = ack.m_codecs;
+
+    auto now = std::chrono::steady_clock::now();
+    m_metrics.m_round_trip.observe(now - batch->m_sent);
+
+    // Batches pipelined behind others wait for them on the secondary, the
+    // timeout only covers the wait since the ack before
+    m_rtt.observe(now - std::max(batch->m_sent, lane.m_last_ack));
+    lane.m_last_ack = now;
+
+    if (ack.m_status == batch_frame::gap && ack.m_last_id < m_cursor)
+    {
+        // The secondary lost logs, send from where it is
+        if (logger::enabled(logger::warn))
+        {
+            logger::Line(logger::warn) << "Secondary needs logs from " << ack.m_last_id
+                                       << ", sending again from there";
+        }
+        m_cursor = ack.m_last_id;
+        m_metrics.m_cursor = m_cursor;
+        save_cursor();
+        return do_close(true);
+    }
+
+    if (ack.m_status != batch_frame::ok)
+    {
+        m_metrics.m_rejected_batches.add();
+        if (ack.m_status == batch_frame::stale_term)
+        {
+            fail(beast::errc::make_error_code(beast::errc::permission_denied),
+                 "batch rejected, secondary follows a newer term");
+        }
+        else
+        {
+            fail(beast::errc::make_error_code(beast::errc::protocol_error), "batch rejected");
+        }
+        return do_close(false);
+    }
+
+    lane.m_inflight.pop_front();
+    batch->m_acked = true;
+    m_failures = 0;
+    m_metrics.m_timeout_ms = io_timeout().count();
+    m_metrics.m_acked_batches.add();
+    if (batch->m_snapshot)
+    {
+        m_metrics.m_snapshots.add();
+    }
+    else
+    {
+        m_metrics.m_acked_logs.add(batch->m_end - batch->m_first);
+    }
+    advance();
+
+    // There is room in the pipeline again
+    do_flush();
+}
+
+void
+ReplicationSender::advance()
+{
+    auto cursor = m_cursor;
+    while (!m_outstanding.empty() && m_outstanding.front()->m_acked)
+    {
+        cursor = m_outstanding.front()->m_end;
+        m_outstanding.pop_front();
+    }
+
+    if (cursor == m_cursor)
+    {
+        return;
+    }
+
+    // A log counts toward wc once the secondary has everything before it.
+    // Compacted logs have nobody waiting.
+    for (auto id = std::max({m_cursor, m_credited, m_context->first_log()}); id < cursor; ++id)
+    {
+        m_context->update_wc(id);
+    }
+    m_credited = std::max(m_credited, cursor);
+    m_cursor = cursor;
+    m_metrics.m_cursor = m_cursor;
+    save_cursor();
+}
+
+void
+ReplicationSender::on_error(size_t i, beast::error_code ec, const char* what)
+{
+    // Pooled connection was closed by the secondary while idle
+    if (m_lanes[i].m_maybe_stale && !m_reconnected)
+    {
+        m_reconnected = true;
+        return do_close(true);
+    }
+
+    fail(ec, what);
+    do_close(false);
+}
+
+void
+ReplicationSender::do_close(bool immediate)
+{
+    if (m_closing)
+    {
+        return;
+    }
+
+    m_closing = true;
+    m_immediate = immediate;
+
+    for (auto& lane : m_lanes)
+    {
+        if (lane.m_conn)
+        {
+            beast::error_code ec;
+            lane.m_conn->m_stream.socket().close(ec);
+        }
+    }
+    on_closed();
+}
+
+void
+ReplicationSender::on_closed()
+{
+    for (auto& lane : m_lanes)
+    {
+        if (lane.m_connecting || lane.m_writing || lane.m_reading)
+        {
+            return;
+        }
+    }
+
+    m_closing = false;
+    for (auto& lane : m_lanes)
+    {
+        lane.m_conn.reset();
+        lane.m_inflight.clear();
+        lane.m_maybe_stale = false;
+    }
+
+    // Everything after the cursor goes again
+    m_unsent.clear();
+    m_outstanding.clear();
+    m_metrics.m_queued_batches = 0;
+    m_next = m_cursor;
+
+    // Down: on_reachable starts again
+    if (m_immediate || !m_reachable)
+    {
+        return do_flush();
+    }
+
+    m_reconnected = false;
+    m_metrics.m_retries.add();
+
+    // Full jitter: clients retrying after the same outage spread out
+    auto ceiling = std::min<int64_t>(m_settings.m_retry_max.count(),
+                                     m_settings.m_retry_base.count() << std::min(m_failures, 16u));
+    ++m_failures;
+    m_metrics.m_timeout_ms = io_timeout().count();
+    std::uniform_int_distribution<int64_t> delay(0, std::max<int64_t>(0, ceiling));
+
+    m_backing_off = true;
+    m_backoff_timer.expires_after(std::chrono::milliseconds(delay(m_random)));
+    m_backoff_timer.async_wait(
+        beast::bind_front_handler(&ReplicationSender::on_backoff, shared_from_this()));
+}
+
+void
+ReplicationSender::on_backoff(beast::error_code ec)
+{
+    if (ec == net::error::operation_aborted)
+        return;
+
+    m_backing_off = false;
+    do_flush();
+}
+
+std::chrono::milliseconds
+ReplicationSender::io_timeout() const
+{
+    // Until the first ack the bound is all there is
+    auto timeout = m_rtt.timeout(m_settings.m_timeout_min, m_settings.m_timeout_max);
+    return std::min(m_settings.m_timeout_max, timeout * (int64_t(1) << std::min(m_failures, 5u)));
+}
+
+void
+ReplicationSender::load_cursor()
+{
+    if (m_settings.m_cursor_path.empty())
+    {
+        return;
+    }
+
+    m_cursor_fd = ::open(m_settings.m_cursor_path.c_str(), O_RDWR | O_CREAT, 0644);
+    if (m_cursor_fd < 0)
+    {
+        fail(beast::error_code(errno, boost::system::generic_category()), "cursor open");
+        return;
+    }
+
+    char buf[8];
+    if (::pread(m_cursor_fd, buf, sizeof(buf), 0) == sizeof(buf))
+    {
+        // The log of master may be shorter if it was not synced
+        m_cursor = std::min<size_t>(segment_format::get_u64(buf), m_context->log_count());
+        m_next = m_credited = m_sent = m_cursor;
+        m_metrics.m_cursor = m_cursor;
+    }
+}
+
+void
+ReplicationSender::save_cursor()
+{
+    if (m_cursor_fd < 0 || m_save_armed)
+    {
+        return;
+    }
+
+    // A cursor behind the real one only costs a few resent logs,
+    // which the secondary skips, so it is neither synced nor written on every ack
+    m_save_armed = true;
+    m_save_timer.expires_after(std::chrono::seconds(1));
+    m_save_timer.async_wait(
+        beast::bind_front_handler(&ReplicationSender::on_save, shared_from_this()));
+}
+
+void
+ReplicationSender::on_save(beast::error_code ec)
+{
+    m_save_armed = false;
+    if (ec)
+        return;
+
+    char buf[8];
+    segment_format::put_u64(buf, m_cursor);
+    if (::pwrite(m_cursor_fd, buf, sizeof(buf), 0) != sizeof(buf))
+    {
+        fail(beast::error_code(errno, boost::system::generic_category()), "cursor write");
+    }
+}
@@ -0,0 +1,305 @@
+#pragma once
+
+#include <boost/beast/core.hpp>
+#include <boost/asio/read.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/asio/strand.hpp>
+#include <boost/asio/write.hpp>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+#include "batch_frame.h"
+#include "failure_detector.h"
+#include "metrics.h"
+#include "node_pool.h"
+
+namespace beast = boost::beast;    // from <boost/beast.hpp>
+namespace net = boost::asio;       // from <boost/asio.hpp>
+using tcp = boost::asio::ip::tcp;  // from <boost/asio/ip/tcp.hpp>
+
+class RServer;
+struct RNode;
+
+// One ReplicationSender per secondary.
+//
+// The log of master is the send queue: the sender keeps a cursor, the id
+// below which the secondary acknowledged every log, and cuts batch_frame
+// append frames from the published logs starting there. Frames are spread
+// over several keep-alive connections to the replication port and
+// pipelined on each; the secondary puts them back in order. A batch is
+// flushed when it reaches the entries or bytes limit, or when the linger
+// deadline expires. Acks may come back in any order, the cursor moves over
+// the acknowledged prefix and updates wc of every log it passes.
+//
+// Nothing is lost when the connection breaks or the secondary refuses a
+// batch: the sender goes back to the cursor and retries after an
+// exponential backoff with jitter. A secondary which was away catches up
+// with full batches streamed back to back. A secondary which lost logs
+// (restarted without its data) answers with the id it needs and the
+// cursor moves back there. With a data directory the cursor is saved
+// to disk, so a restarted master does not send everything again.
+// A secondary whose cursor is below the logs master compacted away gets
+// a snapshot frame instead and continues with the logs kept.
+//
+// Connections time out after srtt + 4 * rttvar of the acks seen so far,
+// doubled with every failure in a row. While the NodeMonitor reports the
+// secondary down, nothing is sent and no connection is held; the sender
+// starts again from the cursor once it is back.
+class ReplicationSender : public std::enable_shared_from_this<ReplicationSender>
+{
+public:
+    struct Settings
+    {
+        size_t m_max_entries = 256;
+        size_t m_max_bytes = 1 << 20;
+        std::chrono::microseconds m_linger{200};
+        size_t m_max_inflight = 4;
+
+        // Connections the batches are spread over
+        size_t m_connections = 2;
+
+        // Delay before the n-th retry in a row is uniform in
+        // [0, min(m_retry_max, m_retry_base * 2^n)]
+        std::chrono::milliseconds m_retry_base{50};
+        std::chrono::milliseconds m_retry_max{5000};
+
+        // Bounds of the I/O timeout
+        std::chrono::milliseconds m_timeout_min{1000};
+        std::chrono::milliseconds m_timeout_max{30000};
+
+        // Where the cursor is saved, empty to keep it in memory only
+        std::string m_cursor_path;
+
+        // Batches of at least m_compress_min_bytes are compressed with
+        // the codec once the secondary tells it accepts it
+        batch_frame::Codec m_codec = batch_frame::no_codec;
+        int m_compression_level = 1;
+        size_t m_compress_min_bytes = 1024;
+
+        // Logs of at least this size are written from where master stores
+        // them instead of being copied into the batch. Batches which get
+        // compressed are copied whole.
+        size_t m_zero_copy_min_bytes = 1024;
+    };
+
+    struct Metrics
+    {
+        // From writing a batch to receiving its ack
+        metrics::Histogram m_round_trip;
+        metrics::Counter m_acked_batches;
+        metrics::Counter m_rejected_batches;
+        metrics::Counter m_acked_logs;
+
+        // Connection or batch failures followed by a retry
+        metrics::Counter m_retries;
+
+        // Snapshots a secondary installed in place of compacted logs
+        metrics::Counter m_snapshots;
+
+        // Logs sent again after a failure
+        metrics::Counter m_resent_logs;
+
+        // Batch sizes before and after compression, the ratio of the two
+        // is what compression saves; time spent compressing
+        metrics::Counter m_raw_bytes;
+        metrics::Counter m_wire_bytes;
+        metrics::Counter m_compressed_batches;
+        metrics::Counter m_compress_ns;
+
+        // Log bytes written from where they are stored, not copied
+        metrics::Counter m_zero_copy_bytes;
+
+        // Copy of the cursor and of the current I/O timeout for the scrapes
+        std::atomic<size_t> m_cursor{0};
+        std::atomic<int64_t> m_timeout_ms{0};
+
+        // Batches waiting to be written or for their ack, at most
+        // m_max_inflight
+        std::atomic<size_t> m_queued_batches{0};
+    };
+
+    ReplicationSender(RServer* context, const RNode& node, const Settings& settings);
+    ~ReplicationSender();
+
+    // Starts sending the logs published before start
+    void run();
+
+    // Thread safe. New logs of bytes payload bytes were published.
+    void notify(size_t bytes);
+
+    // Thread safe. The secondary went down or came back, see NodeMonitor.
+    void set_reachable(bool reachable);
+
+    const Metrics&
+    metrics() const
+    {
+        return m_metrics;
+    }
+
+private:
+    struct Batch
+    {
+        size_t m_first;
+        size_t m_end;
+        size_t m_raw_bytes = 0;
+        std::chrono::steady_clock::time_point m_sent;
+        bool m_acked = false;
+
+        // Snapshot at m_end in place of the logs
+        bool m_snapshot = false;
+
+        // The frame, without the logs in m_refs: each of them goes
+        // right after m_frame[0, m_offset). Every secondary gets its
+        // own headers over the same stored logs, m_pins keep them alive.
+        struct Ref
+        {
+            size_t m_offset;
+            boost::string_view m_log;
+        };
+
+        std::string m_frame;
+        std::vector<Ref> m_refs;
+        size_t m_ref_bytes = 0;
+        std::vector<std::shared_ptr<const void>> m_pins;
+
+        // Scatter-gather list over m_frame and m_refs, built once the
+        // frame is complete
+        std::vector<net::const_buffer> m_buffers;
+
+        void gather();
+
+        size_t
+        size() const
+        {
+            return m_frame.size() + m_ref_bytes;
+        }
+    };
+
+    // One connection to the secondary
+    struct Lane
+    {
+        NodePool::connection_ptr m_conn;
+        bool m_connecting = false;
+        bool m_writing = false;
+        bool m_reading = false;
+
+        // Connection was taken from the pool already established
+        // and no ack was received on it yet
+        bool m_maybe_stale = false;
+
+        // Batches written (or being written) on this connection waiting for the ack
+        std::deque<std::shared_ptr<Batch>> m_inflight;
+
+        // Ack of the oldest batch in flight
+        char m_ack[batch_frame::ACK_SIZE];
+
+        // When the last ack came in on this connection
+        std::chrono::steady_clock::time_point m_last_ack;
+    };
+
+    void on_notify();
+    void on_reachable(bool reachable);
+    void on_linger(beast::error_code ec);
+    void do_flush();
+    void compress(Batch& batch);
+    void pump();
+    void pump(size_t lane);
+    void do_write(size_t lane);
+    void do_read(size_t lane);
+
+    void on_connect(size_t lane, beast::error_code ec, tcp::resolver::results_type::endpoint_type);
+    void on_write(size_t lane, beast::error_code ec, std::size_t bytes_transferred);
+    void on_read(size_t lane, beast::error_code ec, std::size_t bytes_transferred);
+
+    // Moves the cursor over the acknowledged batches at the front
+    void advance();
+
+    // An I/O error on the lane
+    void on_error(size_t lane, beast::error_code ec, const char* what);
+
+    // Closes all connections and sends again from the cursor.
+    // Pending operations are aborted and the connections are dropped once
+    // the last of them completes. Retries right away if immediate is set,
+    // otherwise after the backoff.
+    void do_close(bool immediate);
+    void on_closed();
+    void on_backoff(beast::error_code ec);
+
+    // Time a connect, write or ack may take
+    std::chrono::milliseconds io_timeout() const;
+
+    void load_cursor();
+    void save_cursor();
+    void on_save(beast::error_code ec);
+
+    RServer* m_context;
+    std::shared_ptr<NodePool> m_pool;
+    Settings m_settings;
+    net::strand<net::io_context::executor_type> m_strand;
+    net::steady_timer m_linger_timer;
+    bool m_linger_armed = false;
+
+    // A notification is on its way to the strand
+    std::atomic<bool> m_notified{false};
+
+    // Payload bytes published since the strand last looked
+    std::atomic<size_t> m_notified_bytes{0};
+
+    // State below is only touched on m_strand
+
+    // Every log below the cursor is acknowledged by the secondary
+    size_t m_cursor = 0;
+
+    // Next log to put into a batch
+    size_t m_next = 0;
+
+    // Payload bytes published since the last flush, a full batch
+    // goes without waiting for the linger
+    size_t m_queued_bytes = 0;
+
+    // Logs below were credited to wc already, resent logs are not counted twice
+    size_t m_credited = 0;
+
+    // Logs below were written to the secondary at least once
+    size_t m_sent = 0;
+
+    std::vector<Lane> m_lanes;
+    bool m_closing = false;
+    bool m_immediate = false;
+
+    // Retrying right away after a stale pooled connection failed
+    bool m_reconnected = false;
+
+    // Time the secondary takes for an ack once the batch is at the front
+    RttEstimator m_rtt;
+
+    // False while the secondary is down
+    bool m_reachable = true;
+
+    // Codecs the secondary accepts, as of its last ack
+    uint8_t m_peer_codecs = batch_frame::no_codec;
+
+    // Waiting before the next attempt
+    net::steady_timer m_backoff_timer;
+    bool m_backing_off = false;
+    unsigned m_failures = 0;
+    std::minstd_rand m_random;
+
+    // Batches waiting to be written
+    std::deque<std::shared_ptr<Batch>> m_unsent;
+
+    // Batches written on any connection and not yet passed by the cursor,
+    // in id order
+    std::deque<std::shared_ptr<Batch>> m_outstanding;
+
+    // Saving the cursor at most once a second
+    int m_cursor_fd = -1;
+    net::steady_timer m_save_timer;
+    bool m_save_armed = false;
+
+    Metrics m_metrics;
+};
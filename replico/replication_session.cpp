@@ -0,0 +1,299 @@
+#include "replication_session.h"
+#include "replico_server.h"
+#include "helpers.h"
+
+namespace
+{
+// Fault rules match replication frames under this target
+const char* const FAULT_TARGET = "/addbatch";
+
+// and heartbeats under this one, so the emulated slow replica stays alive
+const char* const HEARTBEAT_FAULT_TARGET = "/heartbeat";
+
+// Bytes requested from the socket at once
+const size_t READ_CHUNK = 64 << 10;
+}  // namespace
+
+ReplicationSession::ReplicationSession(tcp::socket&& socket, RServer* context)
+    : m_stream(std::move(socket))
+    , m_context(context)
+    , m_fault_timer(m_stream.get_executor())
+{
+}
+
+void
+ReplicationSession::run()
+{
+    beast::error_code ec;
+    auto remote_endpoint = m_stream.socket().remote_endpoint(ec);
+    if (ec)
+        return fail(ec, "remote_endpoint");
+
+    // Only master replicates to secondaries
+    if (remote_endpoint.address() != m_context->m_root_endpoint.address())
+    {
+        m_stream.socket().close(ec);
+        return;
+    }
+
+    // Acks are small and must not wait for more data
+    m_stream.socket().set_option(tcp::no_delay(true), ec);
+    do_read();
+}
+
+void
+ReplicationSession::do_read()
+{
+    using namespace batch_frame;
+
+    // The next frame may be buffered already
+    m_frame_size = 0;
+    if (m_buffer.size() >= PREFIX_SIZE)
+    {
+        m_frame_size = body_size(static_cast<const char*>(m_buffer.data().data()));
+        if (m_frame_size > MAX_FRAME_BYTES)
+        {
+            fail(beast::errc::make_error_code(beast::errc::message_size), "replication frame");
+            beast::error_code ec;
+            m_stream.socket().close(ec);
+            return;
+        }
+
+        if (m_buffer.size() >= PREFIX_SIZE + m_frame_size)
+        {
+            auto action = m_context->m_faults.decide(is_heartbeat() ? HEARTBEAT_FAULT_TARGET
+                                                                    : FAULT_TARGET);
+            if (action.m_delay.count() == 0)
+            {
+                return handle(action);
+            }
+
+            // Injected latency, further frames wait behind this one
+            m_fault_timer.expires_after(action.m_delay);
+            m_fault_timer.async_wait(beast::bind_front_handler(
+                &ReplicationSession::on_fault_delay, shared_from_this(), action));
+            return;
+        }
+    }
+
+    auto missing = m_frame_size > 0 ? PREFIX_SIZE + m_frame_size - m_buffer.size() : 0;
+
+    // Master closes idle connections before this expires
+    m_stream.expires_after(std::chrono::seconds(30));
+    m_stream.async_read_some(
+        m_buffer.prepare(std::max(READ_CHUNK, missing)),
+        beast::bind_front_handler(&ReplicationSession::on_read, shared_from_this()));
+}
+
+void
+ReplicationSession::on_read(beast::error_code ec, std::size_t bytes_transferred)
+{
+    // Master closed the connection
+    if (ec == net::error::eof)
+        return;
+
+    if (ec)
+        return fail(ec, "replication read");
+
+    m_buffer.commit(bytes_transferred);
+    do_read();
+}
+
+void
+ReplicationSession::on_fault_delay(FaultInjector::Action action, beast::error_code ec)
+{
+    if (ec)
+        return fail(ec, "fault timer");
+
+    handle(action);
+}
+
+bool
+ReplicationSession::is_heartbeat() const
+{
+    return m_frame_size > 0 &&
+           uint8_t(static_cast<const char*>(m_buffer.data().data())[batch_frame::PREFIX_SIZE]) ==
+               batch_frame::heartbeat_type;
+}
+
+void
+ReplicationSession::handle(FaultInjector::Action action)
+{
+    using namespace batch_frame;
+
+    if (action.m_drop)
+    {
+        // Injected message loss - no ack at all
+        beast::error_code ec;
+        m_stream.socket().close(ec);
+        return;
+    }
+
+    auto seq = m_next_seq++;
+    m_slots.emplace_back();
+
+    auto body = boost::string_view(static_cast<const char*>(m_buffer.data().data()) + PREFIX_SIZE,
+                                   m_frame_size);
+    if (is_heartbeat())
+    {
+        // Answered at once, master measures the round trip
+        Heartbeat heartbeat;
+        if (action.m_error || !decode_heartbeat(body, heartbeat))
+        {
+            send_ack(seq, action.m_error ? unavailable : malformed, 0);
+        }
+        else
+        {
+            send_ack(seq, m_context->accept_leader(heartbeat.m_term, heartbeat.m_epoch) ? ok
+                                                                                      : stale_term,
+                     heartbeat.m_seq);
+        }
+
+        m_buffer.consume(PREFIX_SIZE + m_frame_size);
+        return do_read();
+    }
+
+    m_context->m_metrics.m_frames.add();
+    auto status = ok;
+    Snapshot snapshot;
+    auto is_snapshot = false;
+    if (action.m_error)
+    {
+        status = unavailable;
+    }
+    else if (!inflate(body))
+    {
+        status = malformed;
+    }
+    else if (!body.empty() && uint8_t(body[0]) == snapshot_type)
+    {
+        is_snapshot = true;
+        if (!decode_snapshot(body, snapshot) || snapshot.m_index == 0)
+        {
+            status = malformed;
+        }
+        else if (!m_context->accept_leader(snapshot.m_term, snapshot.m_epoch))
+        {
+            status = stale_term;
+        }
+    }
+    else if (!decode(body, m_frame))
+    {
+        status = malformed;
+    }
+    else if (!m_context->accept_leader(m_frame.m_term, m_frame.m_epoch))
+    {
+        status = stale_term;
+    }
+
+    if (status != ok)
+    {
+        m_context->m_metrics.m_rejected_frames.add();
+        send_ack(seq, status, 0);
+    }
+    else if (is_snapshot)
+    {
+        // Master compacted the logs this node lacks, it continues at the index
+        m_context->install_snapshot(snapshot.m_index);
+        send_ack(seq, ok, snapshot.m_index - 1);
+    }
+    else
+    {
+        // Logs are copied into the store before add_replicated returns,
+        // the frame may be dropped from the buffer right after
+        auto last_id = m_frame.m_entries.empty() ? 0 : m_frame.m_entries.back().m_id;
+        uint64_t missing = 0;
+        // Master sends the frame again if the logs could not be persisted
+        status = m_context->add_replicated(
+            m_frame, [self = shared_from_this(), seq, last_id](bool durable) {
+                self->send_ack(seq, durable ? ok : unavailable, durable ? last_id : 0);
+            }, missing);
+        if (status != ok)
+        {
+            m_context->m_metrics.m_rejected_frames.add();
+            send_ack(seq, status, missing);
+        }
+    }
+
+    m_buffer.consume(PREFIX_SIZE + m_frame_size);
+    do_read();
+}
+
+bool
+ReplicationSession::inflate(boost::string_view& body)
+{
+    if (body.empty() || uint8_t(body[0]) != batch_frame::compressed_type)
+    {
+        return true;
+    }
+
+    // Master compresses only what the acks said is accepted
+    if (!(m_context->m_codecs & batch_frame::zlib_codec))
+    {
+        return false;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    auto ok = batch_frame::decompress(body, m_inflated);
+    m_context->m_metrics.m_compressed_frames.add();
+    m_context->m_metrics.m_decompress_ns.add(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                                 std::chrono::steady_clock::now() - start)
+                                                 .count());
+    body = m_inflated;
+    return ok;
+}
+
+void
+ReplicationSession::send_ack(uint64_t seq, batch_frame::Status status, uint64_t last_id)
+{
+    std::string ack;
+    batch_frame::encode_ack(ack, status, m_context->m_leader_term.load(), last_id,
+                            m_context->m_codecs);
+
+    // Durability is reported from the write-ahead log thread
+    net::post(m_stream.get_executor(), beast::bind_front_handler(&ReplicationSession::on_ack,
+                                                                 shared_from_this(), seq,
+                                                                 std::move(ack)));
+}
+
+void
+ReplicationSession::on_ack(uint64_t seq, std::string ack)
+{
+    m_slots[seq - m_first_seq] = std::move(ack);
+    while (!m_slots.empty() && !m_slots.front().empty())
+    {
+        m_acks += m_slots.front();
+        m_slots.pop_front();
+        ++m_first_seq;
+    }
+
+    do_write();
+}
+
+void
+ReplicationSession::do_write()
+{
+    if (m_writing || m_acks.empty())
+    {
+        return;
+    }
+
+    // Everything acknowledged so far goes out in one write
+    m_writing = true;
+    m_writing_acks.swap(m_acks);
+    net::async_write(m_stream.socket(), net::buffer(m_writing_acks),
+                     beast::bind_front_handler(&ReplicationSession::on_write, shared_from_this()));
+}
+
+void
+ReplicationSession::on_write(beast::error_code ec, std::size_t bytes_transferred)
+{
+    boost::ignore_unused(bytes_transferred);
+
+    m_writing = false;
+    m_writing_acks.clear();
+    if (ec)
+        return fail(ec, "replication write");
+
+    do_write();
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <boost/beast/core.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/asio/write.hpp>
+#include <deque>
+#include <memory>
+#include <string>
+#include <vector>
+#include "batch_frame.h"
+#include "fault_injector.h"
+
+namespace beast = boost::beast;    // from <boost/beast.hpp>
+namespace net = boost::asio;       // from <boost/asio.hpp>
+using tcp = boost::asio::ip::tcp;  // from <boost/asio/ip/tcp.hpp>
+
+class RServer;
+
+// Secondary side of a replication connection from master.
+// Reads batch_frame append frames, adds their logs and answers each frame
+// with an ack once the logs are durable. A snapshot frame replaces the
+// logs master no longer has. Master pipelines frames, so several
+// frames may be waiting for durability; acks go out in the frame order and
+// are coalesced into one write. Heartbeats of master are answered at once.
+class ReplicationSession : public std::enable_shared_from_this<ReplicationSession>
+{
+public:
+    ReplicationSession(tcp::socket&& socket, RServer* context);
+
+    void run();
+
+private:
+    void do_read();
+    void on_read(beast::error_code ec, std::size_t bytes_transferred);
+    void on_fault_delay(FaultInjector::Action action, beast::error_code ec);
+    void handle(FaultInjector::Action action);
+
+    // The frame at the front of the buffer is a heartbeat
+    bool is_heartbeat() const;
+
+    // Points body at the inflated frame if it is compressed.
+    // Returns false if it cannot be inflated.
+    bool inflate(boost::string_view& body);
+
+    // Thread safe. seq is the number of the frame on this connection.
+    void send_ack(uint64_t seq, batch_frame::Status status, uint64_t last_id);
+    void on_ack(uint64_t seq, std::string ack);
+    void do_write();
+    void on_write(beast::error_code ec, std::size_t bytes_transferred);
+
+    beast::tcp_stream m_stream;
+    RServer* m_context;
+
+    // May hold several frames, the current one is at the front
+    beast::flat_buffer m_buffer;
+    batch_frame::Append m_frame;
+
+    // Body of the last compressed frame, m_frame points into it
+    std::string m_inflated;
+    uint32_t m_frame_size = 0;
+    uint64_t m_next_seq = 0;
+
+    // Delays the frame when latency is injected
+    net::steady_timer m_fault_timer;
+
+    // Acks of frames m_first_seq and on, empty until the frame is done.
+    // Failed frames are answered at once while older ones may still
+    // wait for durability, this keeps the acks in order.
+    std::deque<std::string> m_slots;
+    uint64_t m_first_seq = 0;
+
+    // Acks waiting for the write in progress and the ones being written
+    std::string m_acks;
+    std::string m_writing_acks;
+    bool m_writing = false;
+};
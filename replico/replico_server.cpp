@@ -1,12 +1,128 @@
 #include "replico_server.h"
 #include "log_time_scope.h"
+#include "logger.h"
 #include <boost/property_tree/json_parser.hpp>
 #include "server_session.h"
 #include "server_listener.h"
+#include "replication_session.h"
+#include <pthread.h>
+#include <sched.h>
+#include <sstream>
 
 namespace
 {
 const std::string ROOT = "root";
+
+// Idle connections per secondary
+const size_t POOL_SIZE = 8;
+
+// Must be lower than the secondary's read timeout
+const int POOL_IDLE_TIMEOUT_MS = 20000;
+
+// Write-ahead log segment size
+const size_t SEGMENT_BYTES = 64 << 20;
+
+// Replication port is the HTTP port plus this unless given explicitly
+const int REPLICATION_PORT_OFFSET = 1000;
+
+// Logs a secondary buffers ahead of a gap
+const size_t REORDER_WINDOW = 16384;
+
+// Secondaries emulate a slow replica unless told otherwise
+const std::string NODE_FAULTS = "/addbatch:delay=uniform:1000-10000";
+
+// How often the retention is applied
+const int COMPACT_INTERVAL_MS = 1000;
+
+// Writes waiting for their write concern, and their bytes, before
+// /addlog is refused
+const size_t MAX_PENDING_WRITES = 65536;
+const size_t MAX_PENDING_BYTES = 256 << 20;
+
+// Pins the thread to the index-th of the CPUs the process may run on
+void
+pin_to_cpu(std::thread& thread, size_t index)
+{
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0 || CPU_COUNT(&allowed) == 0)
+    {
+        return;
+    }
+
+    index %= CPU_COUNT(&allowed);
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+    {
+        if (!CPU_ISSET(cpu, &allowed) || index-- > 0)
+        {
+            continue;
+        }
+
+        cpu_set_t one;
+        CPU_ZERO(&one);
+        CPU_SET(cpu, &one);
+        if (pthread_setaffinity_np(thread.native_handle(), sizeof(one), &one) != 0 &&
+            logger::enabled(logger::warn))
+        {
+            logger::Line(logger::warn) << "Cannot pin I/O thread to CPU " << cpu;
+        }
+        return;
+    }
+}
+
+// TCP port 1-65535
+bool
+parse_port(const std::string& text, unsigned short& port)
+{
+    if (text.empty() || text.size() > 5 ||
+        text.find_first_not_of("0123456789") != std::string::npos)
+    {
+        return false;
+    }
+    auto value = std::stoul(text);
+    if (value == 0 || value > 65535)
+    {
+        return false;
+    }
+    port = static_cast<unsigned short>(value);
+    return true;
+}
+
+// ip:port
+bool
+parse_endpoint(const std::string& ip, const std::string& port, tcp::endpoint& endpoint)
+{
+    beast::error_code ec;
+    auto address = net::ip::make_address(ip, ec);
+    unsigned short number;
+    if (ec || !parse_port(port, number))
+    {
+        std::cerr << "Bad address " << ip << ":" << port << std::endl;
+        return false;
+    }
+    endpoint = tcp::endpoint{address, number};
+    return true;
+}
+
+// "log [actual/expected]" on master, "log" on secondaries
+void
+append_line(std::string& out,
+            bool is_root,
+            boost::string_view log,
+            size_t actual_wc,
+            size_t expected_wc)
+{
+    out.append(log.data(), log.size());
+    if (is_root)
+    {
+        out += " [";
+        out += std::to_string(actual_wc);
+        out += "/";
+        out += std::to_string(expected_wc);
+        out += "]";
+    }
+    out += "\n";
+}
 }  // namespace
 
 bool
@@ -17,17 +133,10 @@ RServer::start(int argc, char* argv[])
     std::vector<std::string> strs;
     boost::split(strs, argv[2], boost::is_any_of(":"));
 
-    if (strs.size() != 2)
+    if (strs.size() != 2 || !parse_endpoint(strs[0], strs[1], m_endpoint))
     {
         return false;
     }
-
-    {
-        auto ip = net::ip::make_address(strs[0]);
-        unsigned short port = std::stoi(strs[1]);
-
-        m_endpoint = tcp::endpoint{ip, port};
-    }
     strs.clear();
 
     boost::split(strs, argv[3], boost::is_any_of(m_is_root ? ";" : ":"));
@@ -37,46 +146,1177 @@ RServer::start(int argc, char* argv[])
         std::vector<std::string> parts;
         for (auto& s : strs)
         {
+            // ip:port[:replication port]
+            // Names are resolved later. The default replication port
+            // must exist as well.
             boost::split(parts, s, boost::is_any_of(":"));
-            auto ip = net::ip::make_address(parts[0]);
-            unsigned short port = std::stoi(parts[1]);
+            unsigned short port;
+            unsigned short replication;
+            if ((parts.size() != 2 && parts.size() != 3) || !parse_port(parts[1], port) ||
+                !parse_port(parts.size() == 3 ? parts[2]
+                                              : std::to_string(port + REPLICATION_PORT_OFFSET),
+                            replication))
+            {
+                std::cerr << "Bad secondary address " << s << ", expected ip:port[:port]"
+                          << std::endl;
+                return false;
+            }
 
-            m_nodes.emplace_back(RNode{parts[0], parts[1]});
+            m_nodes.emplace_back(parts[0], parts[1], std::to_string(replication));
             parts.clear();
         }
     }
     else
     {
-        if (strs.size() != 2)
+        if (strs.size() != 2 || !parse_endpoint(strs[0], strs[1], m_root_endpoint))
         {
             return false;
         }
+    }
+
+    m_thread_number = std::max<int>(1, std::atoi(argv[4]));
 
-        auto ip = net::ip::make_address(strs[0]);
-        unsigned short port = std::stoi(strs[1]);
+    m_options = parse_options(argc, argv, 5);
 
-        m_root_endpoint = tcp::endpoint{ip, port};
+    logger::Level log_level;
+    if (!logger::parse_level(option<std::string>("log-level", "info"), log_level))
+    {
+        std::cerr << "--log-level: expected trace, debug, info, warn, error or off" << std::endl;
+        return false;
     }
+    logger::set_level(log_level);
+    logger::set_sample(option<unsigned>("log-sample", 1));
+    logger::start();
+    m_wc_timeout = std::chrono::milliseconds(option<int>("wc-timeout-ms", 0));
+    m_max_pending_writes = option<size_t>("max-pending-writes", MAX_PENDING_WRITES);
+    m_max_pending_bytes = option<size_t>("max-pending-bytes", MAX_PENDING_BYTES);
+    m_min_index_wait =
+        std::chrono::milliseconds(option<int>("min-index-wait-ms", m_min_index_wait.count()));
+    m_admin_token = option<std::string>("admin-token", "");
 
-    m_thread_number = std::max<int>(1, std::atoi(argv[4]));
+    if (m_is_root)
+    {
+        m_term = option<uint64_t>("term", m_term);
+        m_epoch = std::chrono::duration_cast<std::chrono::microseconds>(
+                      std::chrono::system_clock::now().time_since_epoch())
+                      .count();
+    }
+    else
+    {
+        m_reorder.reset(new ReorderBuffer(option<size_t>("reorder-window", REORDER_WINDOW)));
+        m_replication_endpoint = tcp::endpoint{
+            m_endpoint.address(),
+            option<unsigned short>("replication-port",
+                                   m_endpoint.port() + REPLICATION_PORT_OFFSET)};
+    }
 
-    // The io_context is required for all I/O
-    m_ioc = std::make_shared<net::io_context>(m_thread_number);
+    std::string why;
+    if (!m_faults.configure(option<std::string>("fault", m_is_root ? "" : NODE_FAULTS), why))
+    {
+        std::cerr << "--fault: " << why << std::endl;
+        return false;
+    }
 
-    // Create and launch a listening port
-    std::make_shared<ServerListener>(this)->run();
+    auto codec = option<std::string>("compression", m_is_root ? "none" : "zlib");
+    if (codec != "none" && codec != "zlib")
+    {
+        std::cerr << "--compression: expected none or zlib" << std::endl;
+        return false;
+    }
+    m_codecs = codec == "zlib" ? batch_frame::zlib_codec : batch_frame::no_codec;
 
-    // Run the I/O service on the requested number of threads
+    auto data_dir = option<std::string>("data-dir", "");
+    if (!data_dir.empty())
+    {
+        WriteAheadLog::Durability durability;
+        if (!WriteAheadLog::parse_durability(option<std::string>("durability", "batch"),
+                                             durability))
+        {
+            std::cerr << "--durability: expected none, batch or entry" << std::endl;
+            return false;
+        }
+
+        auto segment_bytes = option<size_t>("segment-bytes", SEGMENT_BYTES);
+        if (m_bad_option)
+        {
+            return false;
+        }
+
+        m_wal.reset(new WriteAheadLog(data_dir, segment_bytes, durability));
+
+        // Logs below the snapshot were compacted away. Finish a compaction
+        // a crash interrupted before loading anything.
+        size_t first = m_wal->load_snapshot();
+        bool done = true;
+        if (first > 0 && !m_wal->compact(first, done))
+        {
+            return false;
+        }
+
+        // Restore the logs persisted before restart.
+        // Sealed segments stay on disk, only the active one is loaded.
+        std::vector<std::shared_ptr<SealedSegment>> sealed;
+        bool based = false;
+        bool full = false;
+        auto set_base = [&](size_t id) {
+            m_store.set_base(sealed.empty() ? id
+                                            : sealed.back()->first_id() + sealed.back()->count());
+            based = true;
+        };
+
+        // Frames of a secondary sent again are answered once their logs are synced
+        if (!m_is_root)
+        {
+            m_wal->on_synced([this](uint64_t id) { advance_durable(id + 1); });
+        }
+
+        auto recovered = m_wal->open(sealed, [&](uint64_t record_id, uint32_t expected_wc,
+                                                 boost::string_view log) {
+            if (!based)
+            {
+                set_base(record_id);
+            }
+
+            // The log continued after a snapshot, the logs before are gone
+            if (record_id > m_store.end())
+            {
+                m_store.skip_to(record_id);
+                first = std::max<size_t>(first, record_id);
+            }
+
+            // Published without the handler, the log is already on disk
+            size_t id;
+            if (!m_store.reserve(1, id))
+            {
+                full = true;
+                return;
+            }
+            auto& l = m_store.at(id);
+            l.m_data = m_store.copy(id, log);
+            if (m_is_root)
+            {
+                l.m_crc = segment_format::checksum(log.data(), log.size());
+            }
+            l.m_expected_wc = m_is_root ? expected_wc : 0;
+            l.m_actual_wc = m_is_root ? 1 : 0;
+            l.m_ack_taken = true;
+            m_store.commit(id);
+        });
+        if (!recovered)
+        {
+            return false;
+        }
+        if (full)
+        {
+            std::cerr << "More logs in " << data_dir << " than fit into memory, use --retain-*"
+                      << std::endl;
+            return false;
+        }
+
+        if (!based)
+        {
+            set_base(first);
+        }
+
+        // Sealed segments are contiguous after the first one kept
+        for (size_t i = 1; i < sealed.size(); ++i)
+        {
+            if (sealed[i]->first_id() != sealed[i - 1]->first_id() + sealed[i - 1]->count())
+            {
+                first = std::max<size_t>(first, sealed[i]->first_id());
+            }
+        }
+        if (!sealed.empty())
+        {
+            first = std::max<size_t>(first, sealed.front()->first_id());
+        }
+
+        if (m_store.end() < first)
+        {
+            m_store.skip_to(first);
+        }
+        m_store.truncate(first);
+        if (sealed.empty())
+        {
+            first = std::max(first, m_store.first());
+        }
+
+        sealed.erase(std::remove_if(sealed.begin(), sealed.end(),
+                                    [first](const std::shared_ptr<SealedSegment>& s) {
+                                        return s->first_id() + s->count() <= first;
+                                    }),
+                     sealed.end());
+        m_sealed = std::make_shared<const std::vector<std::shared_ptr<SealedSegment>>>(
+            std::move(sealed));
+        m_first_log = first;
+
+        // Whatever was recovered is on disk
+        advance_durable(m_store.end());
+    }
+
+    m_retain_logs = option<size_t>("retain-logs", 0);
+    m_retain_bytes = option<size_t>("retain-bytes", 0);
+    m_retain_age = std::chrono::seconds(option<int>("retain-age-s", 0));
+    if (m_retain_bytes > 0)
+    {
+        m_retained_bytes = payload_bytes(first_log(), log_count());
+    }
+
+    // The io_context is required for all I/O. Sharded, every thread runs
+    // its own and is the only one touching it.
+    auto sharded = option<bool>("shards", false);
+    for (auto i = sharded ? m_thread_number : 1; i > 0; --i)
+    {
+        m_shards.push_back(std::make_shared<net::io_context>(sharded ? 1 : m_thread_number));
+        m_shard_work.push_back(net::make_work_guard(*m_shards.back()));
+    }
+    m_ioc = m_shards.front();
+
+    if (m_is_root)
+    {
+        auto pool_size = option<size_t>("pool-size", POOL_SIZE);
+        auto idle_timeout =
+            std::chrono::milliseconds(option<int>("pool-idle-ms", POOL_IDLE_TIMEOUT_MS));
 
+        ReplicationSender::Settings batching;
+        batching.m_max_entries =
+            std::max<size_t>(1, option<size_t>("batch-entries", batching.m_max_entries));
+        batching.m_max_bytes = option<size_t>("batch-bytes", batching.m_max_bytes);
+        batching.m_linger =
+            std::chrono::microseconds(option<int>("batch-linger-us", batching.m_linger.count()));
+        batching.m_max_inflight =
+            std::max<size_t>(1, option<size_t>("batch-inflight", batching.m_max_inflight));
+        batching.m_connections =
+            std::max<size_t>(1, option<size_t>("replication-connections", batching.m_connections));
+        batching.m_retry_base =
+            std::chrono::milliseconds(option<int>("retry-base-ms", batching.m_retry_base.count()));
+        batching.m_retry_max =
+            std::chrono::milliseconds(option<int>("retry-max-ms", batching.m_retry_max.count()));
+        batching.m_codec = static_cast<batch_frame::Codec>(m_codecs);
+        batching.m_compression_level =
+            option<int>("compression-level", batching.m_compression_level);
+        batching.m_compress_min_bytes =
+            option<size_t>("compress-min-bytes", batching.m_compress_min_bytes);
+        batching.m_zero_copy_min_bytes =
+            option<size_t>("zero-copy-min-bytes", batching.m_zero_copy_min_bytes);
+        batching.m_timeout_min =
+            std::chrono::milliseconds(option<int>("timeout-min-ms", batching.m_timeout_min.count()));
+
+        NodeMonitor::Settings heartbeats;
+        heartbeats.m_interval =
+            std::chrono::milliseconds(option<int>("heartbeat-ms", heartbeats.m_interval.count()));
+        heartbeats.m_acceptable_pause = std::chrono::milliseconds(
+            option<int>("heartbeat-pause-ms", heartbeats.m_acceptable_pause.count()));
+        heartbeats.m_phi_threshold = option<double>("phi-threshold", heartbeats.m_phi_threshold);
+        heartbeats.m_timeout_min = batching.m_timeout_min;
+
+        // Resolve secondaries once instead of on every replicated log
+        tcp::resolver resolver(*m_ioc);
+        for (size_t i = 0; i < m_nodes.size(); ++i)
+        {
+            auto& n = m_nodes[i];
+            beast::error_code ec;
+            auto endpoints = resolver.resolve(n.ip, n.replication_port, ec);
+            if (ec)
+            {
+                fail(ec, "resolve");
+                return false;
+            }
+
+            // The sender of a secondary and its connections stay on one shard
+            n.pool = std::make_shared<NodePool>(this, shard(i), endpoints,
+                                                pool_size, idle_timeout);
+            n.pool->run();
+
+            // Where replication to the secondary stopped before restart
+            auto settings = batching;
+            if (!data_dir.empty())
+            {
+                settings.m_cursor_path = data_dir + "/replica-" + n.ip + "-" + n.port + ".cursor";
+            }
+            n.sender = std::make_shared<ReplicationSender>(this, n, settings);
+
+            // A secondary which is down gets nothing until it is back
+            if (heartbeats.m_interval.count() > 0)
+            {
+                n.monitor = std::make_shared<NodeMonitor>(
+                    this, n, heartbeats,
+                    [sender = n.sender](bool up) { sender->set_reachable(up); });
+            }
+        }
+    }
+
+    auto reuse_port = option<bool>("reuse-port", false);
+    auto compact_interval =
+        std::chrono::milliseconds(option<int>("compact-interval-ms", COMPACT_INTERVAL_MS));
+    auto pin = option<bool>("pin-cpus", false);
+    if (m_bad_option)
+    {
+        return false;
+    }
+
+    // Create the listening ports, with --reuse-port one acceptor per I/O
+    // thread, each on the shard of its thread when sharded
+    auto launch_session = [this](tcp::socket&& socket) {
+        std::make_shared<ServerSession>(std::move(socket), this)->run();
+    };
+    std::vector<std::shared_ptr<ServerListener>> listeners;
+    for (auto i = 0; i < (reuse_port ? m_thread_number : 1); ++i)
+    {
+        listeners.push_back(std::make_shared<ServerListener>(
+            this, m_endpoint, launch_session, reuse_port ? &shard(i) : nullptr));
+    }
+
+    if (!m_is_root)
+    {
+        listeners.push_back(std::make_shared<ServerListener>(
+            this, m_replication_endpoint, [this](tcp::socket&& socket) {
+                std::make_shared<ReplicationSession>(std::move(socket), this)->run();
+            }));
+    }
+
+    // A node which cannot be reached on one of its ports is of no use
+    for (auto& l : listeners)
+    {
+        if (!l->is_open())
+        {
+            std::cerr << "Cannot listen on " << l->endpoint() << std::endl;
+            return false;
+        }
+    }
+
+    m_store.on_publish([this](size_t id, LogEntry& l) { on_publish(id, l); });
+
+    // Secondaries catch up with the logs recovered from disk
+    for (auto& n : m_nodes)
+    {
+        n.sender->run();
+        if (n.monitor)
+        {
+            n.monitor->run();
+        }
+    }
+
+    for (auto& l : listeners)
+    {
+        l->run();
+    }
+
+    // Installed snapshots are persisted by the compactor as well
+    if (m_retain_logs > 0 || m_retain_bytes > 0 || m_retain_age.count() > 0 || m_wal)
+    {
+        m_compactor = std::thread(&RServer::run_compactor, this, compact_interval);
+    }
+
+    // Run the I/O service on the requested number of threads
     m_executors.reserve(m_thread_number);
-    for (auto i = m_thread_number; i > 0; --i)
+    for (auto i = 0; i < m_thread_number; ++i)
     {
-        m_executors.emplace_back([this] { m_ioc->run(); });
+        auto ioc = m_shards[i % m_shards.size()];
+        m_executors.emplace_back([ioc] { ioc->run(); });
+        if (pin)
+        {
+            pin_to_cpu(m_executors.back(), i);
+        }
     }
 
     return true;
 }
 
+RServer::Admission
+RServer::admit_write(size_t bytes)
+{
+    // Taken first and given back if over, racing writers never overshoot
+    auto writes = m_pending_writes.fetch_add(1) + 1;
+    auto total = m_pending_bytes.fetch_add(bytes) + bytes;
+    auto result = admitted;
+    if (m_max_pending_writes > 0 && writes > m_max_pending_writes)
+    {
+        result = too_many_writes;
+        m_metrics.m_throttled_writes.add();
+    }
+    // One write larger than the budget still goes through alone
+    else if (m_max_pending_bytes > 0 && total > m_max_pending_bytes && writes > 1)
+    {
+        result = too_many_bytes;
+        m_metrics.m_throttled_bytes.add();
+    }
+
+    if (result != admitted)
+    {
+        release_write(bytes);
+    }
+    return result;
+}
+
+void
+RServer::release_write(size_t bytes)
+{
+    m_pending_writes.fetch_sub(1);
+    m_pending_bytes.fetch_sub(bytes);
+}
+
+bool
+RServer::accept_leader(uint64_t term, uint64_t epoch)
+{
+    auto seen = m_leader_term.load();
+    while (term > seen && !m_leader_term.compare_exchange_weak(seen, term))
+    {
+    }
+
+    if (term < seen)
+    {
+        return false;
+    }
+
+    if (m_leader_epoch.exchange(epoch) != epoch && logger::enabled(logger::info))
+    {
+        logger::Line(logger::info) << "Replicating from master term " << term << " epoch "
+                                   << epoch;
+    }
+    return true;
+}
+
+batch_frame::Status
+RServer::add_replicated(const batch_frame::Append& frame,
+                        std::function<void(bool durable)> on_durable,
+                        uint64_t& missing)
+{
+    std::lock_guard<std::mutex> g(m_replicate_lock);
+
+    // Master has acks for logs this node lost, e.g. restarted without its data
+    auto next = m_store.end();
+    if (frame.m_acked > next)
+    {
+        missing = next;
+        return batch_frame::gap;
+    }
+
+    if (frame.m_entries.empty())
+    {
+        on_durable(true);
+        return batch_frame::ok;
+    }
+
+    // Logs past the store limit wait for the local compaction,
+    // master sends them again
+    uint64_t last = 0;
+    auto limit = std::min<uint64_t>(next + m_reorder->window(), m_store.limit());
+    for (auto& e : frame.m_entries)
+    {
+        if (e.m_id >= limit)
+        {
+            return batch_frame::unavailable;
+        }
+        last = std::max(last, e.m_id);
+    }
+
+    // Master sends logs again after a failure, skip what is here already
+    size_t added = 0;
+    for (auto& e : frame.m_entries)
+    {
+        if (e.m_id >= next && !m_reorder->has(e.m_id))
+        {
+            m_reorder->put(e.m_id, m_store.copy(e.m_id, e.m_log));
+            ++added;
+        }
+    }
+    m_metrics.m_replicated_logs.add(added);
+
+    // Records are synced in order, the last log covers the whole frame.
+    // Logs applied already may still be on their way to disk.
+    if (last < next)
+    {
+        wait_durable(last, std::move(on_durable));
+    }
+    else
+    {
+        m_reorder->wait(last, std::move(on_durable));
+    }
+
+    apply_reordered();
+    return batch_frame::ok;
+}
+
+void
+RServer::install_snapshot(uint64_t index)
+{
+    std::lock_guard<std::mutex> g(m_replicate_lock);
+
+    auto next = m_store.end();
+    if (index <= next)
+    {
+        return;
+    }
+
+    // Buffered logs below the index are covered by the snapshot,
+    // so are the frames waiting for them
+    std::vector<ReorderBuffer::durable_handler> covered;
+    for (auto id = next; id < std::min<size_t>(index, next + m_reorder->window()); ++id)
+    {
+        if (m_reorder->has(id))
+        {
+            auto slot = m_reorder->take(id);
+            if (slot.m_on_durable)
+            {
+                covered.push_back(std::move(slot.m_on_durable));
+            }
+        }
+    }
+
+    if (logger::enabled(logger::info))
+    {
+        logger::Line(logger::info) << "Installing snapshot at " << index << ", dropping logs "
+                                   << first_log() << " to " << next;
+    }
+
+    m_store.skip_to(index);
+    m_first_log = index;
+    m_index_waiters.applied(index);
+
+    // Nothing is kept below, the compactor deletes the segments
+    {
+        std::lock_guard<std::mutex> cg(m_compact_lock);
+        m_retained_bytes = 0;
+        m_compact_wake = true;
+    }
+    m_compact_cv.notify_one();
+
+    apply_reordered();
+    advance_durable(index);
+    for (auto& on_durable : covered)
+    {
+        on_durable(true);
+    }
+}
+
+void
+RServer::wait_durable(uint64_t id, ReorderBuffer::durable_handler on_durable)
+{
+    {
+        std::lock_guard<std::mutex> g(m_durable_lock);
+        if (m_wal && id >= m_durable_end)
+        {
+            m_durable_waiters.emplace(id, std::move(on_durable));
+            return;
+        }
+    }
+    on_durable(true);
+}
+
+void
+RServer::advance_durable(uint64_t end)
+{
+    std::vector<ReorderBuffer::durable_handler> ready;
+    {
+        std::lock_guard<std::mutex> g(m_durable_lock);
+        m_durable_end = std::max(m_durable_end, end);
+        auto last = m_durable_waiters.lower_bound(m_durable_end);
+        for (auto it = m_durable_waiters.begin(); it != last; ++it)
+        {
+            ready.push_back(std::move(it->second));
+        }
+        m_durable_waiters.erase(m_durable_waiters.begin(), last);
+    }
+
+    for (auto& on_durable : ready)
+    {
+        on_durable(true);
+    }
+}
+
+void
+RServer::apply_reordered()
+{
+    // Apply the logs which have no gap before them now
+    auto next = m_store.end();
+    size_t count = 0;
+    while (m_reorder->has(next + count))
+    {
+        ++count;
+    }
+
+    // add_replicated only buffers logs below the store limit
+    size_t first = next;
+    if (count == 0 || !m_store.reserve(count, first))
+    {
+        return;
+    }
+
+    for (auto id = first; id < first + count; ++id)
+    {
+        auto slot = m_reorder->take(id);
+        auto& l = m_store.at(id);
+        l.m_data = slot.m_log;
+        if (slot.m_on_durable)
+        {
+            l.m_on_ack = [on_durable = std::move(slot.m_on_durable)](size_t, bool durable) {
+                on_durable(durable);
+            };
+        }
+        m_store.commit(id);
+    }
+}
+
+size_t
+RServer::log_count()
+{
+    return m_store.published();
+}
+
+size_t
+RServer::render_logs(size_t from, size_t count, std::string& out)
+{
+    size_t rendered = 0;
+    if (from < first_log())
+    {
+        return 0;
+    }
+
+    // Sealed segments never change.
+    // Replication state is not persisted, only the local copy is known.
+    auto segments = sealed();
+    for (auto& segment : *segments)
+    {
+        if (rendered == count)
+        {
+            return rendered;
+        }
+        segment->visit(from + rendered, [&](const segment_format::Record& r) {
+            append_line(out, m_is_root, r.m_log, 1, r.m_expected_wc);
+            return ++rendered < count;
+        });
+    }
+
+    if (rendered == count)
+    {
+        return rendered;
+    }
+
+    // Published logs never move, no lock needed. Stops where compaction
+    // overtook the reader.
+    m_store.visit(from + rendered, [&](size_t id, const LogEntry& l) {
+        if (id != from + rendered)
+        {
+            return false;
+        }
+        append_line(out, m_is_root, l.m_data, l.m_actual_wc.load(std::memory_order_relaxed),
+                    l.m_expected_wc);
+        return ++rendered < count;
+    });
+    return rendered;
+}
+
+std::string
+RServer::memory_stats()
+{
+    auto arena = m_store.arena_stats();
+    auto logs = m_store.published() - std::min(m_store.first(), m_store.published());
+
+    // What the same logs would take as one heap std::string each:
+    // the string object plus a malloc'ed buffer for payloads over SSO size.
+    // Assumes 16 bytes malloc granularity and 8 bytes of malloc overhead.
+    auto string_bytes = logs * sizeof(std::string);
+    if (arena.m_payloads > 0)
+    {
+        auto average = arena.m_payload_bytes / arena.m_payloads;
+        if (average > 15)
+        {
+            string_bytes += arena.m_payloads * ((average + 1 + 8 + 15) / 16 * 16);
+        }
+    }
+
+    std::ostringstream out;
+    out << "{\"logs\": " << logs << ", \"first_log\": " << first_log()
+        << ", \"entry_bytes\": " << m_store.chunk_bytes()
+        << ", \"arena_blocks\": " << arena.m_blocks
+        << ", \"arena_reserved_bytes\": " << arena.m_reserved_bytes
+        << ", \"payload_bytes\": " << arena.m_payload_bytes
+        << ", \"string_layout_estimate_bytes\": " << string_bytes << "}\n";
+    return out.str();
+}
+
+std::string
+RServer::health()
+{
+    std::ostringstream out;
+    if (!m_is_root)
+    {
+        out << "{\"role\": \"secondary\", \"leader_term\": " << m_leader_term.load()
+            << ", \"logs\": " << log_count() << "}\n";
+        return out.str();
+    }
+
+    out << "{\"role\": \"master\", \"term\": " << m_term << ", \"healthy\": " << healthy_nodes()
+        << ", \"nodes\": [";
+    for (size_t i = 0; i < m_nodes.size(); ++i)
+    {
+        auto& n = m_nodes[i];
+        out << (i > 0 ? ", " : "") << "{\"node\": \"" << n.ip << ":" << n.port << "\"";
+        if (n.monitor)
+        {
+            auto s = n.monitor->status();
+            out << ", \"up\": " << (s.m_up ? "true" : "false") << ", \"phi\": " << s.m_phi
+                << ", \"rtt_ms\": " << s.m_rtt.count() / 1000.0
+                << ", \"heartbeat_timeout_ms\": " << s.m_timeout.count()
+                << ", \"since_heartbeat_ms\": " << s.m_since_heartbeat.count();
+        }
+        else
+        {
+            out << ", \"up\": true";
+        }
+        out << ", \"replication_timeout_ms\": "
+            << n.sender->metrics().m_timeout_ms.load(std::memory_order_relaxed) << "}";
+    }
+    out << "]}\n";
+    return out.str();
+}
+
+std::string
+RServer::render_metrics()
+{
+    metrics::Writer w;
+
+    w.family("replico_http_request_duration_seconds", "histogram",
+             "Time from reading an HTTP request to writing the response.");
+    w.histogram("replico_http_request_duration_seconds", "path=\"/addlog\"",
+                m_metrics.m_request_addlog);
+    w.histogram("replico_http_request_duration_seconds", "path=\"/getlog\"",
+                m_metrics.m_request_getlog);
+    w.histogram("replico_http_request_duration_seconds", "path=\"other\"",
+                m_metrics.m_request_other);
+
+    w.family("replico_http_bad_requests_total", "counter", "Requests answered with 400.");
+    w.sample("replico_http_bad_requests_total", "", m_metrics.m_bad_requests.value());
+
+    if (m_is_root)
+    {
+        w.family("replico_ack_lag_seconds", "histogram",
+                 "Time from adding a log to reaching its write concern or the timeout.");
+        w.histogram("replico_ack_lag_seconds", "", m_metrics.m_ack_lag);
+
+        w.family("replico_partial_acks_total", "counter",
+                 "Writes answered before reaching the write concern.");
+        w.sample("replico_partial_acks_total", "", m_metrics.m_partial_acks.value());
+
+        w.family("replico_throttled_writes_total", "counter",
+                 "Writes refused by admission control, by the limit they hit.");
+        w.sample("replico_throttled_writes_total", "reason=\"pending_writes\"",
+                 m_metrics.m_throttled_writes.value());
+        w.sample("replico_throttled_writes_total", "reason=\"pending_bytes\"",
+                 m_metrics.m_throttled_bytes.value());
+        w.sample("replico_throttled_writes_total", "reason=\"unreachable_wc\"",
+                 m_metrics.m_unreachable_wc.value());
+
+        w.family("replico_pending_writes", "gauge", "Writes waiting for their write concern.");
+        w.sample("replico_pending_writes", "", pending_writes());
+
+        w.family("replico_pending_write_bytes", "gauge",
+                 "Payload bytes of the writes waiting for their write concern.");
+        w.sample("replico_pending_write_bytes", "", pending_bytes());
+
+        auto label = [](const RNode& n) { return "node=\"" + n.ip + ":" + n.port + "\""; };
+
+        w.family("replico_replication_round_trip_seconds", "histogram",
+                 "Time from writing a batch to a secondary to receiving its ack.");
+        for (auto& n : m_nodes)
+        {
+            w.histogram("replico_replication_round_trip_seconds", label(n),
+                        n.sender->metrics().m_round_trip);
+        }
+
+        w.family("replico_replication_timeout_seconds", "gauge",
+                 "Current I/O timeout of the replication to a secondary, from its round trips.");
+        for (auto& n : m_nodes)
+        {
+            w.sample("replico_replication_timeout_seconds", label(n),
+                     n.sender->metrics().m_timeout_ms.load(std::memory_order_relaxed) / 1e3);
+        }
+
+        w.family("replico_node_up", "gauge",
+                 "1 while the heartbeats of a secondary come in, 0 once it is suspected down.");
+        for (auto& n : m_nodes)
+        {
+            w.sample("replico_node_up", label(n), !n.monitor || n.monitor->up() ? 1 : 0);
+        }
+
+        w.family("replico_node_phi", "gauge",
+                 "Suspicion level of the phi accrual failure detector for a secondary.");
+        for (auto& n : m_nodes)
+        {
+            if (n.monitor)
+            {
+                w.sample("replico_node_phi", label(n), n.monitor->status().m_phi);
+            }
+        }
+
+        w.family("replico_heartbeat_round_trip_seconds", "histogram",
+                 "Time from writing a heartbeat to a secondary to receiving its ack.");
+        for (auto& n : m_nodes)
+        {
+            if (n.monitor)
+            {
+                w.histogram("replico_heartbeat_round_trip_seconds", label(n),
+                            n.monitor->round_trip());
+            }
+        }
+
+        w.family("replico_replication_queued_batches", "gauge",
+                 "Batches cut for a secondary, waiting to be written or for their ack.");
+        for (auto& n : m_nodes)
+        {
+            w.sample("replico_replication_queued_batches", label(n),
+                     n.sender->metrics().m_queued_batches.load(std::memory_order_relaxed));
+        }
+
+        w.family("replico_replication_cursor", "gauge",
+                 "Id below which a secondary acknowledged every log.");
+        for (auto& n : m_nodes)
+        {
+            w.sample("replico_replication_cursor", label(n),
+                     n.sender->metrics().m_cursor.load(std::memory_order_relaxed));
+        }
+
+        w.family("replico_replication_lag_logs", "gauge",
+                 "Logs of master not yet acknowledged by a secondary.");
+        auto count = log_count();
+        for (auto& n : m_nodes)
+        {
+            auto cursor = n.sender->metrics().m_cursor.load(std::memory_order_relaxed);
+            w.sample("replico_replication_lag_logs", label(n), count - std::min(cursor, count));
+        }
+
+        w.family("replico_replication_batches_total", "counter", "Batches answered by a secondary.");
+        for (auto& n : m_nodes)
+        {
+            auto& m = n.sender->metrics();
+            w.sample("replico_replication_batches_total", label(n) + ",status=\"ok\"",
+                     m.m_acked_batches.value());
+            w.sample("replico_replication_batches_total", label(n) + ",status=\"rejected\"",
+                     m.m_rejected_batches.value());
+        }
+
+        w.family("replico_replication_logs_total", "counter",
+                 "Logs acknowledged by a secondary and logs sent to it again.");
+        for (auto& n : m_nodes)
+        {
+            auto& m = n.sender->metrics();
+            w.sample("replico_replication_logs_total", label(n) + ",status=\"acked\"",
+                     m.m_acked_logs.value());
+            w.sample("replico_replication_logs_total", label(n) + ",status=\"resent\"",
+                     m.m_resent_logs.value());
+        }
+
+        w.family("replico_replication_retries_total", "counter",
+                 "Failed connections or batches to a secondary followed by a retry.");
+        for (auto& n : m_nodes)
+        {
+            w.sample("replico_replication_retries_total", label(n),
+                     n.sender->metrics().m_retries.value());
+        }
+
+        w.family("replico_replication_snapshots_total", "counter",
+                 "Snapshots a secondary installed in place of compacted logs.");
+        for (auto& n : m_nodes)
+        {
+            w.sample("replico_replication_snapshots_total", label(n),
+                     n.sender->metrics().m_snapshots.value());
+        }
+
+        w.family("replico_replication_bytes_total", "counter",
+                 "Batch bytes written to a secondary before (raw) and after (wire) compression.");
+        for (auto& n : m_nodes)
+        {
+            auto& m = n.sender->metrics();
+            w.sample("replico_replication_bytes_total", label(n) + ",stage=\"raw\"",
+                     m.m_raw_bytes.value());
+            w.sample("replico_replication_bytes_total", label(n) + ",stage=\"wire\"",
+                     m.m_wire_bytes.value());
+        }
+
+        w.family("replico_replication_zero_copy_bytes_total", "counter",
+                 "Log bytes written to a secondary from where master stores them, not copied.");
+        for (auto& n : m_nodes)
+        {
+            w.sample("replico_replication_zero_copy_bytes_total", label(n),
+                     n.sender->metrics().m_zero_copy_bytes.value());
+        }
+
+        w.family("replico_replication_compressed_batches_total", "counter",
+                 "Batches sent to a secondary compressed.");
+        for (auto& n : m_nodes)
+        {
+            w.sample("replico_replication_compressed_batches_total", label(n),
+                     n.sender->metrics().m_compressed_batches.value());
+        }
+
+        w.family("replico_replication_compress_seconds_total", "counter",
+                 "Time spent compressing batches for a secondary.");
+        for (auto& n : m_nodes)
+        {
+            w.sample("replico_replication_compress_seconds_total", label(n),
+                     n.sender->metrics().m_compress_ns.value() / 1e9);
+        }
+    }
+    else
+    {
+        w.family("replico_replication_frames_total", "counter", "Replication frames from master.");
+        w.sample("replico_replication_frames_total", "status=\"ok\"",
+                 m_metrics.m_frames.value() - m_metrics.m_rejected_frames.value());
+        w.sample("replico_replication_frames_total", "status=\"rejected\"",
+                 m_metrics.m_rejected_frames.value());
+
+        w.family("replico_replicated_logs_total", "counter", "Logs received from master.");
+        w.sample("replico_replicated_logs_total", "", m_metrics.m_replicated_logs.value());
+
+        w.family("replico_replication_compressed_frames_total", "counter",
+                 "Compressed replication frames from master.");
+        w.sample("replico_replication_compressed_frames_total", "",
+                 m_metrics.m_compressed_frames.value());
+
+        w.family("replico_replication_decompress_seconds_total", "counter",
+                 "Time spent inflating compressed replication frames.");
+        w.sample("replico_replication_decompress_seconds_total", "",
+                 m_metrics.m_decompress_ns.value() / 1e9);
+
+        size_t buffered = 0;
+        {
+            std::lock_guard<std::mutex> g(m_replicate_lock);
+            buffered = m_reorder->size();
+        }
+        w.family("replico_reorder_buffered_logs", "gauge",
+                 "Logs received ahead of a gap, waiting for the logs before them.");
+        w.sample("replico_reorder_buffered_logs", "", buffered);
+    }
+
+    w.family("replico_log_lines_dropped_total", "counter",
+             "Diagnostic lines lost because the logging thread's ring was full.");
+    w.sample("replico_log_lines_dropped_total", "", logger::dropped());
+
+    w.family("replico_logs", "gauge", "Logs stored, including the sealed segments.");
+    w.sample("replico_logs", "", log_count());
+
+    w.family("replico_log_payload_bytes", "gauge", "Bytes of log payloads held in memory.");
+    w.sample("replico_log_payload_bytes", "", m_store.arena_stats().m_payload_bytes);
+
+    w.family("replico_log_first_id", "gauge", "First log kept, the ones below were compacted.");
+    w.sample("replico_log_first_id", "", first_log());
+
+    return std::move(w.str());
+}
+
+metrics::Histogram&
+RServer::request_histogram(beast::string_view target)
+{
+    auto prefix = target.substr(0, target.find('?'));
+    if (prefix == "/addlog")
+    {
+        return m_metrics.m_request_addlog;
+    }
+    if (prefix == "/getlog")
+    {
+        return m_metrics.m_request_getlog;
+    }
+    return m_metrics.m_request_other;
+}
+
+void
+RServer::on_publish(size_t id, LogEntry& l)
+{
+    if (m_retain_bytes > 0)
+    {
+        m_retained_bytes.fetch_add(l.m_data.size(), std::memory_order_relaxed);
+    }
+
+    // The log is visible already, readers waiting for it may go
+    m_index_waiters.applied(id + 1);
+
+    if (m_is_root)
+    {
+        if (m_wal)
+        {
+            m_wal->append(id, static_cast<uint32_t>(l.m_expected_wc), l.m_data,
+                          [this, id](bool durable) {
+                              if (durable)
+                              {
+                                  update_wc(id);
+                              }
+                              else
+                              {
+                                  fail_write(id);
+                              }
+                          });
+        }
+
+        // Every secondary gets every log, the senders read them from the store
+        for (auto& n : m_nodes)
+        {
+            n.sender->notify(l.m_data.size());
+        }
+        return;
+    }
+
+    if (logger::enabled(logger::info))
+    {
+        logger::Line(logger::info) << "Added log: " << l.m_data;
+    }
+
+    // The waiter of a secondary batch is called once it is durable
+    auto on_durable = l.m_on_ack ? take_ack(l) : nullptr;
+    if (m_wal)
+    {
+        m_wal->append(id, 0, l.m_data,
+                      on_durable ? [on_durable](bool durable) { on_durable(0, durable); }
+                                 : WriteAheadLog::durable_handler());
+    }
+    else if (on_durable)
+    {
+        on_durable(0, true);
+    }
+}
+
+void
+RServer::run_compactor(std::chrono::milliseconds interval)
+{
+    std::unique_lock<std::mutex> g(m_compact_lock);
+    while (!m_compact_stop)
+    {
+        m_compact_cv.wait_for(g, interval, [this] { return m_compact_stop || m_compact_wake; });
+        m_compact_wake = false;
+        if (!m_compact_stop)
+        {
+            compact();
+        }
+    }
+}
+
+void
+RServer::compact()
+{
+    auto end = log_count();
+    auto now = std::chrono::steady_clock::now();
+
+    // Whatever a snapshot install dropped goes from disk as well
+    size_t below = first_log();
+
+    if (m_retain_logs > 0 && end > m_retain_logs)
+    {
+        below = std::max(below, end - m_retain_logs);
+    }
+
+    if (m_retain_bytes > 0 && m_retained_bytes.load() > m_retain_bytes)
+    {
+        auto excess = m_retained_bytes.load() - m_retain_bytes;
+        size_t dropped = 0;
+        visit_logs(below, [&](size_t id, boost::string_view log) {
+            if (dropped >= excess || id >= end)
+            {
+                return false;
+            }
+            dropped += log.size();
+            below = id + 1;
+            return true;
+        });
+    }
+
+    // The logs up to a sample are older than it
+    if (m_retain_age.count() > 0)
+    {
+        if (m_age_samples.empty() || m_age_samples.back().first < end)
+        {
+            m_age_samples.emplace_back(end, now);
+        }
+        while (!m_age_samples.empty() && now - m_age_samples.front().second >= m_retain_age)
+        {
+            below = std::max(below, m_age_samples.front().first);
+            m_age_samples.pop_front();
+        }
+    }
+
+    below = std::min(below, end);
+
+    // Master keeps the logs a client still waits for, with their counters
+    if (m_is_root)
+    {
+        m_store.visit(m_compacted, [&](size_t id, const LogEntry& l) {
+            if (id >= below)
+            {
+                return false;
+            }
+            if (!l.m_ack_taken.load() && l.m_actual_wc.load() < l.m_expected_wc)
+            {
+                below = id;
+                return false;
+            }
+            return true;
+        });
+    }
+
+    if (below <= m_compacted)
+    {
+        return;
+    }
+
+    auto dropped = m_retain_bytes > 0 ? payload_bytes(first_log(), below) : 0;
+
+    // Readers see the new first log before anything is freed
+    if (below > first_log())
+    {
+        m_first_log = below;
+    }
+    m_store.truncate(below);
+
+    auto segments = sealed();
+    auto kept = std::make_shared<std::vector<std::shared_ptr<SealedSegment>>>();
+    for (auto& segment : *segments)
+    {
+        if (segment->first_id() + segment->count() > below)
+        {
+            kept->push_back(segment);
+        }
+    }
+    if (kept->size() != segments->size())
+    {
+        std::atomic_store(&m_sealed,
+                          std::shared_ptr<const std::vector<std::shared_ptr<SealedSegment>>>(
+                              std::move(kept)));
+    }
+
+    auto retained = m_retained_bytes.load();
+    m_retained_bytes -= std::min(retained, dropped);
+
+    // The active segment goes in a later round, once the log moved past it
+    bool done = true;
+    if (m_wal && !m_wal->compact(below, done))
+    {
+        return;
+    }
+    if (done)
+    {
+        m_compacted = below;
+    }
+
+    if (logger::enabled(logger::debug))
+    {
+        logger::Line(logger::debug) << "Compacted logs below " << below;
+    }
+}
+
+size_t
+RServer::payload_bytes(size_t from, size_t to)
+{
+    size_t bytes = 0;
+    visit_logs(from, [&](size_t id, boost::string_view log) {
+        if (id >= to)
+        {
+            return false;
+        }
+        bytes += log.size();
+        return true;
+    });
+    return bytes;
+}
+
 bool
 RServer::stop()
 {
@@ -87,8 +1327,22 @@ RServer::stop()
 
     for (auto& t : m_executors)
     {
-        t.join();
+        if (t.joinable())
+        {
+            t.join();
+        }
+    }
+
+    if (m_compactor.joinable())
+    {
+        {
+            std::lock_guard<std::mutex> g(m_compact_lock);
+            m_compact_stop = true;
+        }
+        m_compact_cv.notify_one();
+        m_compactor.join();
     }
 
+    logger::stop();
     return true;
 }
@@ -3,6 +3,7 @@
 #include <boost/beast/core.hpp>
 #include <boost/beast/http.hpp>
 #include <boost/beast/version.hpp>
+#include <boost/asio/executor_work_guard.hpp>
 #include <boost/asio/strand.hpp>
 #include <boost/config.hpp>
 #include <algorithm>
@@ -12,10 +13,26 @@
 #include <memory>
 #include <string>
 #include <thread>
+#include <type_traits>
 #include <vector>
 #include <boost/algorithm/string.hpp>
 #include <chrono>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <boost/lexical_cast.hpp>
 #include "helpers.h"
+#include "node_pool.h"
+#include "replication_sender.h"
+#include "node_monitor.h"
+#include "fault_injector.h"
+#include "write_ahead_log.h"
+#include "log_store.h"
+#include "reorder_buffer.h"
+#include "index_waiters.h"
+#include "metrics.h"
 
 namespace beast = boost::beast;    // from <boost/beast.hpp>
 namespace net = boost::asio;       // from <boost/asio.hpp>
@@ -27,99 +44,531 @@ class RServer;
 // Aux structure to be used by main (master) to store data about secondaries
 struct RNode
 {
+    RNode(std::string ip, std::string port, std::string replication_port)
+        : ip(std::move(ip))
+        , port(std::move(port))
+        , replication_port(std::move(replication_port))
+    {
+    }
+
     std::string ip;
     std::string port;
+
+    // Replication port of the secondary
+    std::string replication_port;
+
+    // Keep-alive connections to the secondary.
+    // Endpoints are resolved once at RServer::start
+    std::shared_ptr<NodePool> pool;
+
+    // Batches and pipelines logs to the secondary
+    std::shared_ptr<ReplicationSender> sender;
+
+    // Heartbeats, null with --heartbeat-ms=0
+    std::shared_ptr<NodeMonitor> monitor;
 };
 
-struct LogEntry
+// Exported by /metrics along with the ReplicationSender metrics
+struct ServerMetrics
 {
-    LogEntry(std::string data, size_t expected_wc)
-        : m_data(std::move(data))
-        , m_expected_wc(expected_wc)
-        , m_actual_wc(1)
-    {
-    }
-
-    LogEntry(std::string data)
-        : m_data(std::move(data))
-        , m_expected_wc(0)
-        , m_actual_wc(0)
-    {
-    }
+    // From reading an HTTP request to writing the whole response
+    metrics::Histogram m_request_addlog;
+    metrics::Histogram m_request_getlog;
+    metrics::Histogram m_request_other;
+    metrics::Counter m_bad_requests;
 
-    // The log message itself
-    std::string m_data;
+    // Master - /addlog until its write concern is reached or the timeout
+    metrics::Histogram m_ack_lag;
+    metrics::Counter m_partial_acks;
 
-    // Expected write concern
-    size_t m_expected_wc;
+    // Master - /addlog refused: too many writes or bytes waiting for their
+    // write concern, or wc counts on secondaries which are down
+    metrics::Counter m_throttled_writes;
+    metrics::Counter m_throttled_bytes;
+    metrics::Counter m_unreachable_wc;
 
-    // Number of successful posts to secondaries
-    size_t m_actual_wc;
+    // Secondary - replication frames from master
+    metrics::Counter m_frames;
+    metrics::Counter m_rejected_frames;
+    metrics::Counter m_replicated_logs;
+    metrics::Counter m_compressed_frames;
+    metrics::Counter m_decompress_ns;
 };
 
 // One node from cluster.
 // Can be master or secondary.
 // Communication between user and secondary: http
-// Communication between main and secondary nodes: http
+// Communication between main and secondary nodes: batch_frame over
+// a dedicated replication port
 class RServer
 {
 public:
     bool start(int argc, char* argv[]);
     bool stop();
 
+    // Makes the I/O threads return, stop() joins them.
+    // A server runs until the process exits otherwise.
+    void
+    shutdown()
+    {
+        for (auto& shard : m_shards)
+        {
+            shard->stop();
+        }
+    }
+
     ~RServer()
     {
         stop();
     }
 
+    // Called once the log reaches its expected write concern,
+    // or with durable false if master could not persist it
+    typedef std::function<void(size_t actual_wc, bool durable)> ack_handler;
+
     bool m_is_root = false;
     int m_thread_number = 1;
 
+    // Default time /addlog waits for the write concern, 0 - no limit
+    std::chrono::milliseconds m_wc_timeout{0};
+
+    // Master. Writes waiting for their write concern and their payload
+    // bytes, more are refused. Zero means no limit.
+    size_t m_max_pending_writes = 0;
+    size_t m_max_pending_bytes = 0;
+
+    // Default time /getlog?min_index waits for the index, 0 - redirect
+    // (secondary) or refuse (master) at once
+    std::chrono::milliseconds m_min_index_wait{1000};
+
+    // /admin/* from other hosts than this one must carry it in the pwd
+    // header; empty - loopback only
+    std::string m_admin_token;
+
     std::shared_ptr<net::io_context> m_ioc;
     std::vector<std::thread> m_executors;
 
+    // I/O contexts. One shared by all threads, or with --shards one per
+    // thread so a connection and its handlers stay on one core; m_ioc is
+    // the first of them.
+    std::vector<std::shared_ptr<net::io_context>> m_shards;
+    std::atomic<size_t> m_next_shard{0};
+    std::vector<net::executor_work_guard<net::io_context::executor_type>> m_shard_work;
+
+    net::io_context&
+    shard(size_t index)
+    {
+        return *m_shards[index % m_shards.size()];
+    }
+
+    // Shard for a new connection, in turn
+    net::io_context&
+    next_shard()
+    {
+        return shard(m_next_shard.fetch_add(1, std::memory_order_relaxed));
+    }
+
     // Endpoint of this object
     tcp::endpoint m_endpoint;
 
     // For secondary - master's endpoint
     tcp::endpoint m_root_endpoint;
 
+    // For secondary - where master connects to replicate logs
+    tcp::endpoint m_replication_endpoint;
+
+    // For master - term (raised by hand when another node takes over)
+    // and incarnation of this master, sent with every batch
+    uint64_t m_term = 1;
+    uint64_t m_epoch = 0;
+
+    // For secondary - highest term seen and the epoch of its master
+    std::atomic<uint64_t> m_leader_term{0};
+    std::atomic<uint64_t> m_leader_epoch{0};
+
     // For master - secondaries
     std::vector<RNode> m_nodes;
 
-    void
-    add_log(std::string log)
+    // On-disk log, null when running without --data-dir
+    std::unique_ptr<WriteAheadLog> m_wal;
+
+    // Injected latency and failures, see --fault and /admin/fault
+    FaultInjector m_faults;
+
+    // batch_frame::Codec bits. Master compresses batches with them,
+    // a secondary accepts compressed frames.
+    uint8_t m_codecs = batch_frame::no_codec;
+
+    // Optional "--name=value" settings following the positional arguments
+    std::map<std::string, std::string> m_options;
+
+    // A value which does not parse as T is reported, def is returned and
+    // m_bad_option set; start() fails before anything is started
+    template <class T>
+    T
+    option(const std::string& name, T def)
     {
-        std::lock_guard<std::mutex> g(m_log_lock);
-        std::cout << "Added log: " << log << std::endl;
-        m_logs.emplace_back(std::move(log));
+        auto it = m_options.find(name);
+        if (it == m_options.end())
+        {
+            return def;
+        }
+
+        // lexical_cast wraps "-1" around for unsigned types
+        T value;
+        if ((std::is_unsigned<T>::value && it->second.find('-') != std::string::npos) ||
+            !boost::conversion::try_lexical_convert(it->second, value))
+        {
+            std::cerr << "bad value for --" << name << ": " << it->second << std::endl;
+            m_bad_option = true;
+            return def;
+        }
+        return value;
     }
 
-    size_t
-    add_log(std::string log, size_t wc)
+    // Set by option() on a value it could not parse
+    bool m_bad_option = false;
+
+    // Secondary. Adds the logs of a replication frame; logs which arrive
+    // ahead of the local log wait in m_reorder, the ones stored already are
+    // skipped. on_durable is called once all the logs of the frame are
+    // persisted, right away when running without the write-ahead log, with
+    // false if the write-ahead log failed to store them.
+    // Returns gap and the id of the first missing log if master counts
+    // on logs this node does not have, unavailable if the frame does not
+    // fit into the reorder window.
+    batch_frame::Status add_replicated(const batch_frame::Append& frame,
+                                       std::function<void(bool durable)> on_durable,
+                                       uint64_t& missing);
+
+    // Secondary. Master compacted the logs below index away: drops the
+    // local ones and continues the log at index. No-op if the logs are here.
+    void install_snapshot(uint64_t index);
+
+    // Returns false if the store is full: the oldest logs must be
+    // compacted before more fit, see --retain-*
+    bool
+    add_log(boost::string_view log, size_t wc, size_t& id, ack_handler on_ack = nullptr)
     {
-        std::lock_guard<std::mutex> g(m_log_lock);
-        auto size = m_logs.size();
-        m_logs.emplace_back(std::move(log), wc);
-        return size;
+        if (!m_store.reserve(1, id))
+        {
+            return false;
+        }
+
+        auto& l = m_store.at(id);
+        l.m_data = m_store.copy(id, log);
+        l.m_crc = segment_format::checksum(log.data(), log.size());
+        l.m_expected_wc = wc;
+
+        // Nobody waits, compaction need not wait either
+        if (!on_ack)
+        {
+            l.m_ack_taken.store(true, std::memory_order_relaxed);
+        }
+
+        // Master's own copy counts toward wc once it is durable
+        size_t actual = m_wal ? 0 : 1;
+        l.m_actual_wc.store(actual, std::memory_order_relaxed);
+
+        if (on_ack && actual >= wc)
+        {
+            // Nothing to wait for
+            m_store.commit(id);
+            on_ack(actual, true);
+            return true;
+        }
+
+        l.m_on_ack = std::move(on_ack);
+        m_store.commit(id);
+        return true;
     }
 
     // Update write concern
     // If request was successful - update wc for each log
+    // and notify the waiter once the expected wc is reached
     void
     update_wc(size_t id)
     {
-        std::lock_guard<std::mutex> g(m_log_lock);
-        ++m_logs[id].m_actual_wc;
+        // The entry may be compacted away meanwhile, a sealed or compacted
+        // log has nobody waiting
+        LogStore::ReadGuard guard(m_store);
+        auto l = m_store.find(id);
+        if (!l)
+        {
+            return;
+        }
+
+        auto actual = l->m_actual_wc.fetch_add(1) + 1;
+        if (actual == l->m_expected_wc)
+        {
+            auto on_ack = take_ack(*l);
+            if (on_ack)
+            {
+                on_ack(actual, true);
+            }
+        }
+    }
+
+    // The write-ahead log of master could not store the log,
+    // its waiter is refused
+    void
+    fail_write(size_t id)
+    {
+        LogStore::ReadGuard guard(m_store);
+        auto l = m_store.find(id);
+        if (!l)
+        {
+            return;
+        }
+
+        auto on_ack = take_ack(*l);
+        if (on_ack)
+        {
+            on_ack(l->m_actual_wc.load(), false);
+        }
     }
 
-    std::vector<LogEntry>
-    get_logs()
+    // Forget the waiter of the log (e.g. it timed out).
+    // Returns the current write concern of the log.
+    size_t
+    cancel_ack(size_t id)
     {
-        std::lock_guard<std::mutex> g(m_log_lock);
-        return m_logs;
+        LogStore::ReadGuard guard(m_store);
+        auto l = m_store.find(id);
+        if (!l)
+        {
+            return 0;
+        }
+
+        take_ack(*l);
+        return l->m_actual_wc.load();
     }
 
-    std::mutex m_log_lock;
-    std::vector<LogEntry> m_logs;
+    // Only the first caller gets the waiter
+    static ack_handler
+    take_ack(LogEntry& l)
+    {
+        if (l.m_ack_taken.exchange(true))
+        {
+            return nullptr;
+        }
+        return std::move(l.m_on_ack);
+    }
+
+    // Secondary. Returns false if the batch comes from a master
+    // of an older term than already seen.
+    bool accept_leader(uint64_t term, uint64_t epoch);
+
+    // Number of logs including the sealed ones
+    size_t log_count();
+
+    enum Admission
+    {
+        admitted,
+        too_many_writes,
+        too_many_bytes
+    };
+
+    // Master. Takes room for a write of bytes which is going to wait for
+    // its write concern, release_write gives it back. Thread safe.
+    Admission admit_write(size_t bytes);
+    void release_write(size_t bytes);
+
+    size_t
+    pending_writes() const
+    {
+        return m_pending_writes.load(std::memory_order_relaxed);
+    }
+
+    size_t
+    pending_bytes() const
+    {
+        return m_pending_bytes.load(std::memory_order_relaxed);
+    }
+
+    // Master. Secondaries the heartbeats do not report down.
+    size_t
+    healthy_nodes() const
+    {
+        return std::count_if(m_nodes.begin(), m_nodes.end(),
+                             [](const RNode& n) { return !n.monitor || n.monitor->up(); });
+    }
+
+    // State of the secondaries (master) or of this node as JSON, see /health
+    std::string health();
+
+    // Calls fn once the log with the index is applied, right away from this
+    // thread if it is. Returns a ticket for cancel_wait.
+    uint64_t
+    wait_for_log(size_t index, IndexWaiters::handler fn)
+    {
+        auto ticket = m_index_waiters.wait(index, std::move(fn));
+        m_index_waiters.applied(log_count());
+        return ticket;
+    }
+
+    void
+    cancel_wait(size_t index, uint64_t ticket)
+    {
+        m_index_waiters.cancel(index, ticket);
+    }
+
+    // Logs below were compacted away
+    size_t
+    first_log() const
+    {
+        return m_first_log.load();
+    }
+
+    // Segments sealed before restart which were not compacted yet
+    std::shared_ptr<const std::vector<std::shared_ptr<SealedSegment>>>
+    sealed() const
+    {
+        return std::atomic_load(&m_sealed);
+    }
+
+    // Calls fn(id, log) for the logs starting from id "from",
+    // sealed ones included, until fn returns false. Compaction running
+    // meanwhile may make the ids jump.
+    template <class F>
+    void
+    visit_logs(size_t from, F&& fn)
+    {
+        from = std::max(from, first_log());
+        auto segments = sealed();
+        for (auto& segment : *segments)
+        {
+            bool more = true;
+            segment->visit(from, [&](const segment_format::Record& r) {
+                more = fn(from++, r.m_log);
+                return more;
+            });
+            if (!more)
+            {
+                return;
+            }
+        }
+
+        m_store.visit(from, [&](size_t id, const LogEntry& l) { return fn(id, l.m_data); });
+    }
+
+    // Master. Like visit_logs for replication: fn(id, log, crc, owner, pin)
+    // also gets the crc32 of the log and the memory it lives in. pin()
+    // returns what keeps that memory alive after the visit, so the log can
+    // be written from where it is; logs of one owner share the pin.
+    template <class F>
+    void
+    visit_payloads(size_t from, F&& fn)
+    {
+        from = std::max(from, first_log());
+        auto segments = sealed();
+        for (auto& segment : *segments)
+        {
+            bool more = true;
+            auto pin = [&segment] { return std::shared_ptr<const void>(segment); };
+            segment->visit(from, [&](const segment_format::Record& r) {
+                more = fn(from++, r.m_log, segment_format::checksum(r.m_log.data(), r.m_log.size()),
+                          static_cast<const void*>(segment.get()), pin);
+                return more;
+            });
+            if (!more)
+            {
+                return;
+            }
+        }
+
+        // Called under the ReadGuard of visit, the arena cannot go meanwhile
+        m_store.visit(from, [&](size_t id, const LogEntry& l) {
+            auto arena = m_store.arena(id);
+            return fn(id, l.m_data, l.m_crc, static_cast<const void*>(arena),
+                      [arena] { return LogStore::pin(arena); });
+        });
+    }
+
+    // Appends up to count logs starting from id "from" to out, one per line.
+    // Returns the number of rendered logs.
+    size_t render_logs(size_t from, size_t count, std::string& out);
+
+    // Memory usage of the log store as JSON
+    std::string memory_stats();
+
+    // Prometheus text exposition of m_metrics and the replication state
+    std::string render_metrics();
+
+    // Request duration histogram of the request target
+    metrics::Histogram& request_histogram(beast::string_view target);
+
+    ServerMetrics m_metrics;
+
+    // Called in id order for every new log
+    void on_publish(size_t id, LogEntry& l);
+
+    // Logs starting from m_store.base(), the older ones are in m_sealed
+    LogStore m_store;
+
+    // Segments sealed before restart, mapped read-only. Compaction swaps
+    // in a list without the segments it deleted, readers keep theirs.
+    std::shared_ptr<const std::vector<std::shared_ptr<SealedSegment>>> m_sealed =
+        std::make_shared<const std::vector<std::shared_ptr<SealedSegment>>>();
+
+    // Secondary - replication frames are added one at a time.
+    // Logs below m_store.end() are applied, m_store.published() is
+    // the contiguous watermark readers see.
+    std::mutex m_replicate_lock;
+    std::unique_ptr<ReorderBuffer> m_reorder;
+
+    // Secondary - logs below m_durable_end are synced by the write-ahead
+    // log. Frames sent again whose logs are applied but not synced yet
+    // wait here by their last id.
+    std::mutex m_durable_lock;
+    uint64_t m_durable_end = 0;
+    std::multimap<uint64_t, ReorderBuffer::durable_handler> m_durable_waiters;
+
+    // Retention, see --retain-*. Zero means no limit.
+    size_t m_retain_logs = 0;
+    size_t m_retain_bytes = 0;
+    std::chrono::seconds m_retain_age{0};
+
+private:
+    // Applies the buffered logs which follow the local log, under m_replicate_lock
+    void apply_reordered();
+
+    // Secondary. Calls on_durable once the log id is synced
+    void wait_durable(uint64_t id, ReorderBuffer::durable_handler on_durable);
+
+    // Secondary. Logs below end are synced, or covered by a snapshot
+    void advance_durable(uint64_t end);
+
+    // Compaction thread: every interval (or when woken up) drops the logs
+    // the retention does not keep, from memory and from disk
+    void run_compactor(std::chrono::milliseconds interval);
+    void compact();
+
+    // Payload bytes of the logs in [from, to)
+    size_t payload_bytes(size_t from, size_t to);
+
+    std::atomic<size_t> m_first_log{0};
+
+    // Admitted writes waiting for their write concern
+    std::atomic<size_t> m_pending_writes{0};
+    std::atomic<size_t> m_pending_bytes{0};
+
+    // Readers of /getlog?min_index, woken as logs are published
+    IndexWaiters m_index_waiters;
+
+    std::thread m_compactor;
+    std::mutex m_compact_lock;
+    std::condition_variable m_compact_cv;
+    bool m_compact_wake = false;
+    bool m_compact_stop = false;
+
+    // Payload bytes of the logs kept, counted for --retain-bytes only
+    std::atomic<size_t> m_retained_bytes{0};
+
+    // Below is touched under m_compact_lock only.
+    // Logs below were dropped and the write-ahead log compacted.
+    size_t m_compacted = 0;
+
+    // When the log reached an id, for --retain-age-s
+    std::deque<std::pair<size_t, std::chrono::steady_clock::time_point>> m_age_samples;
 };
@@ -0,0 +1,220 @@
+#include "sealed_segment.h"
+#include "helpers.h"
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace segment_format;
+
+namespace
+{
+void
+report(char const* what)
+{
+    fail(beast::error_code(errno, boost::system::generic_category()), what);
+}
+
+std::string
+index_path(const std::string& wal_path)
+{
+    return wal_path.substr(0, wal_path.size() - 4) + ".idx";
+}
+}  // namespace
+
+SealedSegment::~SealedSegment()
+{
+    if (m_data)
+    {
+        ::munmap(const_cast<char*>(m_data), m_size);
+    }
+    if (m_fd >= 0)
+    {
+        ::close(m_fd);
+    }
+}
+
+std::shared_ptr<SealedSegment>
+SealedSegment::open(const std::string& path)
+{
+    std::shared_ptr<SealedSegment> s(new SealedSegment);
+
+    s->m_fd = ::open(path.c_str(), O_RDONLY);
+    if (s->m_fd < 0)
+    {
+        report("segment open");
+        return nullptr;
+    }
+
+    struct stat st;
+    if (::fstat(s->m_fd, &st) != 0)
+    {
+        report("segment stat");
+        return nullptr;
+    }
+
+    s->m_size = static_cast<size_t>(st.st_size);
+    if (s->m_size > 0)
+    {
+        auto p = ::mmap(nullptr, s->m_size, PROT_READ, MAP_SHARED, s->m_fd, 0);
+        if (p == MAP_FAILED)
+        {
+            report("segment mmap");
+            return nullptr;
+        }
+        s->m_data = static_cast<const char*>(p);
+
+        // Reads mostly go front to back
+        ::madvise(p, s->m_size, MADV_SEQUENTIAL);
+    }
+
+    auto idx = index_path(path);
+    if (!s->load_index(idx))
+    {
+        // No index (crashed before it was written) or one which does not
+        // match the segment - scan once and keep it
+        if (!s->build_index())
+        {
+            return nullptr;
+        }
+        write_index(path, s->m_first_id, s->m_count, s->m_data_end, s->m_offsets);
+    }
+
+    return s;
+}
+
+bool
+SealedSegment::load_index(const std::string& path)
+{
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        return false;
+    }
+
+    std::string data;
+    char chunk[64 * 1024];
+    for (;;)
+    {
+        auto n = ::read(fd, chunk, sizeof(chunk));
+        if (n <= 0)
+        {
+            break;
+        }
+        data.append(chunk, static_cast<size_t>(n));
+    }
+    ::close(fd);
+
+    const size_t header = 32;
+    if (data.size() < header || get_u32(data.data()) != INDEX_MAGIC ||
+        get_u32(data.data() + 4) != INDEX_STRIDE)
+    {
+        return false;
+    }
+
+    m_first_id = get_u64(data.data() + 8);
+    m_count = get_u64(data.data() + 16);
+    m_data_end = get_u64(data.data() + 24);
+
+    auto entries = (m_count + INDEX_STRIDE - 1) / INDEX_STRIDE;
+    if (data.size() != header + entries * 8 || m_data_end > m_size)
+    {
+        return false;
+    }
+
+    m_offsets.resize(entries);
+    for (size_t i = 0; i < entries; ++i)
+    {
+        m_offsets[i] = get_u64(data.data() + header + i * 8);
+    }
+
+    // The first and the last indexed records must be where the index
+    // says, a stale index (e.g. of an earlier segment of that name) is not
+    if (entries > 0)
+    {
+        Record r;
+        for (auto i : {size_t(0), entries - 1})
+        {
+            if (parse(m_data, m_data_end, m_offsets[i], r, true) == 0 ||
+                r.m_id != m_first_id + i * INDEX_STRIDE)
+            {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+bool
+SealedSegment::build_index()
+{
+    Record r;
+    size_t offset = 0;
+    m_count = 0;
+    m_offsets.clear();
+
+    for (;;)
+    {
+        auto next = parse(m_data, m_size, offset, r, true);
+        if (next == 0)
+        {
+            break;
+        }
+
+        if (m_count == 0)
+        {
+            m_first_id = r.m_id;
+        }
+        if (m_count % INDEX_STRIDE == 0)
+        {
+            m_offsets.push_back(offset);
+        }
+
+        ++m_count;
+        offset = next;
+    }
+
+    m_data_end = offset;
+    return true;
+}
+
+bool
+SealedSegment::write_index(const std::string& wal_path,
+                           uint64_t first_id,
+                           uint64_t count,
+                           uint64_t data_end,
+                           const std::vector<uint64_t>& offsets)
+{
+    std::string data(32 + offsets.size() * 8, '\0');
+    put_u32(&data[0], INDEX_MAGIC);
+    put_u32(&data[4], INDEX_STRIDE);
+    put_u64(&data[8], first_id);
+    put_u64(&data[16], count);
+    put_u64(&data[24], data_end);
+    for (size_t i = 0; i < offsets.size(); ++i)
+    {
+        put_u64(&data[32 + i * 8], offsets[i]);
+    }
+
+    // Written under a temporary name so a crash never leaves a torn index
+    auto path = index_path(wal_path);
+    auto tmp = path + ".tmp";
+    int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        report("index create");
+        return false;
+    }
+
+    auto ok = ::write(fd, data.data(), data.size()) == static_cast<ssize_t>(data.size()) &&
+              ::fdatasync(fd) == 0;
+    ::close(fd);
+
+    if (!ok || ::rename(tmp.c_str(), path.c_str()) != 0)
+    {
+        report("index write");
+        return false;
+    }
+    return true;
+}
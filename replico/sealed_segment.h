@@ -0,0 +1,91 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+#include "segment_format.h"
+
+// Read-only memory mapped segment of the write-ahead log.
+// Records are served straight from the page cache, the sparse index
+// gives the offset of every INDEX_STRIDE-th record.
+class SealedSegment
+{
+public:
+    ~SealedSegment();
+
+    // Maps the segment. Uses its index file, or scans the segment and
+    // writes the index when there is none. Returns null on failure.
+    static std::shared_ptr<SealedSegment> open(const std::string& path);
+
+    // Stores the index of a segment which was just sealed
+    static bool write_index(const std::string& wal_path,
+                            uint64_t first_id,
+                            uint64_t count,
+                            uint64_t data_end,
+                            const std::vector<uint64_t>& offsets);
+
+    uint64_t
+    first_id() const
+    {
+        return m_first_id;
+    }
+
+    uint64_t
+    count() const
+    {
+        return m_count;
+    }
+
+    // Calls fn(const Record&) for the records starting from id
+    // until fn returns false or the segment ends
+    template <class F>
+    void
+    visit(uint64_t id, F&& fn) const
+    {
+        if (id < m_first_id || id >= m_first_id + m_count)
+        {
+            return;
+        }
+
+        auto n = id - m_first_id;
+        auto offset = m_offsets[n / segment_format::INDEX_STRIDE];
+        segment_format::Record r;
+
+        // Walk from the closest indexed record
+        for (auto skip = n % segment_format::INDEX_STRIDE; skip > 0; --skip)
+        {
+            offset = segment_format::parse(m_data, m_data_end, offset, r, false);
+            if (offset == 0)
+            {
+                return;
+            }
+        }
+
+        // A wrong index ends the walk rather than serving other records
+        for (auto expected = id; n < m_count; ++n, ++expected)
+        {
+            offset = segment_format::parse(m_data, m_data_end, offset, r, false);
+            if (offset == 0 || r.m_id != expected ||
+                !fn(static_cast<const segment_format::Record&>(r)))
+            {
+                return;
+            }
+        }
+    }
+
+private:
+    SealedSegment() = default;
+
+    bool load_index(const std::string& index_path);
+    bool build_index();
+
+    int m_fd = -1;
+    const char* m_data = nullptr;
+    size_t m_size = 0;
+    size_t m_data_end = 0;
+
+    uint64_t m_first_id = 0;
+    uint64_t m_count = 0;
+    std::vector<uint64_t> m_offsets;
+};
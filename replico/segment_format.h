@@ -0,0 +1,108 @@
+#pragma once
+
+#include <boost/crc.hpp>
+#include <boost/utility/string_view.hpp>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+
+// Layout of the write-ahead log segment files.
+//
+// Record:
+//   u32 length, u32 crc32 of the payload,
+//   payload: u64 id, u32 expected wc, length - 12 bytes of the log.
+// All integers are little-endian.
+//
+// A sealed segment "segment-<first id>.wal" gets a sparse index
+// "segment-<first id>.idx" with the offset of every INDEX_STRIDE-th record:
+//   u32 magic, u32 stride, u64 first id, u64 count, u64 data end,
+//   (count + stride - 1) / stride x u64 offset
+//
+// "snapshot" marks where the log starts after compaction, the logs below
+// are gone: u32 magic, u64 id of the first log kept, u32 crc32 of the id
+namespace segment_format
+{
+const size_t HEADER_SIZE = 8;
+const size_t META_SIZE = 12;
+const size_t INDEX_STRIDE = 64;
+const uint32_t INDEX_MAGIC = 0x78646952;  // "Ridx"
+const uint32_t SNAPSHOT_MAGIC = 0x70616e53;  // "Snap"
+
+struct Record
+{
+    uint64_t m_id;
+    uint32_t m_expected_wc;
+    boost::string_view m_log;
+};
+
+inline void
+put_u32(char* p, uint32_t v)
+{
+    for (int i = 0; i < 4; ++i) p[i] = char((v >> (8 * i)) & 0xff);
+}
+
+inline void
+put_u64(char* p, uint64_t v)
+{
+    for (int i = 0; i < 8; ++i) p[i] = char((v >> (8 * i)) & 0xff);
+}
+
+inline uint32_t
+get_u32(const char* p)
+{
+    uint32_t v = 0;
+    for (int i = 0; i < 4; ++i) v |= uint32_t(static_cast<unsigned char>(p[i])) << (8 * i);
+    return v;
+}
+
+inline uint64_t
+get_u64(const char* p)
+{
+    uint64_t v = 0;
+    for (int i = 0; i < 8; ++i) v |= uint64_t(static_cast<unsigned char>(p[i])) << (8 * i);
+    return v;
+}
+
+inline uint32_t
+checksum(const char* p, size_t size)
+{
+    boost::crc_32_type crc;
+    crc.process_bytes(p, size);
+    return crc.checksum();
+}
+
+// Reads the record at offset. Returns the offset of the next record
+// or 0 at the end of the written data (zero length or torn write).
+inline size_t
+parse(const char* data, size_t size, size_t offset, Record& r, bool verify)
+{
+    if (offset + HEADER_SIZE + META_SIZE > size)
+    {
+        return 0;
+    }
+
+    auto p = data + offset;
+    auto length = get_u32(p);
+    if (length < META_SIZE || offset + HEADER_SIZE + length > size ||
+        (verify && checksum(p + HEADER_SIZE, length) != get_u32(p + 4)))
+    {
+        return 0;
+    }
+
+    auto payload = p + HEADER_SIZE;
+    r.m_id = get_u64(payload);
+    r.m_expected_wc = get_u32(payload + 8);
+    r.m_log = boost::string_view(payload + META_SIZE, length - META_SIZE);
+    return offset + HEADER_SIZE + length;
+}
+
+// Zero padded names sort in the order of ids
+inline std::string
+file_name(uint64_t first_id, const char* extension)
+{
+    char name[64];
+    std::snprintf(name, sizeof(name), "segment-%020llu.%s",
+                  static_cast<unsigned long long>(first_id), extension);
+    return name;
+}
+}  // namespace segment_format
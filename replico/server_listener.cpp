@@ -1,15 +1,27 @@
 #include "server_listener.h"
 #include "replico_server.h"
-#include "server_session.h"
+#include <sys/socket.h>
 
-ServerListener::ServerListener(RServer* context)
-    : m_context(context)
-    , acceptor_(net::make_strand(*context->m_ioc))
+namespace
+{
+// SO_REUSEPORT, asio has no option of its own for it
+typedef net::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT> reuse_port_option;
+}  // namespace
+
+ServerListener::ServerListener(RServer* context,
+                               const tcp::endpoint& endpoint,
+                               session_launcher launch,
+                               net::io_context* shard)
+    : acceptor_(net::make_strand(shard ? *shard : *context->m_ioc))
+    , m_context(context)
+    , m_shard(shard)
+    , m_launch(std::move(launch))
+    , m_endpoint(endpoint)
 {
     beast::error_code ec;
 
     // Open the acceptor
-    acceptor_.open(context->m_endpoint.protocol(), ec);
+    acceptor_.open(endpoint.protocol(), ec);
     if (ec)
     {
         fail(ec, "open");
@@ -24,8 +36,19 @@ ServerListener::ServerListener(RServer* context)
         return;
     }
 
+    // Share the port with the other acceptors of this server
+    if (m_shard)
+    {
+        acceptor_.set_option(reuse_port_option(true), ec);
+        if (ec)
+        {
+            fail(ec, "set_option");
+            return;
+        }
+    }
+
     // Bind to the server address
-    acceptor_.bind(context->m_endpoint, ec);
+    acceptor_.bind(endpoint, ec);
     if (ec)
     {
         fail(ec, "bind");
@@ -39,6 +62,7 @@ ServerListener::ServerListener(RServer* context)
         fail(ec, "listen");
         return;
     }
+    m_open = true;
 }
 
 void
@@ -46,7 +70,7 @@ ServerListener::do_accept()
 {
     // The new connection gets its own strand
     acceptor_.async_accept(
-        net::make_strand(*m_context->m_ioc),
+        net::make_strand(m_shard ? *m_shard : m_context->next_shard()),
         beast::bind_front_handler(&ServerListener::on_accept, shared_from_this()));
 }
 
@@ -59,8 +83,8 @@ ServerListener::on_accept(beast::error_code ec, tcp::socket socket)
     }
     else
     {
-        // Create the ServerSession and run it
-        std::make_shared<ServerSession>(std::move(socket), m_context)->run();
+        // Create the session and run it
+        m_launch(std::move(socket));
     }
 
     // Accept another connection
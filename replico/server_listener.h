@@ -2,21 +2,54 @@
 
 #include <boost/beast/core.hpp>
 #include <boost/asio/strand.hpp>
+#include <functional>
 
 
 namespace beast = boost::beast;    // from <boost/beast.hpp>
+namespace net = boost::asio;       // from <boost/asio.hpp>
 using tcp = boost::asio::ip::tcp;  // from <boost/asio/ip/tcp.hpp>
 
 class RServer;
 
-// Accepts incoming connections and launches the ServerSessions
+// Accepts incoming connections on the endpoint and launches a session
+// for each of them: ServerSession for clients, ReplicationSession
+// on the replication port of a secondary.
+// A listener given a shard binds the endpoint with SO_REUSEPORT next to the
+// listeners of the other shards, the kernel spreads incoming connections
+// over them and they stay on that shard. Otherwise there is one listener
+// and it deals the connections out to the shards in turn.
 class ServerListener : public std::enable_shared_from_this<ServerListener>
 {
+public:
+    // Takes the accepted socket, which has its own strand
+    typedef std::function<void(tcp::socket&& socket)> session_launcher;
+
+private:
     tcp::acceptor acceptor_;
     RServer* m_context;
+    net::io_context* m_shard;
+    session_launcher m_launch;
+    tcp::endpoint m_endpoint;
+    bool m_open = false;
 
 public:
-    ServerListener(RServer* context);
+    ServerListener(RServer* context,
+                   const tcp::endpoint& endpoint,
+                   session_launcher launch,
+                   net::io_context* shard = nullptr);
+
+    const tcp::endpoint&
+    endpoint() const
+    {
+        return m_endpoint;
+    }
+
+    // The endpoint could be opened, bound and listened on
+    bool
+    is_open() const
+    {
+        return m_open;
+    }
 
     // Start accepting incoming connections
     void
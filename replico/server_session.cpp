@@ -1,5 +1,6 @@
 #include "server_session.h"
 #include "helpers.h"
+#include "replico_server.h"
 
 class RServer;
 
@@ -8,6 +9,7 @@ ServerSession::ServerSession(tcp::socket&& socket, RServer* context)
     : stream_(std::move(socket))
     , lambda_(*this)
     , m_context(context)
+    , m_fault_timer(stream_.get_executor())
 {
 }
 
@@ -41,14 +43,68 @@ void ServerSession::on_read(beast::error_code ec, std::size_t bytes_transferred)
     if (ec)
         return fail(ec, "read");
 
+    m_request_histogram = &m_context->request_histogram(req_.target());
+    m_request_start = std::chrono::steady_clock::now();
+
+    auto action = m_context->m_faults.decide(req_.target());
+    if (action.m_delay.count() == 0)
+    {
+        return handle(action);
+    }
+
+    // Injected latency, the thread keeps serving other connections
+    m_fault_timer.expires_after(action.m_delay);
+    m_fault_timer.async_wait(
+        beast::bind_front_handler(&ServerSession::on_fault_delay, shared_from_this(), action));
+}
+
+void ServerSession::on_fault_delay(FaultInjector::Action action, beast::error_code ec)
+{
+    if (ec)
+        return fail(ec, "fault timer");
+
+    handle(action);
+}
+
+void ServerSession::handle(FaultInjector::Action action)
+{
+    if (action.m_drop)
+    {
+        // Injected message loss - no response at all
+        beast::error_code ec;
+        stream_.socket().close(ec);
+        return;
+    }
+
+    if (action.m_error)
+    {
+        http::response<http::string_body> res{http::status::service_unavailable, req_.version()};
+        res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
+        res.keep_alive(req_.keep_alive());
+        res.body() = "Injected failure";
+        res.prepare_payload();
+        return lambda_(std::move(res));
+    }
+
     // Send the response
-    handle_request(std::move(req_), lambda_, m_context, stream_.socket().remote_endpoint());
+    beast::error_code ec;
+    auto remote_endpoint = stream_.socket().remote_endpoint(ec);
+    if (ec)
+        return fail(ec, "remote_endpoint");
+
+    handle_request(std::move(req_), lambda_, m_context, remote_endpoint);
 }
 
 void ServerSession::on_write(bool close, beast::error_code ec, std::size_t bytes_transferred)
 {
     boost::ignore_unused(bytes_transferred);
 
+    if (m_request_histogram)
+    {
+        m_request_histogram->observe(std::chrono::steady_clock::now() - m_request_start);
+        m_request_histogram = nullptr;
+    }
+
     if (ec)
         return fail(ec, "write");
 
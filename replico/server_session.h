@@ -4,6 +4,7 @@
 #include <boost/beast/http.hpp>
 #include <boost/beast/version.hpp>
 #include <boost/asio/strand.hpp>
+#include <boost/asio/steady_timer.hpp>
 #include <boost/config.hpp>
 #include <algorithm>
 #include <cstdlib>
@@ -15,6 +16,8 @@
 #include <vector>
 #include <boost/algorithm/string.hpp>
 #include <chrono>
+#include "fault_injector.h"
+#include "metrics.h"
 
 namespace beast = boost::beast;    // from <boost/beast.hpp>
 namespace net = boost::asio;       // from <boost/asio.hpp>
@@ -66,6 +69,13 @@ public:
     send_lambda lambda_;
     RServer* m_context;
 
+    // Delays the request when latency is injected
+    net::steady_timer m_fault_timer;
+
+    // Duration of the current request goes there once it is answered
+    metrics::Histogram* m_request_histogram = nullptr;
+    std::chrono::steady_clock::time_point m_request_start;
+
 public:
     // Take ownership of the stream
     ServerSession(tcp::socket&& socket, RServer* context);
@@ -74,6 +84,8 @@ public:
     void run();
     void do_read();
     void on_read(beast::error_code ec, std::size_t bytes_transferred);
+    void on_fault_delay(FaultInjector::Action action, beast::error_code ec);
+    void handle(FaultInjector::Action action);
     void on_write(bool close, beast::error_code ec, std::size_t bytes_transferred);
     void do_close();
 };
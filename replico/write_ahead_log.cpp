@@ -0,0 +1,559 @@
+#include "write_ahead_log.h"
+#include "helpers.h"
+#include "logger.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace segment_format;
+
+namespace
+{
+// Pause before a failed group is written again
+const std::chrono::milliseconds RETRY_DELAY(100);
+
+void
+report(char const* what)
+{
+    fail(beast::error_code(errno, boost::system::generic_category()), what);
+}
+
+// mkdir -p
+bool
+make_dirs(const std::string& path)
+{
+    for (size_t pos = 1; pos != std::string::npos;)
+    {
+        pos = path.find('/', pos + 1);
+        auto dir = path.substr(0, pos);
+        if (::mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+}  // namespace
+
+WriteAheadLog::WriteAheadLog(std::string dir, size_t segment_bytes, Durability durability)
+    : m_dir(std::move(dir))
+    , m_segment_bytes(segment_bytes)
+    , m_durability(durability)
+{
+}
+
+WriteAheadLog::~WriteAheadLog()
+{
+    {
+        std::lock_guard<std::mutex> g(m_lock);
+        m_stop = true;
+    }
+    m_cv.notify_one();
+
+    if (m_committer.joinable())
+    {
+        m_committer.join();
+    }
+
+    if (m_fd >= 0)
+    {
+        ::close(m_fd);
+    }
+}
+
+bool
+WriteAheadLog::parse_durability(const std::string& name, Durability& durability)
+{
+    if (name == "none")
+        durability = Durability::none;
+    else if (name == "batch")
+        durability = Durability::batch;
+    else if (name == "entry")
+        durability = Durability::entry;
+    else
+        return false;
+    return true;
+}
+
+bool
+WriteAheadLog::open(std::vector<std::shared_ptr<SealedSegment>>& sealed,
+                    const recover_handler& on_record)
+{
+    if (!make_dirs(m_dir))
+    {
+        report("wal directory");
+        return false;
+    }
+
+    auto segments = list_segments();
+
+    // Sealed segments are only mapped, not parsed
+    for (size_t i = 0; i + 1 < segments.size(); ++i)
+    {
+        auto segment = SealedSegment::open(segments[i]);
+        if (!segment)
+        {
+            return false;
+        }
+        sealed.push_back(std::move(segment));
+    }
+
+    if (!segments.empty() && !recover_segment(segments.back(), on_record))
+    {
+        return false;
+    }
+
+    m_committer = std::thread([this] { run(); });
+    return true;
+}
+
+std::vector<std::string>
+WriteAheadLog::list_segments()
+{
+    std::vector<std::string> segments;
+    auto dir = ::opendir(m_dir.c_str());
+    if (!dir)
+    {
+        report("wal directory");
+        return segments;
+    }
+
+    // Zero padded names sort in the order of ids
+    while (auto e = ::readdir(dir))
+    {
+        std::string name = e->d_name;
+        if (name.size() > 12 && name.compare(0, 8, "segment-") == 0 &&
+            name.compare(name.size() - 4, 4, ".wal") == 0)
+        {
+            segments.push_back(m_dir + "/" + name);
+        }
+    }
+    ::closedir(dir);
+    std::sort(segments.begin(), segments.end());
+    return segments;
+}
+
+uint64_t
+WriteAheadLog::load_snapshot()
+{
+    char buf[16];
+    int fd = ::open((m_dir + "/snapshot").c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        return 0;
+    }
+    auto n = ::pread(fd, buf, sizeof(buf), 0);
+    ::close(fd);
+
+    if (n != sizeof(buf) || get_u32(buf) != SNAPSHOT_MAGIC ||
+        get_u32(buf + 12) != checksum(buf + 4, 8))
+    {
+        fail(beast::errc::make_error_code(beast::errc::illegal_byte_sequence), "snapshot");
+        return 0;
+    }
+    m_snapshot = get_u64(buf + 4);
+    return m_snapshot;
+}
+
+bool
+WriteAheadLog::compact(uint64_t below, bool& done)
+{
+    done = true;
+    if (below != m_snapshot && !save_snapshot(below))
+    {
+        return false;
+    }
+
+    // The snapshot is in place before any segment goes. A segment holds
+    // logs below the first id of the next one, the last one is never removed.
+    auto segments = list_segments();
+    for (size_t i = 0; i < segments.size(); ++i)
+    {
+        auto first = std::stoull(segments[i].substr(segments[i].size() - 24, 20));
+        auto next_first = i + 1 < segments.size()
+                              ? std::stoull(segments[i + 1].substr(segments[i + 1].size() - 24, 20))
+                              : std::numeric_limits<uint64_t>::max();
+        if (next_first > below)
+        {
+            done = first >= below;
+            break;
+        }
+
+        auto& wal = segments[i];
+        auto idx = wal.substr(0, wal.size() - 4) + ".idx";
+        if (::unlink(wal.c_str()) != 0)
+        {
+            report("segment unlink");
+        }
+        ::unlink(idx.c_str());
+    }
+    return true;
+}
+
+bool
+WriteAheadLog::save_snapshot(uint64_t below)
+{
+    // Replaced atomically, a crash leaves the old snapshot or the new one
+    char buf[16];
+    put_u32(buf, SNAPSHOT_MAGIC);
+    put_u64(buf + 4, below);
+    put_u32(buf + 12, checksum(buf + 4, 8));
+
+    auto path = m_dir + "/snapshot";
+    auto tmp = path + ".tmp";
+    int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        report("snapshot create");
+        return false;
+    }
+    auto written = ::pwrite(fd, buf, sizeof(buf), 0) == sizeof(buf);
+    if (!written || (m_durability != Durability::none && ::fdatasync(fd) != 0))
+    {
+        report("snapshot write");
+        ::close(fd);
+        return false;
+    }
+    ::close(fd);
+    if (::rename(tmp.c_str(), path.c_str()) != 0)
+    {
+        report("snapshot rename");
+        return false;
+    }
+    m_snapshot = below;
+    return true;
+}
+
+bool
+WriteAheadLog::recover_segment(const std::string& path, const recover_handler& on_record)
+{
+    int fd = ::open(path.c_str(), O_RDWR);
+    if (fd < 0)
+    {
+        report("wal open");
+        return false;
+    }
+
+    auto size = ::lseek(fd, 0, SEEK_END);
+    std::string data(static_cast<size_t>(std::max<off_t>(size, 0)), '\0');
+    if (::pread(fd, &data[0], data.size(), 0) != static_cast<ssize_t>(data.size()))
+    {
+        report("wal read");
+        ::close(fd);
+        return false;
+    }
+
+    // The active segment, keep appending after its last valid record
+    m_fd = fd;
+    m_segment_path = path;
+    m_segment_count = 0;
+    m_segment_index.clear();
+
+    Record r;
+    size_t offset = 0;
+    for (;;)
+    {
+        auto next = parse(data.data(), data.size(), offset, r, true);
+        if (next == 0)
+        {
+            break;
+        }
+
+        if (m_segment_count == 0)
+        {
+            m_segment_first_id = r.m_id;
+        }
+        if (m_segment_count % INDEX_STRIDE == 0)
+        {
+            m_segment_index.push_back(offset);
+        }
+        ++m_segment_count;
+
+        on_record(r.m_id, r.m_expected_wc, r.m_log);
+        offset = next;
+    }
+
+    m_offset = offset;
+    return true;
+}
+
+void
+WriteAheadLog::append(uint64_t id,
+                      uint32_t expected_wc,
+                      boost::string_view log,
+                      durable_handler on_durable)
+{
+    auto length = static_cast<uint32_t>(META_SIZE + log.size());
+
+    std::unique_lock<std::mutex> g(m_lock);
+    auto start = m_buffer.size();
+    m_buffer.resize(start + HEADER_SIZE + length);
+
+    auto p = &m_buffer[start];
+    put_u32(p, length);
+    put_u64(p + HEADER_SIZE, id);
+    put_u32(p + HEADER_SIZE + 8, expected_wc);
+    std::copy(log.begin(), log.end(), p + HEADER_SIZE + META_SIZE);
+    put_u32(p + 4, checksum(p + HEADER_SIZE, length));
+
+    m_pending.push_back(Pending{m_buffer.size(), std::move(on_durable)});
+
+    // Wake the committer only for the first record of a group
+    auto first = m_pending.size() == 1;
+    g.unlock();
+    if (first)
+    {
+        m_cv.notify_one();
+    }
+}
+
+void
+WriteAheadLog::run()
+{
+    // Records of a failed group not in the file yet, then the new ones
+    std::string buffer;
+    std::vector<Pending> records;
+    for (;;)
+    {
+        {
+            std::unique_lock<std::mutex> g(m_lock);
+            if (m_failed)
+            {
+                // The disk may recover (e.g. space freed), try again in a while
+                m_cv.wait_for(g, RETRY_DELAY, [this] { return m_stop; });
+            }
+            else
+            {
+                m_cv.wait(g, [this] { return m_stop || !m_pending.empty(); });
+            }
+            if (m_stop && (m_failed || m_pending.empty()))
+            {
+                return;
+            }
+
+            // Everything appended so far becomes one group
+            if (buffer.empty())
+            {
+                buffer.swap(m_buffer);
+                records.swap(m_pending);
+            }
+            else
+            {
+                auto base = buffer.size();
+                buffer += m_buffer;
+                for (auto& p : m_pending)
+                {
+                    records.push_back(Pending{base + p.m_end, std::move(p.m_on_durable)});
+                }
+                m_buffer.clear();
+                m_pending.clear();
+            }
+        }
+
+        size_t written = 0;
+        auto broken = m_broken;
+        auto durable = write_group(buffer, records, written);
+        if (m_broken)
+        {
+            if (!broken && logger::enabled(logger::error))
+            {
+                logger::Line(logger::error)
+                    << "Write-ahead log could not be synced, refusing writes until restart";
+            }
+        }
+        else if (!durable && !m_failed && logger::enabled(logger::error))
+        {
+            logger::Line(logger::error) << "Write-ahead log failed, writing again in "
+                                        << RETRY_DELAY.count() << "ms";
+        }
+        else if (durable && m_failed && logger::enabled(logger::info))
+        {
+            logger::Line(logger::info) << "Write-ahead log recovered";
+        }
+        m_failed = !durable && !m_broken;
+
+        // Waiters get an answer either way, the ones of a failed
+        // group see their write refused
+        for (auto& r : records)
+        {
+            if (r.m_on_durable)
+            {
+                r.m_on_durable(durable);
+            }
+        }
+
+        // Nothing written since a failed sync is trusted, not even
+        // after a sync which succeeds
+        if (durable || m_broken)
+        {
+            if (durable && m_on_synced && m_written_end > 0)
+            {
+                m_on_synced(m_written_end - 1);
+            }
+            buffer.clear();
+            records.clear();
+            continue;
+        }
+
+        // The records which did not make it into the file are written
+        // again from the same offset, over whatever part of them got there
+        auto begin = written > 0 ? records[written - 1].m_end : 0;
+        buffer.erase(0, begin);
+        records.erase(records.begin(), records.begin() + written);
+        for (auto& r : records)
+        {
+            r.m_end -= begin;
+            r.m_on_durable = nullptr;
+        }
+    }
+}
+
+bool
+WriteAheadLog::write_group(const std::string& buffer,
+                           const std::vector<Pending>& records,
+                           size_t& written)
+{
+    if (m_broken)
+    {
+        return false;
+    }
+
+    size_t begin = 0;
+    size_t i = 0;
+    while (i < records.size())
+    {
+        if (m_fd < 0 && !roll(get_u64(buffer.data() + begin + HEADER_SIZE)))
+        {
+            return false;
+        }
+
+        // Take as many consecutive records as fit into the current segment,
+        // in per-entry mode every record is written and synced alone
+        auto id_of = [&](size_t k) {
+            return get_u64(buffer.data() + (k ? records[k - 1].m_end : 0) + HEADER_SIZE);
+        };
+        size_t end = begin;
+        size_t j = i;
+        while (j < records.size() && (m_durability != Durability::entry || j == i) &&
+               m_offset + records[j].m_end - begin <= m_segment_bytes &&
+               (m_segment_count + j - i == 0 ||
+                id_of(j) == m_segment_first_id + m_segment_count + j - i))
+        {
+            end = records[j++].m_end;
+        }
+
+        if (j == i)
+        {
+            if (m_offset > 0)
+            {
+                if (!roll(get_u64(buffer.data() + begin + HEADER_SIZE)))
+                {
+                    return false;
+                }
+                continue;
+            }
+
+            // A record bigger than the whole segment gets one of its own
+            end = records[j++].m_end;
+        }
+
+        // A short write leaves m_offset where it is, the records are
+        // written there again
+        auto size = end - begin;
+        m_unsynced = true;
+        auto result = ::pwrite(m_fd, buffer.data() + begin, size, static_cast<off_t>(m_offset));
+        if (result != static_cast<ssize_t>(size))
+        {
+            if (result >= 0)
+            {
+                errno = ENOSPC;
+            }
+            report("wal write");
+            return false;
+        }
+
+        // Sparse index of the segment, stored when it is sealed
+        for (auto k = i; k < j; ++k)
+        {
+            if (m_segment_count == 0)
+            {
+                m_segment_first_id = get_u64(buffer.data() + (k ? records[k - 1].m_end : 0) +
+                                             HEADER_SIZE);
+            }
+            if (m_segment_count % INDEX_STRIDE == 0)
+            {
+                m_segment_index.push_back(m_offset + (k ? records[k - 1].m_end : 0) - begin);
+            }
+            ++m_segment_count;
+        }
+        m_offset += size;
+        m_written_end = id_of(j - 1) + 1;
+        written = j;
+
+        if (m_durability == Durability::entry && !sync())
+        {
+            return false;
+        }
+
+        begin = end;
+        i = j;
+    }
+
+    // After a failure the records written before are synced again
+    return m_durability == Durability::none || !m_unsynced || sync();
+}
+
+bool
+WriteAheadLog::roll(uint64_t first_id)
+{
+    if (m_fd >= 0)
+    {
+        if (m_durability != Durability::none && !sync())
+        {
+            return false;
+        }
+        ::close(m_fd);
+
+        // Next startup maps the sealed segment without scanning it
+        SealedSegment::write_index(m_segment_path, m_segment_first_id, m_segment_count, m_offset,
+                                   m_segment_index);
+    }
+
+    m_segment_path = m_dir + "/" + file_name(first_id, "wal");
+    m_fd = ::open(m_segment_path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (m_fd < 0)
+    {
+        report("wal create");
+        return false;
+    }
+    m_offset = 0;
+    m_segment_first_id = first_id;
+    m_segment_count = 0;
+    m_segment_index.clear();
+
+    // Preallocated segment lets fdatasync skip the file size update
+    if (::posix_fallocate(m_fd, 0, static_cast<off_t>(m_segment_bytes)) != 0)
+    {
+        report("wal fallocate");
+    }
+    return true;
+}
+
+bool
+WriteAheadLog::sync()
+{
+    if ((m_fdatasync ? m_fdatasync(m_fd) : ::fdatasync(m_fd)) != 0)
+    {
+        report("wal fdatasync");
+        m_broken = true;
+        return false;
+    }
+    m_unsynced = false;
+    return true;
+}
@@ -0,0 +1,150 @@
+#pragma once
+
+#include <boost/utility/string_view.hpp>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "sealed_segment.h"
+
+// Durable append-only log of fixed-size segment files.
+//
+// Segment "segment-<first id>.wal" is preallocated to the segment size and
+// holds records in segment_format. A zero length or a checksum mismatch marks
+// the end of the written data. A segment is sealed once the next one is
+// started and gets its sparse index file at that moment.
+//
+// Appends only copy the record into the pending buffer. A group commit thread
+// writes all pending records at once and syncs them according to durability.
+// When a write fails the waiters of the group are told so; the records which
+// are not in the file yet are written again, from the same offset, after a
+// pause. A failed sync is not retried: the kernel may have dropped the dirty
+// pages and marked them clean, so a later sync could succeed without the
+// records on disk. From then on every append is refused until restart, when
+// recovery finds out what made it.
+//
+// A segment holds consecutive ids; a record which does not follow the last
+// one (the log continues after a snapshot) starts a new segment. Compaction
+// records the first id kept in the snapshot file and deletes the segments
+// below it.
+class WriteAheadLog
+{
+public:
+    enum class Durability
+    {
+        // Written to the page cache, never synced
+        none,
+        // One fdatasync per group of records
+        batch,
+        // One fdatasync per record
+        entry
+    };
+
+    // Called by the commit thread once the record is durable, or with
+    // false if its group could not be written or synced
+    typedef std::function<void(bool durable)> durable_handler;
+
+    // Called by the commit thread with the highest id synced so far,
+    // including the records written again after a failure
+    typedef std::function<void(uint64_t id)> synced_handler;
+
+    // Syncs the file like fdatasync, tests use it to make syncs fail
+    typedef std::function<int(int fd)> sync_function;
+
+    // Called for every valid record on recovery
+    typedef std::function<void(uint64_t id, uint32_t expected_wc, boost::string_view log)>
+        recover_handler;
+
+    WriteAheadLog(std::string dir, size_t segment_bytes, Durability durability);
+    ~WriteAheadLog();
+
+    // Maps the sealed segments, replays the active one and starts
+    // the commit thread. Returns false if the segments cannot be used.
+    bool open(std::vector<std::shared_ptr<SealedSegment>>& sealed,
+              const recover_handler& on_record);
+
+    // Set before open
+    void
+    on_synced(synced_handler handler)
+    {
+        m_on_synced = std::move(handler);
+    }
+
+    // Set before open
+    void
+    sync_with(sync_function function)
+    {
+        m_fdatasync = std::move(function);
+    }
+
+    // Thread safe. Records are written in the order of append calls.
+    void append(uint64_t id, uint32_t expected_wc, boost::string_view log, durable_handler on_durable);
+
+    // First id kept by the last compaction, 0 if there was none
+    uint64_t load_snapshot();
+
+    // Stores below as the first id kept, then deletes the segments which
+    // only hold logs below it. done is cleared while the active segment
+    // still holds some, it goes once the log moves on to the next segment.
+    // Not called concurrently with itself.
+    bool compact(uint64_t below, bool& done);
+
+    static bool parse_durability(const std::string& name, Durability& durability);
+
+private:
+    struct Pending
+    {
+        // End of the record in the pending buffer
+        size_t m_end;
+        durable_handler m_on_durable;
+    };
+
+    void run();
+    // written is the number of records which made it into the file
+    bool write_group(const std::string& buffer,
+                     const std::vector<Pending>& records,
+                     size_t& written);
+    bool roll(uint64_t first_id);
+    bool sync();
+    bool recover_segment(const std::string& path, const recover_handler& on_record);
+    std::vector<std::string> list_segments();
+    bool save_snapshot(uint64_t below);
+
+    std::string m_dir;
+    size_t m_segment_bytes;
+    Durability m_durability;
+
+    // Current segment, touched by the commit thread only
+    int m_fd = -1;
+    size_t m_offset = 0;
+    std::string m_segment_path;
+    uint64_t m_segment_first_id = 0;
+    uint64_t m_segment_count = 0;
+    std::vector<uint64_t> m_segment_index;
+
+    // Commit thread only. Written but not synced yet, the last group failed
+    bool m_unsynced = false;
+    bool m_failed = false;
+
+    // Commit thread only. A sync failed, nothing is durable anymore
+    bool m_broken = false;
+    sync_function m_fdatasync;
+
+    // One past the last id written, 0 if none
+    uint64_t m_written_end = 0;
+    synced_handler m_on_synced;
+
+    // Id in the snapshot file, touched by compact only
+    uint64_t m_snapshot = 0;
+
+    std::mutex m_lock;
+    std::condition_variable m_cv;
+    std::string m_buffer;
+    std::vector<Pending> m_pending;
+    bool m_stop = false;
+
+    std::thread m_committer;
+};
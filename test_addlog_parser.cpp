@@ -0,0 +1,134 @@
+#include "gtest/gtest.h"
+
+#include <string>
+
+#include "addlog_parser.h"
+
+namespace
+{
+// Parses body and returns the reason of the failure, empty on success
+std::string
+parse(const std::string& body, AddLogRequest& request)
+{
+    const char* why = nullptr;
+    if (parse_addlog(body, request, why))
+    {
+        return "";
+    }
+    EXPECT_NE(nullptr, why);
+    return why ? why : "?";
+}
+
+std::string
+parse(const std::string& body)
+{
+    AddLogRequest request;
+    return parse(body, request);
+}
+
+std::string
+nested(int depth)
+{
+    return "{\"data\":\"x\",\"wc\":1,\"extra\":" + std::string(depth, '[') +
+           std::string(depth, ']') + "}";
+}
+}  // namespace
+
+TEST(AddLogParserTests, Fields)
+{
+    AddLogRequest request;
+    ASSERT_EQ("", parse(" {\"wc\": 3, \"data\": \"hello\", \"timeout\": 250}\n", request));
+    EXPECT_EQ("hello", request.m_data);
+    EXPECT_EQ(3u, request.m_wc);
+    EXPECT_TRUE(request.m_has_timeout);
+    EXPECT_EQ(250, request.m_timeout_ms);
+
+    ASSERT_EQ("", parse("{\"data\":\"\",\"wc\":0}", request));
+    EXPECT_EQ("", request.m_data);
+    EXPECT_EQ(0u, request.m_wc);
+    EXPECT_FALSE(request.m_has_timeout);
+}
+
+TEST(AddLogParserTests, QuotedNumbers)
+{
+    AddLogRequest request;
+    ASSERT_EQ("", parse("{\"data\":\"x\",\"wc\":\"2\",\"timeout\":\"-1\"}", request));
+    EXPECT_EQ(2u, request.m_wc);
+    EXPECT_EQ(-1, request.m_timeout_ms);
+
+    EXPECT_EQ("wc must be a non-negative integer", parse("{\"data\":\"x\",\"wc\":\"two\"}"));
+    EXPECT_EQ("wc must be a non-negative integer", parse("{\"data\":\"x\",\"wc\":\"\"}"));
+    EXPECT_EQ("wc must be a non-negative integer", parse("{\"data\":\"x\",\"wc\":-1}"));
+    EXPECT_EQ("wc must be a non-negative integer", parse("{\"data\":\"x\",\"wc\":1.5}"));
+    EXPECT_EQ("wc must be a non-negative integer",
+              parse("{\"data\":\"x\",\"wc\":\"99999999999999999999999\"}"));
+    EXPECT_EQ("timeout must be an integer",
+              parse("{\"data\":\"x\",\"wc\":1,\"timeout\":\"1e3\"}"));
+}
+
+TEST(AddLogParserTests, Escapes)
+{
+    AddLogRequest request;
+    ASSERT_EQ("", parse(R"({"data":"a\"b\\c\/d\n\u0041\u00e9","wc":1})", request));
+    EXPECT_EQ("a\"b\\c/d\nA\xc3\xa9", request.m_data);
+
+    // Escaped field names are skipped as unknown ones
+    EXPECT_EQ("Missing wc", parse(R"({"data":"x","w\u0063":1})"));
+
+    EXPECT_EQ("Bad escape sequence", parse(R"({"data":"\x","wc":1})"));
+    EXPECT_EQ("Bad escape sequence", parse(R"({"data":"\u12g4","wc":1})"));
+    EXPECT_EQ("Control character in a string", parse("{\"data\":\"a\tb\",\"wc\":1}"));
+    EXPECT_EQ("Unterminated string", parse(R"({"data":"abc\")"));
+}
+
+TEST(AddLogParserTests, Surrogates)
+{
+    AddLogRequest request;
+    ASSERT_EQ("", parse(R"({"data":"\ud83d\ude00","wc":1})", request));
+    EXPECT_EQ("\xf0\x9f\x98\x80", request.m_data);
+
+    EXPECT_EQ("Unpaired surrogate", parse(R"({"data":"\ud83d","wc":1})"));
+    EXPECT_EQ("Unpaired surrogate", parse(R"({"data":"\ud83dx","wc":1})"));
+    EXPECT_EQ("Unpaired surrogate", parse(R"({"data":"\ud83d\u0041","wc":1})"));
+    EXPECT_EQ("Unpaired surrogate", parse(R"({"data":"\ude00\ud83d","wc":1})"));
+}
+
+TEST(AddLogParserTests, TrailingGarbage)
+{
+    EXPECT_EQ("", parse("{\"data\":\"x\",\"wc\":1} \r\n"));
+    EXPECT_EQ("Unexpected data after the object", parse("{\"data\":\"x\",\"wc\":1} x"));
+    EXPECT_EQ("Unexpected data after the object", parse("{\"data\":\"x\",\"wc\":1}{}"));
+    EXPECT_EQ("Expected ',' or '}'", parse("{\"data\":\"x\",\"wc\":1 \"timeout\":1}"));
+    EXPECT_EQ("Expected ',' or '}'", parse("{\"data\":\"x\",\"wc\":1"));
+    EXPECT_EQ("Expected a JSON object", parse("[]"));
+    EXPECT_EQ("Expected a JSON object", parse(""));
+}
+
+TEST(AddLogParserTests, UnknownFields)
+{
+    AddLogRequest request;
+    ASSERT_EQ("", parse(R"({"a":null,"data":"x","b":[true,false,{"c":-1.5e3}],"wc":1,"d":{}})",
+                        request));
+    EXPECT_EQ("x", request.m_data);
+
+    EXPECT_EQ("Bad number", parse(R"({"data":"x","wc":1,"a":-})"));
+    EXPECT_EQ("Bad number", parse(R"({"data":"x","wc":1,"a":1.})"));
+    EXPECT_EQ("Expected ',' or '}'", parse(R"({"data":"x","wc":1,"a":01})"));
+    EXPECT_EQ("Unexpected character", parse(R"({"data":"x","wc":1,"a":nul})"));
+    EXPECT_EQ("Expected ',' or ']'", parse(R"({"data":"x","wc":1,"a":[1 2]})"));
+}
+
+TEST(AddLogParserTests, DepthLimit)
+{
+    EXPECT_EQ("", parse(nested(32)));
+    EXPECT_EQ("Nesting too deep", parse(nested(33)));
+    EXPECT_EQ("Nesting too deep", parse(nested(100000)));
+}
+
+TEST(AddLogParserTests, MissingFields)
+{
+    EXPECT_EQ("Missing data", parse("{\"wc\":1}"));
+    EXPECT_EQ("Missing wc", parse("{\"data\":\"x\"}"));
+    EXPECT_EQ("data must be a string", parse("{\"data\":1,\"wc\":1}"));
+    EXPECT_EQ("Missing data", parse("{}"));
+}
@@ -0,0 +1,92 @@
+#include "gtest/gtest.h"
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include "replico_server.h"
+
+TEST(AdmissionTests, WriteLimit)
+{
+    RServer server;
+    server.m_max_pending_writes = 2;
+
+    EXPECT_EQ(RServer::admitted, server.admit_write(10));
+    EXPECT_EQ(RServer::admitted, server.admit_write(10));
+    EXPECT_EQ(RServer::too_many_writes, server.admit_write(10));
+
+    // A refused write takes nothing
+    EXPECT_EQ(2u, server.pending_writes());
+    EXPECT_EQ(20u, server.pending_bytes());
+
+    server.release_write(10);
+    EXPECT_EQ(RServer::admitted, server.admit_write(10));
+}
+
+TEST(AdmissionTests, ByteLimit)
+{
+    RServer server;
+    server.m_max_pending_bytes = 100;
+
+    // One write larger than the budget still goes through alone
+    EXPECT_EQ(RServer::admitted, server.admit_write(500));
+    EXPECT_EQ(RServer::too_many_bytes, server.admit_write(1));
+    server.release_write(500);
+
+    EXPECT_EQ(RServer::admitted, server.admit_write(60));
+    EXPECT_EQ(RServer::admitted, server.admit_write(40));
+    EXPECT_EQ(RServer::too_many_bytes, server.admit_write(1));
+    EXPECT_EQ(100u, server.pending_bytes());
+
+    server.release_write(60);
+    server.release_write(40);
+    EXPECT_EQ(0u, server.pending_writes());
+    EXPECT_EQ(0u, server.pending_bytes());
+}
+
+TEST(AdmissionTests, NoLimits)
+{
+    RServer server;
+    for (int i = 0; i < 1000; ++i)
+    {
+        EXPECT_EQ(RServer::admitted, server.admit_write(1 << 20));
+    }
+    EXPECT_EQ(1000u, server.pending_writes());
+}
+
+TEST(AdmissionTests, RacingWritersNeverOvershoot)
+{
+    RServer server;
+    server.m_max_pending_writes = 3;
+
+    std::atomic<size_t> inside{0};
+    std::atomic<size_t> most{0};
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 8; ++t)
+    {
+        threads.emplace_back([&] {
+            for (int i = 0; i < 10000; ++i)
+            {
+                if (server.admit_write(1) != RServer::admitted)
+                {
+                    continue;
+                }
+                auto now = ++inside;
+                auto seen = most.load();
+                while (now > seen && !most.compare_exchange_weak(seen, now))
+                {
+                }
+                --inside;
+                server.release_write(1);
+            }
+        });
+    }
+    for (auto& t : threads)
+    {
+        t.join();
+    }
+
+    EXPECT_LE(most.load(), 3u);
+    EXPECT_EQ(0u, server.pending_writes());
+    EXPECT_EQ(0u, server.pending_bytes());
+}
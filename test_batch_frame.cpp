@@ -0,0 +1,176 @@
+#include "gtest/gtest.h"
+
+#include <string>
+
+#include "batch_frame.h"
+#include "segment_format.h"
+
+namespace
+{
+boost::string_view
+body_of(const std::string& frame)
+{
+    EXPECT_EQ(frame.size() - batch_frame::PREFIX_SIZE, batch_frame::body_size(frame.data()));
+    return boost::string_view(frame).substr(batch_frame::PREFIX_SIZE);
+}
+
+std::string
+three_logs()
+{
+    std::string frame;
+    batch_frame::begin(frame, 7, 42, 10);
+    batch_frame::append(frame, 10, "first");
+    batch_frame::append(frame, 11, "");
+    batch_frame::append(frame, 12, std::string(1000, 'x'));
+    batch_frame::finish(frame, 3);
+    return frame;
+}
+}  // namespace
+
+TEST(BatchFrameTests, AppendRoundTrip)
+{
+    auto frame = three_logs();
+
+    batch_frame::Append decoded;
+    ASSERT_TRUE(batch_frame::decode(body_of(frame), decoded));
+    EXPECT_EQ(7u, decoded.m_term);
+    EXPECT_EQ(42u, decoded.m_epoch);
+    EXPECT_EQ(10u, decoded.m_acked);
+    ASSERT_EQ(3u, decoded.m_entries.size());
+    EXPECT_EQ(10u, decoded.m_entries[0].m_id);
+    EXPECT_EQ("first", decoded.m_entries[0].m_log);
+    EXPECT_EQ("", decoded.m_entries[1].m_log);
+    EXPECT_EQ(std::string(1000, 'x'), decoded.m_entries[2].m_log);
+}
+
+TEST(BatchFrameTests, MalformedAppend)
+{
+    auto frame = three_logs();
+    batch_frame::Append decoded;
+
+    // A flipped byte of a log fails its checksum
+    auto corrupt = frame;
+    corrupt[corrupt.size() - 1] ^= 1;
+    EXPECT_FALSE(batch_frame::decode(body_of(corrupt), decoded));
+
+    // Cut short, or with bytes after the last log
+    auto body = body_of(frame);
+    EXPECT_FALSE(batch_frame::decode(body.substr(0, body.size() - 1), decoded));
+    EXPECT_FALSE(batch_frame::decode(frame.substr(batch_frame::PREFIX_SIZE) + "x", decoded));
+    EXPECT_FALSE(batch_frame::decode(body.substr(0, 10), decoded));
+
+    // A count the frame cannot hold
+    auto counted = frame;
+    batch_frame::finish(counted, 1000000);
+    EXPECT_FALSE(batch_frame::decode(body_of(counted), decoded));
+
+    // Another frame type
+    std::string ack;
+    batch_frame::encode_ack(ack, batch_frame::ok, 7, 12, batch_frame::no_codec);
+    EXPECT_FALSE(batch_frame::decode(body_of(ack), decoded));
+}
+
+TEST(BatchFrameTests, AckRoundTrip)
+{
+    // Acks of several frames go back to back
+    std::string out;
+    batch_frame::encode_ack(out, batch_frame::ok, 7, 12, batch_frame::zlib_codec);
+    batch_frame::encode_ack(out, batch_frame::gap, 8, 3, batch_frame::no_codec);
+    ASSERT_EQ(2 * batch_frame::ACK_SIZE, out.size());
+
+    batch_frame::Ack ack;
+    auto first = boost::string_view(out).substr(0, batch_frame::ACK_SIZE);
+    ASSERT_EQ(batch_frame::ACK_SIZE - batch_frame::PREFIX_SIZE,
+              batch_frame::body_size(first.data()));
+    ASSERT_TRUE(batch_frame::decode_ack(first.substr(batch_frame::PREFIX_SIZE), ack));
+    EXPECT_EQ(batch_frame::ok, ack.m_status);
+    EXPECT_EQ(7u, ack.m_term);
+    EXPECT_EQ(12u, ack.m_last_id);
+    EXPECT_EQ(batch_frame::zlib_codec, ack.m_codecs);
+
+    auto second = boost::string_view(out).substr(batch_frame::ACK_SIZE);
+    ASSERT_TRUE(batch_frame::decode_ack(second.substr(batch_frame::PREFIX_SIZE), ack));
+    EXPECT_EQ(batch_frame::gap, ack.m_status);
+    EXPECT_EQ(8u, ack.m_term);
+    EXPECT_EQ(3u, ack.m_last_id);
+    EXPECT_EQ(batch_frame::no_codec, ack.m_codecs);
+
+    // Wrong size
+    EXPECT_FALSE(batch_frame::decode_ack(second.substr(batch_frame::PREFIX_SIZE + 1), ack));
+}
+
+TEST(BatchFrameTests, CompressRoundTrip)
+{
+    auto frame = three_logs();
+    std::string compressed;
+    ASSERT_TRUE(batch_frame::compress(frame, 1, compressed));
+    EXPECT_LT(compressed.size(), frame.size());
+
+    // The compressed frame holds the body of the append frame
+    std::string inflated;
+    ASSERT_TRUE(batch_frame::decompress(body_of(compressed), inflated));
+    EXPECT_EQ(body_of(frame), inflated);
+
+    batch_frame::Append decoded;
+    ASSERT_TRUE(batch_frame::decode(inflated, decoded));
+    ASSERT_EQ(3u, decoded.m_entries.size());
+    EXPECT_EQ(std::string(1000, 'x'), decoded.m_entries[2].m_log);
+}
+
+TEST(BatchFrameTests, CompressRefusals)
+{
+    // A frame which does not get smaller goes raw
+    std::string noise(4000, '\0');
+    uint32_t seed = 1;
+    for (auto& c : noise)
+    {
+        seed = seed * 1103515245 + 12345;
+        c = char(seed >> 23);
+    }
+    std::string frame;
+    batch_frame::begin(frame, 1, 1, 0);
+    batch_frame::append(frame, 0, noise);
+    batch_frame::finish(frame, 1);
+    std::string compressed;
+    EXPECT_FALSE(batch_frame::compress(frame, 9, compressed));
+
+    // A damaged stream or a wrong length is refused
+    ASSERT_TRUE(batch_frame::compress(three_logs(), 1, compressed));
+    std::string inflated;
+    auto damaged = compressed;
+    damaged[damaged.size() / 2] ^= 0x5a;
+    EXPECT_FALSE(batch_frame::decompress(body_of(damaged), inflated));
+
+    auto body = body_of(compressed).to_string();
+    body[1] ^= 1;
+    EXPECT_FALSE(batch_frame::decompress(body, inflated));
+
+    // So is one claiming more than a frame may hold
+    body = body_of(compressed).to_string();
+    body[4] = char(0x7f);
+    EXPECT_FALSE(batch_frame::decompress(body, inflated));
+}
+
+TEST(BatchFrameTests, ZeroCopyHeaders)
+{
+    // Big logs get only their header in the frame, the bytes on the wire
+    // are the frame pieces and the logs in between
+    std::string big(5000, 'b');
+    std::string frame;
+    batch_frame::begin(frame, 3, 4, 5);
+    batch_frame::append(frame, 5, "small");
+    batch_frame::append_header(frame, 6, big, segment_format::checksum(big.data(), big.size()));
+    auto split = frame.size();
+    batch_frame::append(frame, 7, "tail");
+    batch_frame::finish(frame, 3, big.size());
+    EXPECT_EQ(frame.size() + big.size() - batch_frame::PREFIX_SIZE,
+              batch_frame::body_size(frame.data()));
+
+    auto wire = frame.substr(0, split) + big + frame.substr(split);
+    batch_frame::Append decoded;
+    ASSERT_TRUE(batch_frame::decode(body_of(wire), decoded));
+    ASSERT_EQ(3u, decoded.m_entries.size());
+    EXPECT_EQ("small", decoded.m_entries[0].m_log);
+    EXPECT_EQ(big, decoded.m_entries[1].m_log);
+    EXPECT_EQ("tail", decoded.m_entries[2].m_log);
+}
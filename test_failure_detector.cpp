@@ -0,0 +1,113 @@
+#include "gtest/gtest.h"
+
+#include <chrono>
+
+#include "failure_detector.h"
+
+namespace
+{
+const FailureDetector::clock::time_point START;
+
+FailureDetector::clock::time_point
+at(long long ms)
+{
+    return START + std::chrono::milliseconds(ms);
+}
+}  // namespace
+
+TEST(FailureDetectorTests, PhiGrowsWithSilence)
+{
+    FailureDetector detector(std::chrono::milliseconds(100), std::chrono::milliseconds(0), START);
+    for (int i = 1; i <= 50; ++i)
+    {
+        detector.heartbeat(at(i * 100));
+    }
+    EXPECT_EQ(at(5000), detector.last());
+
+    // Right after a heartbeat nothing is suspicious, at the mean interval
+    // it is a coin flip whether the next one comes: phi = log10(2)
+    EXPECT_LT(detector.phi(at(5000)), 0.01);
+    EXPECT_NEAR(0.301, detector.phi(at(5100)), 0.001);
+
+    auto previous = 0.0;
+    for (int ms = 5000; ms <= 5400; ms += 10)
+    {
+        auto phi = detector.phi(at(ms));
+        EXPECT_GE(phi, previous) << ms;
+        previous = phi;
+    }
+    EXPECT_GT(detector.phi(at(5300)), 8.0);
+
+    // A heartbeat clears the suspicion
+    detector.heartbeat(at(5400));
+    EXPECT_LT(detector.phi(at(5400)), 0.01);
+}
+
+TEST(FailureDetectorTests, AcceptablePause)
+{
+    FailureDetector strict(std::chrono::milliseconds(100), std::chrono::milliseconds(0), START);
+    FailureDetector lenient(std::chrono::milliseconds(100), std::chrono::milliseconds(200), START);
+
+    // The pause shifts the curve without changing its shape
+    EXPECT_NEAR(strict.phi(at(150)), lenient.phi(at(350)), 1e-9);
+    EXPECT_LT(lenient.phi(at(300)), 1.0);
+    EXPECT_GT(strict.phi(at(300)), 8.0);
+}
+
+TEST(FailureDetectorTests, JitterLowersPhi)
+{
+    FailureDetector steady(std::chrono::milliseconds(100), std::chrono::milliseconds(0), START);
+    FailureDetector jittery(std::chrono::milliseconds(100), std::chrono::milliseconds(0), START);
+    for (int i = 1; i <= 20; ++i)
+    {
+        steady.heartbeat(at(i * 100));
+        jittery.heartbeat(at(i * 100 + (i % 2 ? 40 : -40)));
+    }
+    jittery.heartbeat(at(2100));
+    steady.heartbeat(at(2100));
+
+    // Same mean interval, the wider spread makes the same silence less alarming
+    EXPECT_LT(jittery.phi(at(2300)), steady.phi(at(2300)));
+}
+
+TEST(FailureDetectorTests, WindowForgetsOldIntervals)
+{
+    FailureDetector detector(
+        std::chrono::milliseconds(100), std::chrono::milliseconds(0), START, 10);
+
+    // The node slowed down to one heartbeat per second
+    long long now = 0;
+    for (int i = 0; i < 10; ++i)
+    {
+        detector.heartbeat(at(now += 1000));
+    }
+    EXPECT_NEAR(0.301, detector.phi(at(now + 1000)), 0.001);
+}
+
+TEST(RttEstimatorTests, Timeout)
+{
+    RttEstimator rtt;
+    EXPECT_TRUE(rtt.empty());
+    EXPECT_EQ(std::chrono::milliseconds(500),
+              rtt.timeout(std::chrono::milliseconds(10), std::chrono::milliseconds(500)));
+
+    // First sample: srtt = rtt, rttvar = rtt / 2
+    rtt.observe(std::chrono::milliseconds(20));
+    EXPECT_EQ(std::chrono::microseconds(20000), rtt.srtt());
+    EXPECT_EQ(std::chrono::milliseconds(60),
+              rtt.timeout(std::chrono::milliseconds(10), std::chrono::milliseconds(500)));
+
+    // Clamped to the bounds
+    EXPECT_EQ(std::chrono::milliseconds(100),
+              rtt.timeout(std::chrono::milliseconds(100), std::chrono::milliseconds(500)));
+    EXPECT_EQ(std::chrono::milliseconds(30),
+              rtt.timeout(std::chrono::milliseconds(10), std::chrono::milliseconds(30)));
+
+    // Steady samples shrink the variance towards zero
+    for (int i = 0; i < 100; ++i)
+    {
+        rtt.observe(std::chrono::milliseconds(20));
+    }
+    EXPECT_EQ(std::chrono::milliseconds(20),
+              rtt.timeout(std::chrono::milliseconds(1), std::chrono::milliseconds(500)));
+}
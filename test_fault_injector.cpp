@@ -0,0 +1,64 @@
+#include "gtest/gtest.h"
+
+#include <chrono>
+#include <string>
+
+#include "fault_injector.h"
+
+TEST(FaultInjectorTests, Configure)
+{
+    FaultInjector faults;
+    std::string why;
+    EXPECT_EQ("none", faults.describe());
+
+    ASSERT_TRUE(faults.configure(" /addbatch:delay=fixed:5,drop=0.5 ; *:error=0.001", why));
+    EXPECT_EQ("/addbatch:delay=fixed:5,drop=0.5;*:error=0.001", faults.describe());
+
+    // A bad spec keeps the previous rules
+    EXPECT_FALSE(faults.configure("drop=0.5", why));
+    EXPECT_EQ("Missing target in rule: drop=0.5", why);
+    EXPECT_FALSE(faults.configure("*:drop=2", why));
+    EXPECT_EQ("Bad setting 'drop=2' in rule: *:drop=2", why);
+    EXPECT_FALSE(faults.configure("*:delay=uniform:10-5", why));
+    EXPECT_FALSE(faults.configure("*:delay=exp:0", why));
+    EXPECT_FALSE(faults.configure("*:delay=fixed:x", why));
+    EXPECT_FALSE(faults.configure("*:delay=slow:1", why));
+    EXPECT_FALSE(faults.configure("*:timeout=1", why));
+    EXPECT_EQ("/addbatch:delay=fixed:5,drop=0.5;*:error=0.001", faults.describe());
+
+    ASSERT_TRUE(faults.configure("none", why));
+    EXPECT_EQ("none", faults.describe());
+}
+
+TEST(FaultInjectorTests, Decide)
+{
+    FaultInjector faults;
+    std::string why;
+    ASSERT_TRUE(faults.configure("/addbatch:delay=fixed:5,drop=1;/addlog:error=1;"
+                                 "*:delay=uniform:1-2",
+                                 why));
+
+    auto action = faults.decide("/addbatch");
+    EXPECT_EQ(std::chrono::microseconds(5000), action.m_delay);
+    EXPECT_TRUE(action.m_drop);
+    EXPECT_FALSE(action.m_error);
+
+    // Rules match the path without the query
+    action = faults.decide("/addlog?wc=1");
+    EXPECT_EQ(std::chrono::microseconds(0), action.m_delay);
+    EXPECT_FALSE(action.m_drop);
+    EXPECT_TRUE(action.m_error);
+
+    for (int i = 0; i < 100; ++i)
+    {
+        action = faults.decide("/getlog");
+        EXPECT_GE(action.m_delay, std::chrono::microseconds(1000));
+        EXPECT_LE(action.m_delay, std::chrono::microseconds(2000));
+        EXPECT_FALSE(action.m_drop || action.m_error);
+    }
+
+    // Admin targets stay reachable whatever the rules say
+    action = faults.decide("/admin/fault");
+    EXPECT_EQ(std::chrono::microseconds(0), action.m_delay);
+    EXPECT_FALSE(action.m_drop || action.m_error);
+}
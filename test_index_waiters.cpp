@@ -0,0 +1,85 @@
+#include "gtest/gtest.h"
+
+#include <functional>
+#include <limits>
+#include <string>
+#include <vector>
+
+#include "index_waiters.h"
+#include "replico_server.h"
+
+TEST(IndexWaitersTests, AppliedCallsWaitersBelowEnd)
+{
+    IndexWaiters waiters;
+    std::vector<size_t> called;
+    waiters.wait(5, [&called] { called.push_back(5); });
+    waiters.wait(3, [&called] { called.push_back(3); });
+    waiters.wait(3, [&called] { called.push_back(33); });
+    waiters.wait(9, [&called] { called.push_back(9); });
+
+    // The log with index 5 is not there before end passes it
+    waiters.applied(5);
+    EXPECT_EQ((std::vector<size_t>{3, 33}), called);
+
+    waiters.applied(6);
+    EXPECT_EQ((std::vector<size_t>{3, 33, 5}), called);
+
+    // A waiter is called once
+    waiters.applied(6);
+    EXPECT_EQ(3u, called.size());
+
+    waiters.applied(100);
+    EXPECT_EQ((std::vector<size_t>{3, 33, 5, 9}), called);
+}
+
+TEST(IndexWaitersTests, CancelForgetsOneWaiter)
+{
+    IndexWaiters waiters;
+    int first = 0;
+    int second = 0;
+    auto ticket = waiters.wait(4, [&first] { ++first; });
+    waiters.wait(4, [&second] { ++second; });
+
+    waiters.cancel(4, ticket);
+    waiters.applied(5);
+    EXPECT_EQ(0, first);
+    EXPECT_EQ(1, second);
+
+    // Too late, the waiter was called already
+    waiters.cancel(4, ticket);
+}
+
+TEST(IndexWaitersTests, WaiterMayWaitAgain)
+{
+    IndexWaiters waiters;
+    std::vector<size_t> called;
+    std::function<void()> again = [&] {
+        called.push_back(1);
+        waiters.wait(7, [&called] { called.push_back(7); });
+    };
+    waiters.wait(1, again);
+
+    waiters.applied(2);
+    EXPECT_EQ(std::vector<size_t>{1}, called);
+    waiters.applied(8);
+    EXPECT_EQ((std::vector<size_t>{1, 7}), called);
+}
+
+TEST(IndexWaitersTests, MinIndexSeesLogAddedBeforeWaiting)
+{
+    RServer server;
+    server.m_is_root = true;
+    size_t id;
+    ASSERT_TRUE(server.add_log("log 0", std::numeric_limits<size_t>::max(), id));
+    ASSERT_TRUE(server.add_log("log 1", std::numeric_limits<size_t>::max(), id));
+
+    // The logs are there already, the waiter is called right away
+    int present = 0;
+    server.wait_for_log(1, [&present] { ++present; });
+    EXPECT_EQ(1, present);
+
+    int missing = 0;
+    auto ticket = server.wait_for_log(2, [&missing] { ++missing; });
+    EXPECT_EQ(0, missing);
+    server.cancel_wait(2, ticket);
+}
@@ -0,0 +1,154 @@
+#include "gtest/gtest.h"
+
+#include <chrono>
+#include <future>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "log_store.h"
+
+namespace
+{
+size_t
+append(LogStore& store, const std::string& log)
+{
+    size_t id = 0;
+    EXPECT_TRUE(store.reserve(1, id));
+    store.at(id).m_data = store.copy(id, log);
+    store.commit(id);
+    return id;
+}
+}  // namespace
+
+TEST(LogStoreTests, ReserveStopsAtLimit)
+{
+    LogStore store;
+    store.set_base(100);
+    EXPECT_EQ(100 + LogStore::MAX_CHUNKS * LogStore::CHUNK_SIZE, store.limit());
+
+    size_t first = 0;
+    ASSERT_TRUE(store.reserve(10, first));
+    EXPECT_EQ(100u, first);
+    EXPECT_EQ(110u, store.end());
+
+    // Ids past the limit have no chunk slot, nothing is reserved
+    EXPECT_FALSE(store.reserve(store.limit() - store.end() + 1, first));
+    EXPECT_EQ(110u, store.end());
+
+    ASSERT_TRUE(store.reserve(store.limit() - store.end(), first));
+    EXPECT_EQ(110u, first);
+    EXPECT_EQ(store.limit(), store.end());
+    EXPECT_FALSE(store.reserve(1, first));
+}
+
+TEST(LogStoreTests, TruncationRaisesLimit)
+{
+    LogStore store;
+    auto generation = LogStore::GENERATION_CHUNKS * LogStore::CHUNK_SIZE;
+    for (size_t i = 0; i <= generation; ++i)
+    {
+        append(store, "x");
+    }
+    auto limit = store.limit();
+    auto chunk_bytes = store.chunk_bytes();
+    EXPECT_EQ(generation + 1, store.arena_stats().m_payloads);
+
+    // A whole generation goes, its chunk and arena slots are free again
+    store.truncate(generation);
+    EXPECT_EQ(limit + generation, store.limit());
+    EXPECT_EQ(chunk_bytes / (LogStore::GENERATION_CHUNKS + 1), store.chunk_bytes());
+    EXPECT_EQ(1u, store.arena_stats().m_payloads);
+}
+
+TEST(LogStoreTests, PublishesInIdOrder)
+{
+    LogStore store;
+    std::vector<size_t> published;
+    store.on_publish([&published](size_t id, LogEntry& entry) {
+        EXPECT_EQ("log " + std::to_string(id), entry.m_data);
+        published.push_back(id);
+    });
+
+    size_t first = 0;
+    ASSERT_TRUE(store.reserve(3, first));
+    for (size_t id = first; id < first + 3; ++id)
+    {
+        store.at(id).m_data = store.copy(id, "log " + std::to_string(id));
+    }
+
+    // The watermark only moves over a contiguous prefix
+    store.commit(2);
+    EXPECT_EQ(0u, store.published());
+    EXPECT_TRUE(published.empty());
+    EXPECT_EQ(nullptr, store.find(2));
+
+    store.commit(0);
+    EXPECT_EQ(1u, store.published());
+    EXPECT_EQ(std::vector<size_t>{0}, published);
+
+    store.commit(1);
+    EXPECT_EQ(3u, store.published());
+    EXPECT_EQ((std::vector<size_t>{0, 1, 2}), published);
+    ASSERT_NE(nullptr, store.find(2));
+    EXPECT_EQ("log 2", store.find(2)->m_data);
+}
+
+TEST(LogStoreTests, TruncateWaitsForReaders)
+{
+    LogStore store;
+    for (size_t i = 0; i < 10; ++i)
+    {
+        append(store, "log " + std::to_string(i));
+    }
+
+    // A reader which started before the truncation holds it up
+    std::unique_ptr<LogStore::ReadGuard> guard(new LogStore::ReadGuard(store));
+    auto truncated = std::async(std::launch::async, [&store] { store.truncate(5); });
+    EXPECT_EQ(std::future_status::timeout, truncated.wait_for(std::chrono::milliseconds(50)));
+
+    guard.reset();
+    truncated.get();
+
+    EXPECT_EQ(5u, store.first());
+    EXPECT_EQ(nullptr, store.find(4));
+    ASSERT_NE(nullptr, store.find(5));
+    EXPECT_EQ("log 5", store.find(5)->m_data);
+
+    std::vector<size_t> visited;
+    store.visit(0, [&visited](size_t id, const LogEntry&) {
+        visited.push_back(id);
+        return true;
+    });
+    EXPECT_EQ((std::vector<size_t>{5, 6, 7, 8, 9}), visited);
+
+    // Only published logs are truncated
+    store.truncate(100);
+    EXPECT_EQ(10u, store.first());
+    EXPECT_EQ(10u, append(store, "log 10"));
+}
+
+TEST(LogStoreTests, PinnedPayloadsOutliveTruncation)
+{
+    LogStore store;
+    auto generation = LogStore::GENERATION_CHUNKS * LogStore::CHUNK_SIZE;
+    for (size_t i = 0; i <= generation; ++i)
+    {
+        append(store, "log " + std::to_string(i));
+    }
+
+    // A batch in flight writes the payload straight from its arena
+    std::shared_ptr<const void> pin;
+    boost::string_view payload;
+    {
+        LogStore::ReadGuard guard(store);
+        pin = LogStore::pin(store.arena(7));
+        payload = store.find(7)->m_data;
+    }
+
+    store.truncate(generation);
+    EXPECT_EQ(nullptr, store.find(7));
+    EXPECT_EQ(1u, store.arena_stats().m_payloads);
+    EXPECT_EQ("log 7", payload);
+    pin.reset();
+}
@@ -0,0 +1,89 @@
+#include "gtest/gtest.h"
+
+#include <string>
+#include <thread>
+
+#include "logger.h"
+
+namespace
+{
+size_t
+count(const std::string& text, const std::string& what)
+{
+    size_t n = 0;
+    for (auto pos = text.find(what); pos != std::string::npos; pos = text.find(what, pos + 1))
+    {
+        ++n;
+    }
+    return n;
+}
+}  // namespace
+
+TEST(LoggerTests, Levels)
+{
+    logger::Level l;
+    ASSERT_TRUE(logger::parse_level("warn", l));
+    EXPECT_EQ(logger::warn, l);
+    EXPECT_FALSE(logger::parse_level("loud", l));
+    EXPECT_STREQ("trace", logger::level_name(logger::trace));
+
+    logger::set_level(logger::warn);
+    EXPECT_FALSE(logger::enabled(logger::info));
+    EXPECT_TRUE(logger::enabled(logger::error));
+    logger::set_level(logger::info);
+
+    logger::set_sample(3);
+    int sampled = 0;
+    for (int i = 0; i < 9; ++i)
+    {
+        sampled += logger::sampled();
+    }
+    EXPECT_EQ(3, sampled);
+    logger::set_sample(0);
+    EXPECT_EQ(1u, logger::sample());
+}
+
+TEST(LoggerTests, LinesAreWrittenInOrder)
+{
+    testing::internal::CaptureStdout();
+    logger::start();
+
+    logger::Line(logger::info) << "ordered " << 1 << ' ' << -42 << ' '
+                               << uint64_t(18446744073709551615u) << ' ' << 0.5;
+    std::thread([] { logger::Line(logger::info) << "ordered " << 2u; }).join();
+    logger::Line(logger::info) << "ordered " << std::string(300, 'x');
+
+    logger::stop();
+    auto out = testing::internal::GetCapturedStdout();
+
+    auto first = out.find("ordered 1 -42 18446744073709551615 0.5\n");
+    auto second = out.find("ordered 2\n");
+    auto third = out.find("ordered " + std::string(logger::Line::CAPACITY - 11, 'x') + "...\n");
+    ASSERT_NE(std::string::npos, first);
+    ASSERT_NE(std::string::npos, second);
+    ASSERT_NE(std::string::npos, third);
+    EXPECT_LT(first, second);
+    EXPECT_LT(second, third);
+}
+
+TEST(LoggerTests, FullRingDropsLines)
+{
+    // Nothing drains the ring while the writer thread is stopped
+    auto dropped = logger::dropped();
+    std::thread([] {
+        for (int i = 0; i < 1100; ++i)
+        {
+            logger::Line(logger::info) << "queued " << i;
+        }
+    }).join();
+    EXPECT_EQ(dropped + 1100 - 1024, logger::dropped());
+
+    // The ring outlives its thread, the queued lines are written out
+    testing::internal::CaptureStdout();
+    logger::start();
+    logger::stop();
+    auto out = testing::internal::GetCapturedStdout();
+    EXPECT_EQ(1024u, count(out, "queued "));
+    EXPECT_NE(std::string::npos, out.find("queued 1023\n"));
+    EXPECT_EQ(std::string::npos, out.find("queued 1024\n"));
+}
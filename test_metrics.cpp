@@ -0,0 +1,82 @@
+#include "gtest/gtest.h"
+
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "metrics.h"
+
+using namespace std::chrono;
+
+TEST(MetricsTests, HistogramBuckets)
+{
+    metrics::Histogram h;
+    h.observe(microseconds(30));
+    h.observe(microseconds(100));  // bounds are inclusive
+    h.observe(microseconds(101));
+    h.observe(seconds(20));
+    h.observe(nanoseconds(-5));
+
+    auto s = h.snapshot();
+    EXPECT_EQ(5u, s.m_count);
+    EXPECT_EQ(30u + 100 + 101 + 20000000, s.m_sum_us);
+    EXPECT_EQ(2u, s.m_buckets[0]);
+    EXPECT_EQ(1u, s.m_buckets[1]);
+    EXPECT_EQ(1u, s.m_buckets[2]);
+    EXPECT_EQ(1u, s.m_buckets[metrics::Histogram::BUCKETS - 1]);
+}
+
+TEST(MetricsTests, ShardsAreMerged)
+{
+    metrics::Histogram h;
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 20; ++t)
+    {
+        threads.emplace_back([&h] {
+            for (int i = 0; i < 1000; ++i)
+            {
+                h.observe(milliseconds(3));
+            }
+        });
+    }
+    for (auto& t : threads)
+    {
+        t.join();
+    }
+
+    auto s = h.snapshot();
+    EXPECT_EQ(20000u, s.m_count);
+    EXPECT_EQ(20000u * 3000, s.m_sum_us);
+    EXPECT_EQ(20000u, s.m_buckets[6]);
+}
+
+TEST(MetricsTests, HistogramText)
+{
+    metrics::Histogram h;
+    h.observe(microseconds(30));
+    h.observe(milliseconds(3));
+    h.observe(seconds(20));
+
+    metrics::Writer w;
+    w.family("replico_latency_seconds", "histogram", "Request latency");
+    w.histogram("replico_latency_seconds", "op=\"addlog\"", h);
+    w.sample("replico_logs", "", 7);
+    auto& text = w.str();
+
+    EXPECT_EQ(0u, text.find("# HELP replico_latency_seconds Request latency\n"
+                            "# TYPE replico_latency_seconds histogram\n"
+                            "replico_latency_seconds_bucket{op=\"addlog\",le=\"5e-05\"} 1\n"
+                            "replico_latency_seconds_bucket{op=\"addlog\",le=\"0.0001\"} 1\n"));
+
+    // Buckets are cumulative
+    EXPECT_NE(std::string::npos,
+              text.find("replico_latency_seconds_bucket{op=\"addlog\",le=\"0.0025\"} 1\n"
+                        "replico_latency_seconds_bucket{op=\"addlog\",le=\"0.005\"} 2\n"));
+    EXPECT_NE(std::string::npos,
+              text.find("replico_latency_seconds_bucket{op=\"addlog\",le=\"10\"} 2\n"
+                        "replico_latency_seconds_bucket{op=\"addlog\",le=\"+Inf\"} 3\n"
+                        "replico_latency_seconds_sum{op=\"addlog\"} 20.00303\n"
+                        "replico_latency_seconds_count{op=\"addlog\"} 3\n"
+                        "replico_logs 7\n"));
+}
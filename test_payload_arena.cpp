@@ -0,0 +1,98 @@
+#include "gtest/gtest.h"
+
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "payload_arena.h"
+
+TEST(PayloadArenaTests, CopiesIntoBlocks)
+{
+    PayloadArena arena(1024);
+    std::string text = "first payload";
+    auto first = arena.copy(text);
+    auto second = arena.copy("second");
+
+    // Copied, not referenced, and bump allocated one after another
+    text.assign(text.size(), 'x');
+    EXPECT_EQ("first payload", first);
+    EXPECT_EQ("second", second);
+    EXPECT_EQ(first.data() + first.size(), second.data());
+
+    auto s = arena.stats();
+    EXPECT_EQ(1u, s.m_blocks);
+    EXPECT_EQ(2u, s.m_payloads);
+    EXPECT_EQ(first.size() + second.size(), s.m_payload_bytes);
+    EXPECT_GT(s.m_reserved_bytes, 1024u);
+
+    // Empty payloads take no memory
+    EXPECT_TRUE(arena.copy("").empty());
+    EXPECT_EQ(2u, arena.stats().m_payloads);
+}
+
+TEST(PayloadArenaTests, FullBlockAndBigPayloads)
+{
+    PayloadArena arena(1024);
+    std::string small(200, 's');
+    for (int i = 0; i < 5; ++i)
+    {
+        arena.copy(small);
+    }
+    EXPECT_EQ(1u, arena.stats().m_blocks);
+
+    // The sixth one does not fit, a new block is started
+    auto sixth = arena.copy(small);
+    EXPECT_EQ(2u, arena.stats().m_blocks);
+    EXPECT_EQ(small, sixth);
+
+    // More than a quarter of a block gets a block of its own and leaves
+    // the current one be
+    std::string big(300, 'b');
+    EXPECT_EQ(big, arena.copy(big));
+    EXPECT_EQ(3u, arena.stats().m_blocks);
+    auto seventh = arena.copy(small);
+    EXPECT_EQ(sixth.data() + sixth.size(), seventh.data());
+}
+
+TEST(PayloadArenaTests, ConcurrentCopies)
+{
+    PayloadArena arena(4096);
+    const int threads = 4;
+    const int copies = 1000;
+    std::vector<std::vector<boost::string_view>> stored(threads);
+    std::vector<std::thread> writers;
+    for (int t = 0; t < threads; ++t)
+    {
+        writers.emplace_back([&arena, &stored, t] {
+            for (int i = 0; i < copies; ++i)
+            {
+                stored[t].push_back(arena.copy(std::to_string(t) + ":" + std::to_string(i)));
+            }
+        });
+    }
+    for (auto& w : writers)
+    {
+        w.join();
+    }
+
+    for (int t = 0; t < threads; ++t)
+    {
+        for (int i = 0; i < copies; ++i)
+        {
+            EXPECT_EQ(std::to_string(t) + ":" + std::to_string(i), stored[t][i]);
+        }
+    }
+    EXPECT_EQ(size_t(threads * copies), arena.stats().m_payloads);
+}
+
+TEST(PayloadArenaTests, ReferenceCount)
+{
+    auto arena = new PayloadArena(1024);
+    auto payload = arena->copy("kept");
+
+    // A reader holds it after the owner let go
+    arena->retain();
+    arena->release();
+    EXPECT_EQ("kept", payload);
+    arena->release();
+}
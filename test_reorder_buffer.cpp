@@ -0,0 +1,70 @@
+#include "gtest/gtest.h"
+
+#include <string>
+#include <vector>
+
+#include "reorder_buffer.h"
+
+TEST(ReorderBufferTests, WindowRoundsUp)
+{
+    EXPECT_EQ(1u, ReorderBuffer(1).window());
+    EXPECT_EQ(8u, ReorderBuffer(5).window());
+    EXPECT_EQ(64u, ReorderBuffer(64).window());
+}
+
+TEST(ReorderBufferTests, Wraparound)
+{
+    ReorderBuffer buffer(4);
+    std::vector<std::string> logs = {"a", "b", "c", "d", "e", "f", "g", "h", "i", "j"};
+
+    // Logs 2..4 arrive while 1 is missing, 4 shares the slot of 0
+    for (size_t id = 2; id < 5; ++id)
+    {
+        buffer.put(id, logs[id]);
+    }
+    EXPECT_EQ(3u, buffer.size());
+    EXPECT_FALSE(buffer.has(0));
+    EXPECT_FALSE(buffer.has(1));
+    EXPECT_TRUE(buffer.has(4));
+    EXPECT_FALSE(buffer.has(8));
+
+    buffer.put(1, logs[1]);
+    for (size_t id = 1; id < 5; ++id)
+    {
+        ASSERT_TRUE(buffer.has(id));
+        auto slot = buffer.take(id);
+        EXPECT_TRUE(slot.m_full);
+        EXPECT_EQ(id, slot.m_id);
+        EXPECT_EQ(logs[id], slot.m_log);
+        EXPECT_FALSE(buffer.has(id));
+    }
+    EXPECT_EQ(0u, buffer.size());
+
+    // The slots are reused by the ids a window later
+    buffer.put(9, logs[9]);
+    EXPECT_TRUE(buffer.has(9));
+    EXPECT_FALSE(buffer.has(1));
+    EXPECT_EQ("j", buffer.take(9).m_log);
+}
+
+TEST(ReorderBufferTests, DuplicateWaitsChain)
+{
+    ReorderBuffer buffer(8);
+    buffer.put(3, "x");
+
+    // The log was sent in three frames, each one is answered
+    std::vector<int> answered;
+    buffer.wait(3, [&answered](bool durable) { answered.push_back(durable ? 1 : -1); });
+    buffer.wait(3, [&answered](bool durable) { answered.push_back(durable ? 2 : -2); });
+    buffer.wait(3, [&answered](bool durable) { answered.push_back(durable ? 3 : -3); });
+    EXPECT_TRUE(answered.empty());
+
+    auto slot = buffer.take(3);
+    ASSERT_TRUE(slot.m_on_durable);
+    slot.m_on_durable(false);
+    EXPECT_EQ((std::vector<int>{-1, -2, -3}), answered);
+
+    // The emptied slot holds no waiter for the next id using it
+    buffer.put(11, "y");
+    EXPECT_FALSE(buffer.take(11).m_on_durable);
+}
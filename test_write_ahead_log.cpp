@@ -0,0 +1,449 @@
+#include "gtest/gtest.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "write_ahead_log.h"
+
+namespace
+{
+// 8 byte header + 12 byte meta + 10 byte log
+const size_t RECORD_SIZE = 30;
+
+std::string
+log_of(uint64_t id)
+{
+    char log[16];
+    std::snprintf(log, sizeof(log), "log-%06llu", static_cast<unsigned long long>(id));
+    return log;
+}
+
+// Fresh directory under /tmp, removed with its files at the end of the test
+class TempDir
+{
+public:
+    TempDir()
+    {
+        char path[] = "/tmp/replico-wal-XXXXXX";
+        m_path = ::mkdtemp(path);
+    }
+
+    ~TempDir()
+    {
+        for (auto& name : files())
+        {
+            ::unlink((m_path + "/" + name).c_str());
+        }
+        ::rmdir(m_path.c_str());
+    }
+
+    const std::string&
+    path() const
+    {
+        return m_path;
+    }
+
+    std::vector<std::string>
+    files() const
+    {
+        std::vector<std::string> names;
+        auto dir = ::opendir(m_path.c_str());
+        while (auto e = ::readdir(dir))
+        {
+            std::string name = e->d_name;
+            if (name != "." && name != "..")
+            {
+                names.push_back(name);
+            }
+        }
+        ::closedir(dir);
+        std::sort(names.begin(), names.end());
+        return names;
+    }
+
+    std::vector<std::string>
+    segments() const
+    {
+        std::vector<std::string> wal;
+        for (auto& name : files())
+        {
+            if (name.size() > 4 && name.compare(name.size() - 4, 4, ".wal") == 0)
+            {
+                wal.push_back(m_path + "/" + name);
+            }
+        }
+        return wal;
+    }
+
+private:
+    std::string m_path;
+};
+
+// Appends logs [first, last) and waits for all of them to be written
+void
+write_logs(const std::string& dir, size_t segment_bytes, uint64_t first, uint64_t last)
+{
+    WriteAheadLog wal(dir, segment_bytes, WriteAheadLog::Durability::batch);
+    std::vector<std::shared_ptr<SealedSegment>> sealed;
+    ASSERT_TRUE(wal.open(sealed, [](uint64_t, uint32_t, boost::string_view) {}));
+
+    for (auto id = first; id < last; ++id)
+    {
+        wal.append(id, 2, log_of(id), nullptr);
+    }
+    // The destructor writes what is still pending
+}
+
+struct Recovered
+{
+    std::vector<std::shared_ptr<SealedSegment>> m_sealed;
+    std::map<uint64_t, std::string> m_active;
+};
+
+Recovered
+recover(const std::string& dir, size_t segment_bytes)
+{
+    Recovered r;
+    WriteAheadLog wal(dir, segment_bytes, WriteAheadLog::Durability::batch);
+    EXPECT_TRUE(wal.open(r.m_sealed, [&r](uint64_t id, uint32_t wc, boost::string_view log) {
+        EXPECT_EQ(2u, wc);
+        r.m_active[id] = log.to_string();
+    }));
+    return r;
+}
+
+void
+corrupt(const std::string& path, off_t offset)
+{
+    int fd = ::open(path.c_str(), O_RDWR);
+    ASSERT_GE(fd, 0);
+    char c = 0;
+    ASSERT_EQ(1, ::pread(fd, &c, 1, offset));
+    c ^= 0x55;
+    ASSERT_EQ(1, ::pwrite(fd, &c, 1, offset));
+    ::close(fd);
+}
+}  // namespace
+
+TEST(WriteAheadLogTests, RecoversAllRecords)
+{
+    TempDir dir;
+    write_logs(dir.path(), 1 << 20, 0, 100);
+
+    auto r = recover(dir.path(), 1 << 20);
+    EXPECT_TRUE(r.m_sealed.empty());
+    ASSERT_EQ(100u, r.m_active.size());
+    EXPECT_EQ(0u, r.m_active.begin()->first);
+    EXPECT_EQ(log_of(99), r.m_active.rbegin()->second);
+}
+
+TEST(WriteAheadLogTests, DurableHandlerCalled)
+{
+    TempDir dir;
+    size_t durable = 0;
+    uint64_t synced = 0;
+    {
+        WriteAheadLog wal(dir.path(), 1 << 20, WriteAheadLog::Durability::entry);
+        wal.on_synced([&synced](uint64_t id) { synced = id; });
+        std::vector<std::shared_ptr<SealedSegment>> sealed;
+        ASSERT_TRUE(wal.open(sealed, [](uint64_t, uint32_t, boost::string_view) {}));
+        for (uint64_t id = 0; id < 10; ++id)
+        {
+            wal.append(id, 2, log_of(id), [&durable](bool ok) { durable += ok; });
+        }
+    }
+    EXPECT_EQ(10u, durable);
+    EXPECT_EQ(9u, synced);
+}
+
+TEST(WriteAheadLogTests, FailedSyncIsNotRetried)
+{
+    TempDir dir;
+    std::atomic<bool> fail_sync(true);
+    std::atomic<size_t> answered(0);
+    size_t durable = 0;
+    bool synced = false;
+    {
+        WriteAheadLog wal(dir.path(), 1 << 20, WriteAheadLog::Durability::batch);
+        wal.sync_with([&fail_sync](int fd) {
+            if (fail_sync)
+            {
+                errno = EIO;
+                return -1;
+            }
+            return ::fdatasync(fd);
+        });
+        wal.on_synced([&synced](uint64_t) { synced = true; });
+        std::vector<std::shared_ptr<SealedSegment>> sealed;
+        ASSERT_TRUE(wal.open(sealed, [](uint64_t, uint32_t, boost::string_view) {}));
+
+        auto handler = [&durable, &answered](bool ok) {
+            durable += ok;
+            ++answered;
+        };
+        for (uint64_t id = 0; id < 10; ++id)
+        {
+            wal.append(id, 2, log_of(id), handler);
+        }
+        while (answered < 10)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+
+        // The disk seems fine again, but the pages of the failed
+        // sync may be gone: neither old nor new records are durable
+        fail_sync = false;
+        for (uint64_t id = 10; id < 20; ++id)
+        {
+            wal.append(id, 2, log_of(id), handler);
+        }
+    }
+    EXPECT_EQ(20u, answered);
+    EXPECT_EQ(0u, durable);
+    EXPECT_FALSE(synced);
+}
+
+TEST(WriteAheadLogTests, TornTailIsDropped)
+{
+    TempDir dir;
+    write_logs(dir.path(), 1 << 20, 0, 10);
+
+    // The last record was cut in the middle of its log
+    auto segments = dir.segments();
+    ASSERT_EQ(1u, segments.size());
+    ASSERT_EQ(0, ::truncate(segments[0].c_str(), 10 * RECORD_SIZE - 3));
+
+    auto r = recover(dir.path(), 1 << 20);
+    ASSERT_EQ(9u, r.m_active.size());
+    EXPECT_EQ(8u, r.m_active.rbegin()->first);
+}
+
+TEST(WriteAheadLogTests, ChecksumMismatchEndsRecovery)
+{
+    TempDir dir;
+    write_logs(dir.path(), 1 << 20, 0, 10);
+
+    // A byte of the log of record 3 flipped, the records after it are not trusted
+    auto segments = dir.segments();
+    ASSERT_EQ(1u, segments.size());
+    corrupt(segments[0], 3 * RECORD_SIZE + RECORD_SIZE - 1);
+
+    auto r = recover(dir.path(), 1 << 20);
+    ASSERT_EQ(3u, r.m_active.size());
+    EXPECT_EQ(2u, r.m_active.rbegin()->first);
+}
+
+TEST(WriteAheadLogTests, AppendsAfterRecoveredTail)
+{
+    TempDir dir;
+    write_logs(dir.path(), 1 << 20, 0, 10);
+    ASSERT_EQ(0, ::truncate(dir.segments()[0].c_str(), 10 * RECORD_SIZE - 3));
+
+    // The new records overwrite the torn one
+    {
+        WriteAheadLog wal(dir.path(), 1 << 20, WriteAheadLog::Durability::batch);
+        std::vector<std::shared_ptr<SealedSegment>> sealed;
+        ASSERT_TRUE(wal.open(sealed, [](uint64_t, uint32_t, boost::string_view) {}));
+        for (uint64_t id = 9; id < 20; ++id)
+        {
+            wal.append(id, 2, log_of(id), nullptr);
+        }
+    }
+
+    auto r = recover(dir.path(), 1 << 20);
+    ASSERT_EQ(20u, r.m_active.size());
+    EXPECT_EQ(log_of(9), r.m_active[9]);
+    EXPECT_EQ(log_of(19), r.m_active[19]);
+}
+
+TEST(WriteAheadLogTests, SegmentRoll)
+{
+    TempDir dir;
+    // Eight records per segment
+    write_logs(dir.path(), 8 * RECORD_SIZE, 0, 100);
+
+    auto r = recover(dir.path(), 8 * RECORD_SIZE);
+    ASSERT_EQ(12u, r.m_sealed.size());
+    for (size_t i = 0; i < r.m_sealed.size(); ++i)
+    {
+        EXPECT_EQ(i * 8, r.m_sealed[i]->first_id());
+        EXPECT_EQ(8u, r.m_sealed[i]->count());
+    }
+
+    // The active segment holds the rest
+    ASSERT_EQ(4u, r.m_active.size());
+    EXPECT_EQ(96u, r.m_active.begin()->first);
+}
+
+TEST(WriteAheadLogTests, GapStartsNewSegment)
+{
+    TempDir dir;
+    write_logs(dir.path(), 1 << 20, 0, 10);
+    // The log continues after a snapshot
+    write_logs(dir.path(), 1 << 20, 50, 60);
+
+    auto r = recover(dir.path(), 1 << 20);
+    ASSERT_EQ(1u, r.m_sealed.size());
+    EXPECT_EQ(0u, r.m_sealed[0]->first_id());
+    EXPECT_EQ(10u, r.m_sealed[0]->count());
+    ASSERT_EQ(10u, r.m_active.size());
+    EXPECT_EQ(50u, r.m_active.begin()->first);
+}
+
+TEST(WriteAheadLogTests, SnapshotThenCompact)
+{
+    TempDir dir;
+    write_logs(dir.path(), 8 * RECORD_SIZE, 0, 100);
+
+    {
+        WriteAheadLog wal(dir.path(), 8 * RECORD_SIZE, WriteAheadLog::Durability::batch);
+        EXPECT_EQ(0u, wal.load_snapshot());
+
+        // Segments 0..31 go, 32..39 still holds logs 35.. and stays
+        bool done = false;
+        ASSERT_TRUE(wal.compact(35, done));
+        EXPECT_FALSE(done);
+        EXPECT_EQ(9u, dir.segments().size());
+    }
+
+    WriteAheadLog wal(dir.path(), 8 * RECORD_SIZE, WriteAheadLog::Durability::batch);
+    EXPECT_EQ(35u, wal.load_snapshot());
+
+    std::vector<std::shared_ptr<SealedSegment>> sealed;
+    ASSERT_TRUE(wal.open(sealed, [](uint64_t, uint32_t, boost::string_view) {}));
+    ASSERT_EQ(8u, sealed.size());
+    EXPECT_EQ(32u, sealed.front()->first_id());
+
+    // Compacting on a segment boundary removes everything below it
+    bool done = false;
+    ASSERT_TRUE(wal.compact(48, done));
+    EXPECT_TRUE(done);
+    auto segments = dir.segments();
+    ASSERT_EQ(7u, segments.size());
+    EXPECT_EQ(dir.path() + "/" + segment_format::file_name(48, "wal"), segments.front());
+}
+
+TEST(WriteAheadLogTests, CorruptSnapshotIsIgnored)
+{
+    TempDir dir;
+    {
+        WriteAheadLog wal(dir.path(), 1 << 20, WriteAheadLog::Durability::batch);
+        std::vector<std::shared_ptr<SealedSegment>> sealed;
+        ASSERT_TRUE(wal.open(sealed, [](uint64_t, uint32_t, boost::string_view) {}));
+        bool done = false;
+        ASSERT_TRUE(wal.compact(7, done));
+    }
+    corrupt(dir.path() + "/snapshot", 6);
+
+    WriteAheadLog wal(dir.path(), 1 << 20, WriteAheadLog::Durability::batch);
+    EXPECT_EQ(0u, wal.load_snapshot());
+}
+
+TEST(SealedSegmentTests, IndexLookup)
+{
+    TempDir dir;
+    // 200 records in the first segment, more than three index strides
+    write_logs(dir.path(), 200 * RECORD_SIZE, 1000, 1210);
+
+    auto segments = dir.segments();
+    ASSERT_EQ(2u, segments.size());
+
+    auto check = [](const SealedSegment& s) {
+        EXPECT_EQ(1000u, s.first_id());
+        EXPECT_EQ(200u, s.count());
+
+        for (uint64_t id : {1000, 1001, 1063, 1064, 1065, 1128, 1199})
+        {
+            std::vector<uint64_t> seen;
+            s.visit(id, [&seen](const segment_format::Record& r) {
+                seen.push_back(r.m_id);
+                EXPECT_EQ(log_of(r.m_id), r.m_log.to_string());
+                return seen.size() < 3;
+            });
+            ASSERT_FALSE(seen.empty()) << id;
+            EXPECT_EQ(id, seen.front());
+            EXPECT_EQ(std::min<size_t>(3, 1200 - id), seen.size());
+            EXPECT_EQ(id + seen.size() - 1, seen.back());
+        }
+
+        // Outside the segment nothing is visited
+        size_t calls = 0;
+        auto count = [&calls](const segment_format::Record&) {
+            ++calls;
+            return true;
+        };
+        s.visit(999, count);
+        s.visit(1200, count);
+        EXPECT_EQ(0u, calls);
+    };
+
+    // With the index written when the segment was sealed
+    auto indexed = SealedSegment::open(segments[0]);
+    ASSERT_TRUE(indexed);
+    check(*indexed);
+
+    // And with the index rebuilt by a scan
+    auto idx = segments[0].substr(0, segments[0].size() - 4) + ".idx";
+    ASSERT_EQ(0, ::unlink(idx.c_str()));
+    auto scanned = SealedSegment::open(segments[0]);
+    ASSERT_TRUE(scanned);
+    check(*scanned);
+
+    struct stat st;
+    EXPECT_EQ(0, ::stat(idx.c_str(), &st));
+}
+
+TEST(SealedSegmentTests, WrongIndexIsNotTrusted)
+{
+    TempDir dir;
+    write_logs(dir.path(), 200 * RECORD_SIZE, 1000, 1210);
+    auto path = dir.segments()[0];
+
+    std::vector<uint64_t> offsets;
+    for (uint64_t i = 0; i < 200; i += segment_format::INDEX_STRIDE)
+    {
+        offsets.push_back(i * RECORD_SIZE);
+    }
+
+    // An index of another segment of that name is rebuilt by a scan
+    ASSERT_TRUE(SealedSegment::write_index(path, 500, 200, 200 * RECORD_SIZE, offsets));
+    auto rebuilt = SealedSegment::open(path);
+    ASSERT_TRUE(rebuilt);
+    EXPECT_EQ(1000u, rebuilt->first_id());
+    EXPECT_EQ(200u, rebuilt->count());
+
+    // A wrong offset in the middle ends the lookup instead of serving other records
+    offsets[2] = offsets[1];
+    ASSERT_TRUE(SealedSegment::write_index(path, 1000, 200, 200 * RECORD_SIZE, offsets));
+    auto wrong = SealedSegment::open(path);
+    ASSERT_TRUE(wrong);
+
+    size_t calls = 0;
+    auto count = [&calls](const segment_format::Record&) {
+        ++calls;
+        return true;
+    };
+    wrong->visit(1130, count);
+    EXPECT_EQ(0u, calls);
+
+    // A short segment stops the walk to the record
+    offsets[2] = 199 * RECORD_SIZE;
+    offsets[1] = 199 * RECORD_SIZE;
+    ASSERT_TRUE(SealedSegment::write_index(path, 1000, 200, 200 * RECORD_SIZE, offsets));
+    auto short_data = SealedSegment::open(path);
+    ASSERT_TRUE(short_data);
+    short_data->visit(1070, count);
+    EXPECT_EQ(0u, calls);
+}